@@ -0,0 +1,504 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * The AT command channel. Commands are queued and each one goes on
+ * the wire as soon as the final result line of the one before it
+ * arrives. A bulk IN is always posted on the AT endpoint and what
+ * comes back is split into lines in place in the receive buffer, so
+ * a response is handed to its callback without being copied out.
+ * Unsolicited lines are picked out and passed on to urc.c.
+ *
+ * Functions:
+ *  o atchan_new() - Start reading the AT channel of a live dongle
+ *  o atchan_free() - Fail everything outstanding and tear it down
+ *  o atchan_send() - Queue a command with a completion callback
+*/
+
+#include <libusb-1.0/libusb.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compiler.h"
+#include "list.h"
+#include "nbio.h"
+#include "ondawagon.h"
+#include "tapif.h"
+#include "dongle.h"
+#include "pktpool.h"
+#include "usbio.h"
+#include "xport.h"
+#include "stats.h"
+#include "trace.h"
+
+#define ATCHAN_BUF	4096
+#define ATCHAN_CMD_MAX	512
+#define ATCHAN_IN_LEN	512
+/* how often the IN transfer comes back to check command timeouts */
+#define ATCHAN_TICK_MS	1000
+#define ATCHAN_TIMEOUT	10000000ULL
+/* IN errors in a row before we decide the endpoint is wedged */
+#define ATCHAN_ERRS	8
+
+struct atcmd {
+	struct list_head	c_list;
+	dongle_at_t		c_done;
+	void			*c_priv;
+	uint64_t		c_sent;
+	size_t			c_len;
+	char			c_cmd[];
+};
+
+struct atchan {
+	struct _dongle		*a_dongle;
+	struct usbio_req	*a_in;
+	struct usbio_req	*a_out;
+	struct list_head	a_queue;
+	struct atcmd		*a_cur;
+	int			a_in_busy;
+	int			a_out_busy;
+	int			a_dead;
+	unsigned int		a_errs;
+
+	/* a_buf[a_resp..a_scan) is the response so far to a_cur and
+	 * a_buf[a_scan..a_fill) a line we've not seen the end of
+	 */
+	size_t			a_resp;
+	size_t			a_scan;
+	size_t			a_fill;
+	char			a_buf[ATCHAN_BUF];
+};
+
+static const struct {
+	const char *str;
+	size_t len;
+	int prefix;
+	int result;
+}finals[] = {
+	{ "OK", 2, 0, DONGLE_AT_OK },
+	{ "CONNECT", 7, 1, DONGLE_AT_OK },
+	{ "ERROR", 5, 0, DONGLE_AT_ERROR },
+	{ "+CME ERROR:", 11, 1, DONGLE_AT_ERROR },
+	{ "+CMS ERROR:", 11, 1, DONGLE_AT_ERROR },
+	{ "NO CARRIER", 10, 0, DONGLE_AT_ERROR },
+	{ "NO DIALTONE", 11, 0, DONGLE_AT_ERROR },
+	{ "NO ANSWER", 9, 0, DONGLE_AT_ERROR },
+	{ "BUSY", 4, 0, DONGLE_AT_ERROR },
+};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Result code if this line ends a response, otherwise -1 */
+static int at_final(const char *line, size_t len)
+{
+	unsigned int i;
+
+	for(i = 0; i < sizeof(finals)/sizeof(*finals); i++) {
+		if ( len < finals[i].len )
+			continue;
+		if ( len > finals[i].len && !finals[i].prefix )
+			continue;
+		if ( !memcmp(line, finals[i].str, finals[i].len) )
+			return finals[i].result;
+	}
+
+	return -1;
+}
+
+static void atchan_kick(struct atchan *a);
+
+static void at_complete(struct atchan *a, int result,
+			const char *resp, size_t len)
+{
+	struct dongle_counters *ctr = &a->a_dongle->d_stats->s_ctr;
+	struct atcmd *c = a->a_cur;
+	uint64_t us;
+
+	a->a_cur = NULL;
+	list_del(&c->c_list);
+
+	us = (c->c_sent) ? now_us() - c->c_sent : 0;
+
+	ctr->at_cmds++;
+	if ( result != DONGLE_AT_OK )
+		ctr->at_fails++;
+	if ( result == DONGLE_AT_TIMEOUT )
+		ctr->at_timeouts++;
+	ctr->at_us += us;
+	if ( us > ctr->at_us_max )
+		ctr->at_us_max = us;
+
+	if ( odw_verbose ) {
+		printf("%s: %s: %.*s: %s in %"PRIu64" us\n",
+			odw_cmd, a->a_dongle->d_serial,
+			(int)c->c_len - 1, c->c_cmd,
+			(result == DONGLE_AT_OK) ? "ok" : "failed", us);
+	}
+
+	(*c->c_done)(c->c_priv, result, resp, len);
+	free(c);
+}
+
+/* One line, without its terminator, starting at a_buf + off */
+static void at_line(struct atchan *a, size_t off, size_t len, size_t next)
+{
+	const char *line = a->a_buf + off;
+	struct atcmd *c = a->a_cur;
+	int result;
+
+	if ( NULL == c ) {
+		/* nobody asked for it */
+		a->a_resp = next;
+		return;
+	}
+
+	/* command echo, unless it's been turned off */
+	if ( off == a->a_resp && len + 1 == c->c_len &&
+			!memcmp(line, c->c_cmd, len) ) {
+		a->a_resp = next;
+		return;
+	}
+
+	result = at_final(line, len);
+	if ( result < 0 )
+		return;
+
+	at_complete(a, result, a->a_buf + a->a_resp, off + len - a->a_resp);
+	a->a_resp = next;
+}
+
+/* Is the line what the command in flight asks for: AT+CSQ gets
+ * +CSQ: back, and AT^SYSINFO gets ^SYSINFO:
+ */
+static int at_solicited(const struct atcmd *c, const char *line, size_t len)
+{
+	const char *name = c->c_cmd + 2;
+	size_t n;
+
+	if ( c->c_len < 4 || (*name != '+' && *name != '^') )
+		return 0;
+
+	for(n = 1; name + n < c->c_cmd + c->c_len; n++) {
+		if ( strchr("=?;\r", name[n]) )
+			break;
+	}
+
+	return len > n && line[n] == ':' && !memcmp(line, name, n);
+}
+
+static int at_urc(struct atchan *a, size_t off, size_t len)
+{
+	const char *line = a->a_buf + off;
+
+	if ( a->a_cur && at_solicited(a->a_cur, line, len) )
+		return 0;
+
+	return urc_dispatch(a->a_dongle, line, len);
+}
+
+/* Split whatever we have in to lines, a line ends at \n and loses
+ * any \r from its end, blank ones are skipped. Unsolicited lines are
+ * cut out of the response they land in the middle of.
+ */
+static void at_parse(struct atchan *a)
+{
+	size_t i, start, end;
+
+	i = start = a->a_scan;
+	while ( i < a->a_fill ) {
+		if ( a->a_buf[i++] != '\n' )
+			continue;
+
+		for(end = i - 1; end > start && a->a_buf[end - 1] == '\r';
+				end--)
+			/* do nothing */;
+
+		if ( end != start )
+			trace_at_rx(a->a_dongle, a->a_buf + start, end - start);
+
+		if ( end == start ) {
+			if ( start == a->a_resp )
+				a->a_resp = i;
+		}else if ( at_urc(a, start, end - start) ) {
+			if ( start != a->a_resp ) {
+				memmove(a->a_buf + start, a->a_buf + i,
+					a->a_fill - i);
+				a->a_fill -= i - start;
+				i = start;
+				continue;
+			}
+			a->a_resp = i;
+		}else{
+			at_line(a, start, end - start, i);
+		}
+
+		start = i;
+	}
+
+	a->a_scan = start;
+}
+
+/* Append received bytes, making room by dropping what's been dealt
+ * with and, if it comes to it, the front of an oversized response
+ */
+static void at_recv(struct atchan *a, const uint8_t *buf, size_t len)
+{
+	if ( a->a_fill + len > sizeof(a->a_buf) ) {
+		memmove(a->a_buf, a->a_buf + a->a_resp,
+			a->a_fill - a->a_resp);
+		a->a_scan -= a->a_resp;
+		a->a_fill -= a->a_resp;
+		a->a_resp = 0;
+	}
+
+	if ( a->a_fill + len > sizeof(a->a_buf) ) {
+		a->a_fill -= a->a_scan;
+		memmove(a->a_buf, a->a_buf + a->a_scan, a->a_fill);
+		a->a_scan = 0;
+	}
+
+	if ( a->a_fill + len > sizeof(a->a_buf) ) {
+		/* a line longer than the buffer */
+		a->a_fill = 0;
+		a->a_scan = 0;
+	}
+
+	memcpy(a->a_buf + a->a_fill, buf, len);
+	a->a_fill += len;
+
+	at_parse(a);
+
+	if ( a->a_resp == a->a_fill )
+		a->a_resp = a->a_scan = a->a_fill = 0;
+}
+
+static void at_fail_all(struct atchan *a, int result)
+{
+	struct atcmd *c;
+
+	while ( !list_empty(&a->a_queue) ) {
+		c = list_entry(a->a_queue.next, struct atcmd, c_list);
+		a->a_cur = c;
+		at_complete(a, result, NULL, 0);
+	}
+}
+
+static void in_done(struct usbio_req *r);
+
+static void atchan_listen(struct atchan *a)
+{
+	struct _dongle *d = a->a_dongle;
+	int rc;
+
+	rc = usbio_bulk(a->a_in, d->d_xport, d->d_at_in_ep, ATCHAN_IN_LEN,
+			ATCHAN_TICK_MS, in_done, a);
+	if ( rc ) {
+		fprintf(stderr, "%s: %s: AT channel: %s\n", odw_cmd,
+			d->d_serial, libusb_error_name(rc));
+		a->a_dead = 1;
+		at_fail_all(a, DONGLE_AT_GONE);
+		return;
+	}
+
+	a->a_in_busy = 1;
+}
+
+static void in_done(struct usbio_req *r)
+{
+	struct atchan *a = r->r_priv;
+
+	a->a_in_busy = 0;
+	if ( a->a_dead )
+		return;
+
+	if ( r->r_len > 0 )
+		at_recv(a, usbio_req_data(r), r->r_len);
+
+	switch(r->r_err) {
+	case LIBUSB_ERROR_NO_DEVICE:
+	case LIBUSB_ERROR_INTERRUPTED:
+		a->a_dead = 1;
+		at_fail_all(a, DONGLE_AT_GONE);
+		return;
+	case LIBUSB_SUCCESS:
+	case LIBUSB_ERROR_TIMEOUT:
+		/* a quiet line is nothing to count */
+		a->a_errs = 0;
+		break;
+	default:
+		stats_usb_err(&a->a_dongle->d_stats->s_ctr, r->r_err);
+		if ( ++a->a_errs < ATCHAN_ERRS )
+			break;
+		/* stalled or overflowing every time, don't spin on it */
+		fprintf(stderr, "%s: %s: AT channel: %s, giving up\n",
+			odw_cmd, a->a_dongle->d_serial,
+			libusb_error_name(r->r_err));
+		a->a_dead = 1;
+		at_fail_all(a, DONGLE_AT_ERROR);
+		return;
+	}
+
+	if ( a->a_cur && a->a_cur->c_sent &&
+			now_us() - a->a_cur->c_sent >= ATCHAN_TIMEOUT ) {
+		at_complete(a, DONGLE_AT_TIMEOUT, NULL, 0);
+		a->a_resp = a->a_scan;
+	}
+
+	atchan_listen(a);
+	atchan_kick(a);
+}
+
+static void out_done(struct usbio_req *r)
+{
+	struct atchan *a = r->r_priv;
+
+	a->a_out_busy = 0;
+	if ( a->a_dead )
+		return;
+
+	if ( r->r_err )
+		stats_usb_err(&a->a_dongle->d_stats->s_ctr, r->r_err);
+
+	if ( r->r_err && a->a_cur ) {
+		fprintf(stderr, "%s: %s: AT channel: %s\n", odw_cmd,
+			a->a_dongle->d_serial, libusb_error_name(r->r_err));
+		at_complete(a, (r->r_err == LIBUSB_ERROR_NO_DEVICE) ?
+				DONGLE_AT_GONE : DONGLE_AT_ERROR, NULL, 0);
+	}
+
+	/* the response may have beaten us to it */
+	atchan_kick(a);
+}
+
+/* Put the next command on the wire if the last one has finished */
+static void atchan_kick(struct atchan *a)
+{
+	struct _dongle *d = a->a_dongle;
+	struct atcmd *c;
+	int rc;
+
+	while ( !a->a_dead && NULL == a->a_cur && !a->a_out_busy &&
+			!list_empty(&a->a_queue) ) {
+		c = list_entry(a->a_queue.next, struct atcmd, c_list);
+		a->a_cur = c;
+
+		trace_at_tx(d, c->c_cmd, c->c_len - 1);
+		memcpy(usbio_req_data(a->a_out), c->c_cmd, c->c_len);
+		rc = usbio_bulk(a->a_out, d->d_xport, d->d_at_out_ep,
+				c->c_len, 1000, out_done, a);
+		if ( rc ) {
+			at_complete(a, DONGLE_AT_ERROR, NULL, 0);
+			continue;
+		}
+
+		a->a_out_busy = 1;
+		a->a_resp = a->a_scan;
+		c->c_sent = now_us();
+	}
+}
+
+/* cmd is without its \r, the response passed to done includes the
+ * final result line and is only valid until it returns
+ */
+int atchan_send(struct atchan *a, const char *cmd,
+		dongle_at_t done, void *priv)
+{
+	size_t len = strlen(cmd);
+	struct atcmd *c;
+
+	if ( a->a_dead || len + 1 > ATCHAN_CMD_MAX )
+		return 0;
+
+	c = malloc(sizeof(*c) + len + 1);
+	if ( NULL == c )
+		return 0;
+
+	memcpy(c->c_cmd, cmd, len);
+	c->c_cmd[len] = '\r';
+	c->c_len = len + 1;
+	c->c_done = done;
+	c->c_priv = priv;
+	c->c_sent = 0;
+
+	list_add_tail(&c->c_list, &a->a_queue);
+	atchan_kick(a);
+	return 1;
+}
+
+struct atchan *atchan_new(struct _dongle *d)
+{
+	struct atchan *a;
+
+	a = calloc(1, sizeof(*a));
+	if ( NULL == a ) {
+		fprintf(stderr, "%s: calloc: %s\n", odw_cmd, os_err());
+		return NULL;
+	}
+
+	a->a_in = usbio_req_new(ATCHAN_IN_LEN);
+	a->a_out = usbio_req_new(ATCHAN_CMD_MAX);
+	if ( NULL == a->a_in || NULL == a->a_out ) {
+		fprintf(stderr, "%s: usbio_req_new: failed\n", odw_cmd);
+		goto err;
+	}
+
+	a->a_dongle = d;
+	INIT_LIST_HEAD(&a->a_queue);
+
+	atchan_listen(a);
+	if ( a->a_dead )
+		goto err;
+
+	return a;
+err:
+	usbio_req_free(a->a_in);
+	usbio_req_free(a->a_out);
+	free(a);
+	return NULL;
+}
+
+static int at_busy(void *priv)
+{
+	struct atchan *a = priv;
+
+	return a->a_in_busy || a->a_out_busy;
+}
+
+void atchan_free(struct atchan *a)
+{
+	struct xport *x;
+	int idle;
+
+	if ( NULL == a )
+		return;
+
+	x = a->a_dongle->d_xport;
+	a->a_dead = 1;
+	if ( a->a_in_busy )
+		usbio_cancel(a->a_in);
+	if ( a->a_out_busy )
+		usbio_cancel(a->a_out);
+
+	idle = usbio_drain(x, at_busy, a);
+
+	at_fail_all(a, DONGLE_AT_GONE);
+
+	/* in_done() and out_done() may yet run, leave them a channel */
+	if ( !idle )
+		return;
+
+	usbio_req_free(a->a_in);
+	usbio_req_free(a->a_out);
+	free(a);
+}
@@ -0,0 +1,751 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Datapath benchmark. One emulated dongle is brought up on a TAP just
+ * as --ifup would, and a load generator thread sits on the far side of
+ * the interface with an AF_PACKET socket. For each frame size:
+ *
+ *  o usb_to_tap: the emulator sources stamped frames as fast as --rate
+ *    allows, the generator receives them off the interface
+ *  o tap_to_usb: the generator sends stamped frames keeping --window of
+ *    them in flight, the emulator's sink hook receives them
+ *
+ * Throughput is what arrived during the measurement window, latency
+ * is one-way from stamp to arrival. Cycles (or failing that, CPU time)
+ * are for the eventloop thread only, that is the datapath plus the
+ * emulated modem, not the generator. Results go to stdout as JSON.
+ *
+ * Needs CAP_NET_ADMIN for the TAP, so as an unprivileged user run it
+ * in its own user and network namespace: unshare -rn ./odw-bench
+*/
+
+#define _GNU_SOURCE
+#include <libusb-1.0/libusb.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <linux/perf_event.h>
+
+#include "compiler.h"
+#include "list.h"
+#include "nbio.h"
+#include "ondawagon.h"
+#include "xport.h"
+
+#define BENCH_SERIAL	"EMU0000000"
+#define BENCH_IFNAME	"odwbench%d"
+#define BENCH_STAMP_OFF	(ETH_HLEN + sizeof(struct iphdr) + \
+				sizeof(struct udphdr))
+#define BENCH_SAMPLES	(1U << 21)
+#define BENCH_WARMUP	200	/* msecs */
+#define BENCH_DRAIN	100	/* msecs */
+#define BENCH_STALL	50000000ULL	/* nsecs */
+
+enum {
+	PATH_USB_TO_TAP,
+	PATH_TAP_TO_USB,
+};
+
+static const char * const path_names[] = {
+	[PATH_USB_TO_TAP] = "usb_to_tap",
+	[PATH_TAP_TO_USB] = "tap_to_usb",
+};
+
+/* set by the generator thread, watched by the eventloop */
+enum {
+	PHASE_WARMUP,
+	PHASE_MEASURE,
+	PHASE_DRAIN,
+	PHASE_DONE,
+};
+
+struct lat {
+	uint64_t		*v;
+	size_t			n;
+};
+
+struct cpu {
+	int			fd;
+	const char		*scope;
+	uint64_t		cycles;
+	uint64_t		ns;
+};
+
+struct bench {
+	struct iothread		t;
+	dongle_t		d;
+	int			sock;
+	int			ifindex;
+
+	unsigned int		duration;
+	unsigned int		window;
+	unsigned int		rate;
+
+	/* the run in progress */
+	unsigned int		path;
+	unsigned int		size;
+	int			phase;
+	uint64_t		sent;
+	uint64_t		sunk;
+	uint64_t		pkts;
+	uint64_t		lost;
+	uint64_t		elapsed;
+	struct lat		lat;
+
+	struct cpu		cpu;
+	unsigned int		nr_results;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void lat_add(struct lat *l, uint64_t ns)
+{
+	if ( l->n < BENCH_SAMPLES )
+		l->v[l->n++] = ns;
+}
+
+static int cmp_u64(const void *A, const void *B)
+{
+	const uint64_t *a = A, *b = B;
+	return (*a > *b) - (*a < *b);
+}
+
+static uint64_t lat_pct(struct lat *l, unsigned int per_mille)
+{
+	size_t i;
+
+	if ( !l->n )
+		return 0;
+
+	i = (l->n * per_mille + 999) / 1000;
+	return l->v[(i) ? i - 1 : 0];
+}
+
+/* Cycles for the calling thread, kernel included if we're allowed */
+static void cpu_open(struct cpu *c)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.exclude_hv = 1;
+
+	c->scope = "user+kernel";
+	c->fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if ( c->fd >= 0 )
+		return;
+
+	attr.exclude_kernel = 1;
+	c->scope = "user";
+	c->fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if ( c->fd >= 0 )
+		return;
+
+	c->scope = NULL;
+}
+
+static void cpu_sample(struct cpu *c, uint64_t *cycles, uint64_t *ns)
+{
+	struct timespec ts;
+
+	*cycles = 0;
+	if ( c->fd >= 0 && read(c->fd, cycles, sizeof(*cycles)) !=
+						sizeof(*cycles) )
+		*cycles = 0;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	*ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int get_phase(struct bench *b)
+{
+	return __atomic_load_n(&b->phase, __ATOMIC_ACQUIRE);
+}
+
+static void set_phase(struct bench *b, int phase)
+{
+	__atomic_store_n(&b->phase, phase, __ATOMIC_RELEASE);
+}
+
+/* Runs on the eventloop thread, from within the emulator */
+static void tx_sink(void *priv, const uint8_t *frame, size_t len)
+{
+	struct bench *b = priv;
+	struct xport_emu_stamp stamp;
+
+	if ( len < BENCH_STAMP_OFF + sizeof(stamp) )
+		return;
+
+	memcpy(&stamp, frame + BENCH_STAMP_OFF, sizeof(stamp));
+	if ( stamp.magic != XPORT_EMU_MAGIC )
+		return;
+
+	__atomic_store_n(&b->sunk, b->sunk + 1, __ATOMIC_RELEASE);
+	if ( get_phase(b) != PHASE_MEASURE )
+		return;
+
+	b->pkts++;
+	lat_add(&b->lat, now_ns() - stamp.ns);
+}
+
+static void frame_init(uint8_t *frame, unsigned int size)
+{
+	struct ethhdr *eth = (struct ethhdr *)frame;
+	struct iphdr *iph = (struct iphdr *)(eth + 1);
+	struct udphdr *udp = (struct udphdr *)(iph + 1);
+
+	memset(frame, 0, size);
+	memset(eth->h_dest, 0xff, ETH_ALEN);
+	eth->h_source[0] = 0x02;
+	eth->h_proto = htons(ETH_P_IP);
+
+	iph->version = 4;
+	iph->ihl = sizeof(*iph) / 4;
+	iph->tot_len = htons(size - ETH_HLEN);
+	iph->ttl = 64;
+	iph->protocol = IPPROTO_UDP;
+	iph->saddr = htonl(0x0a400002);
+	iph->daddr = htonl(0x0a400001);
+
+	udp->source = htons(9);
+	udp->dest = htons(9);
+	udp->len = htons(size - ETH_HLEN - sizeof(*iph));
+}
+
+static void gen_tx(struct bench *b, uint64_t end)
+{
+	struct xport_emu_stamp stamp;
+	uint8_t frame[ETH_FRAME_LEN];
+	uint64_t off = 0, last_sunk = 0, last_progress, now, sunk;
+
+	frame_init(frame, b->size);
+	stamp.magic = XPORT_EMU_MAGIC;
+	last_progress = now_ns();
+
+	while ( (now = now_ns()) < end ) {
+		if ( now >= end - b->duration * 1000000ULL &&
+				get_phase(b) == PHASE_WARMUP ) {
+			set_phase(b, PHASE_MEASURE);
+		}
+
+		sunk = __atomic_load_n(&b->sunk, __ATOMIC_ACQUIRE);
+		if ( sunk != last_sunk ) {
+			last_sunk = sunk;
+			last_progress = now;
+		}
+
+		if ( b->sent - off - sunk >= b->window ) {
+			/* frames dropped before the TAP never come back */
+			if ( now - last_progress > BENCH_STALL )
+				off = b->sent - sunk;
+			sched_yield();
+			continue;
+		}
+
+		stamp.seq = b->sent;
+		stamp.ns = now;
+		memcpy(frame + BENCH_STAMP_OFF, &stamp, sizeof(stamp));
+		if ( send(b->sock, frame, b->size, 0) < 0 ) {
+			sched_yield();
+			continue;
+		}
+		b->sent++;
+	}
+
+	set_phase(b, PHASE_DRAIN);
+
+	end = now_ns() + BENCH_DRAIN * 1000000ULL;
+	while ( now_ns() < end &&
+			__atomic_load_n(&b->sunk, __ATOMIC_ACQUIRE) < b->sent )
+		sched_yield();
+
+	b->lost = b->sent - __atomic_load_n(&b->sunk, __ATOMIC_ACQUIRE);
+}
+
+static void gen_rx(struct bench *b, uint64_t end)
+{
+	struct xport_emu_stamp stamp;
+	uint8_t frame[ETH_FRAME_LEN];
+	struct sockaddr_ll sll;
+	uint32_t first = 0, last = 0;
+	socklen_t slen;
+	uint64_t now;
+	ssize_t len;
+
+	while ( (now = now_ns()) < end ) {
+		if ( now >= end - b->duration * 1000000ULL &&
+				get_phase(b) == PHASE_WARMUP ) {
+			set_phase(b, PHASE_MEASURE);
+		}
+
+		slen = sizeof(sll);
+		len = recvfrom(b->sock, frame, sizeof(frame), 0,
+				(struct sockaddr *)&sll, &slen);
+		if ( len < (ssize_t)(BENCH_STAMP_OFF + sizeof(stamp)) )
+			continue;
+		if ( sll.sll_pkttype == PACKET_OUTGOING )
+			continue;
+
+		memcpy(&stamp, frame + BENCH_STAMP_OFF, sizeof(stamp));
+		if ( stamp.magic != XPORT_EMU_MAGIC )
+			continue;
+		if ( get_phase(b) != PHASE_MEASURE )
+			continue;
+
+		lat_add(&b->lat, now_ns() - stamp.ns);
+		if ( !b->pkts++ )
+			first = stamp.seq;
+		last = stamp.seq;
+	}
+
+	set_phase(b, PHASE_DRAIN);
+
+	/* whatever the source sent in the window that we didn't see */
+	if ( b->pkts )
+		b->lost = (uint32_t)(last - first) + 1 - b->pkts;
+}
+
+static void *gen_main(void *priv)
+{
+	struct bench *b = priv;
+	uint64_t start, end;
+
+	start = now_ns();
+	end = start + (BENCH_WARMUP + b->duration) * 1000000ULL;
+
+	if ( b->path == PATH_TAP_TO_USB ) {
+		gen_tx(b, end);
+	}else{
+		gen_rx(b, end);
+	}
+
+	b->elapsed = b->duration * 1000000ULL;
+	set_phase(b, PHASE_DONE);
+	return NULL;
+}
+
+static void pump_for(unsigned int msec)
+{
+	uint64_t end = now_ns() + msec * 1000000ULL;
+
+	while ( now_ns() < end )
+		dongle_loop_pump(1);
+}
+
+static void emit(struct bench *b, uint64_t cycles, uint64_t ns)
+{
+	double secs = b->elapsed / 1e9;
+	double pps = (secs > 0) ? b->pkts / secs : 0;
+
+	qsort(b->lat.v, b->lat.n, sizeof(*b->lat.v), cmp_u64);
+
+	printf("%s\n    {\"path\": \"%s\", \"frame_size\": %u, "
+		"\"packets\": %"PRIu64", \"lost\": %"PRIu64", ",
+		(b->nr_results++) ? "," : "",
+		path_names[b->path], b->size, b->pkts, b->lost);
+	printf("\"pps\": %.0f, \"mbit_s\": %.2f, ",
+		pps, pps * b->size * 8 / 1e6);
+	if ( b->cpu.scope && b->pkts ) {
+		printf("\"cycles_per_packet\": %.1f, ",
+			(double)cycles / b->pkts);
+	}else{
+		printf("\"cycles_per_packet\": null, ");
+	}
+	printf("\"cpu_ns_per_packet\": %.1f, ",
+		(b->pkts) ? (double)ns / b->pkts : 0.0);
+	printf("\"latency_ns\": {\"p50\": %"PRIu64", \"p99\": %"PRIu64
+		", \"p999\": %"PRIu64", \"max\": %"PRIu64"}}",
+		lat_pct(&b->lat, 500), lat_pct(&b->lat, 990),
+		lat_pct(&b->lat, 999),
+		(b->lat.n) ? b->lat.v[b->lat.n - 1] : 0);
+	fflush(stdout);
+}
+
+static int run(struct bench *b, unsigned int path, unsigned int size)
+{
+	uint64_t c0 = 0, n0 = 0, c1 = 0, n1 = 0;
+	pthread_t gen;
+	int measuring = 0, phase;
+
+	b->path = path;
+	b->size = size;
+	b->phase = PHASE_WARMUP;
+	b->sent = b->sunk = b->pkts = b->lost = 0;
+	b->lat.n = 0;
+
+	xport_emu_size(size);
+	if ( path == PATH_USB_TO_TAP ) {
+		xport_emu_rate(b->rate);
+	}else{
+		xport_emu_sink(tx_sink, b);
+	}
+
+	if ( pthread_create(&gen, NULL, gen_main, b) ) {
+		fprintf(stderr, "%s: pthread_create: %s\n",
+			odw_cmd, os_err());
+		return 0;
+	}
+
+	while ( (phase = get_phase(b)) != PHASE_DONE ) {
+		if ( phase == PHASE_MEASURE && !measuring ) {
+			cpu_sample(&b->cpu, &c0, &n0);
+			measuring = 1;
+		}else if ( phase >= PHASE_DRAIN && measuring == 1 ) {
+			cpu_sample(&b->cpu, &c1, &n1);
+			measuring = 2;
+		}
+		dongle_loop_pump(1);
+	}
+
+	pthread_join(gen, NULL);
+	if ( measuring == 1 )
+		cpu_sample(&b->cpu, &c1, &n1);
+
+	xport_emu_rate(0);
+	xport_emu_sink(NULL, NULL);
+
+	/* let the rest of the source's frames through before the next */
+	pump_for(BENCH_DRAIN);
+
+	emit(b, c1 - c0, n1 - n0);
+	return 1;
+}
+
+/* in a fresh netns nobody else will be sending router solicitations */
+static void no_ipv6(const char *ifname)
+{
+	char path[128];
+	FILE *f;
+
+	snprintf(path, sizeof(path),
+		"/proc/sys/net/ipv6/conf/%s/disable_ipv6", ifname);
+	f = fopen(path, "w");
+	if ( f ) {
+		fputs("1\n", f);
+		fclose(f);
+	}
+}
+
+static int link_up(struct bench *b, const char *ifname)
+{
+	struct timeval tv = { .tv_sec = 0, .tv_usec = 10000 };
+	struct sockaddr_ll sll;
+	struct ifreq ifr;
+	int fd, one = 1, sz = 4 << 20;
+
+	no_ipv6(ifname);
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if ( fd < 0 ) {
+		fprintf(stderr, "%s: socket: %s\n", odw_cmd, os_err());
+		return 0;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+	if ( ioctl(fd, SIOCGIFFLAGS, &ifr) < 0 )
+		goto err_ioctl;
+	ifr.ifr_flags |= IFF_UP;
+	if ( ioctl(fd, SIOCSIFFLAGS, &ifr) < 0 )
+		goto err_ioctl;
+	if ( ioctl(fd, SIOCGIFINDEX, &ifr) < 0 )
+		goto err_ioctl;
+	close(fd);
+	b->ifindex = ifr.ifr_ifindex;
+
+	b->sock = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if ( b->sock < 0 ) {
+		fprintf(stderr, "%s: packet socket: %s\n", odw_cmd, os_err());
+		return 0;
+	}
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = b->ifindex;
+	if ( bind(b->sock, (struct sockaddr *)&sll, sizeof(sll)) ) {
+		fprintf(stderr, "%s: bind: %s\n", odw_cmd, os_err());
+		close(b->sock);
+		return 0;
+	}
+
+	setsockopt(b->sock, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+	setsockopt(b->sock, SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz));
+	setsockopt(b->sock, SOL_PACKET, PACKET_IGNORE_OUTGOING,
+			&one, sizeof(one));
+
+	/* so the receiver can keep an eye on the clock */
+	setsockopt(b->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return 1;
+
+err_ioctl:
+	fprintf(stderr, "%s: %s: %s\n", odw_cmd, ifname, os_err());
+	close(fd);
+	return 0;
+}
+
+static int bringup(struct bench *b)
+{
+	char spec[32];
+
+	snprintf(spec, sizeof(spec), "1,size=%u", ETH_FRAME_LEN);
+	dongle_emulate(spec);
+	dongle_tap_name(BENCH_IFNAME);
+
+	if ( !nbio_init(&b->t, odw_eventloop) )
+		return 0;
+	nbio_busy_poll(&b->t, odw_busy_poll);
+	nbio_budget(&b->t, odw_weight, odw_budget);
+
+	if ( !dongle_loop_init(&b->t) )
+		goto err_fini;
+
+	b->d = dongle_open(BENCH_SERIAL);
+	if ( NULL == b->d ) {
+		fprintf(stderr, "%s: no emulated dongle\n", odw_cmd);
+		goto err_loop;
+	}
+
+	if ( !dongle_init(b->d) || !dongle_ifup(b->d, &b->t) ) {
+		fprintf(stderr, "%s: couldn't bring up %s, "
+			"try: unshare -rn %s\n", odw_cmd, BENCH_SERIAL,
+			odw_cmd);
+		goto err_close;
+	}
+
+	if ( !link_up(b, dongle_ifname(b->d)) )
+		goto err_down;
+
+	return 1;
+
+err_down:
+	dongle_ifdown(b->d);
+err_close:
+	dongle_close(b->d);
+err_loop:
+	dongle_loop_fini();
+err_fini:
+	nbio_fini(&b->t);
+	return 0;
+}
+
+static void teardown(struct bench *b)
+{
+	close(b->sock);
+	dongle_ifdown(b->d);
+	dongle_loop_fini();
+	nbio_fini(&b->t);
+	dongle_close(b->d);
+}
+
+static int parse_sizes(const char *str, unsigned int *sizes,
+			unsigned int max)
+{
+	unsigned int n = 0;
+	char *end;
+
+	while ( n < max ) {
+		sizes[n] = strtoul(str, &end, 0);
+		if ( end == str || !xport_emu_size(sizes[n]) )
+			return 0;
+		n++;
+		if ( *end != ',' )
+			break;
+		str = end + 1;
+	}
+
+	return (*end) ? 0 : n;
+}
+
+static void usage(FILE *f)
+{
+	fprintf(f, "%s: ondawagon datapath benchmark\n", odw_cmd);
+	fprintf(f, "\n");
+	fprintf(f, "Usage:\n");
+	fprintf(f, " --sizes <a,b,..>   Frame sizes "
+		"(default: 64,128,256,512,1024,1500)\n");
+	fprintf(f, " --duration <ms>    Measure each size and path "
+		"for this long (default: 1000)\n");
+	fprintf(f, " --rate <pps>       Offered load from the modem "
+		"(default: 1000000)\n");
+	fprintf(f, " --window <n>       Frames in flight towards the modem "
+		"(default: 256)\n");
+	fprintf(f, " --rx-depth <n>     Bulk IN transfers kept in flight\n");
+	fprintf(f, " --eventloop <name> epoll, poll or io_uring\n");
+	fprintf(f, " --busy-poll <us>   Spin this long before sleeping\n");
+	fprintf(f, " --weight <n>       Packets one fd handles before "
+		"yielding\n");
+	fprintf(f, " --budget <n>       Packets per eventloop iteration\n");
+	fprintf(f, " --help, -h         Display this massage\n");
+	fprintf(f, "\n");
+	fprintf(f, "Unprivileged: unshare -rn %s\n", odw_cmd);
+}
+
+const char *os_err(void)
+{
+	return strerror(errno);
+}
+
+const char *odw_cmd;
+const char *odw_eventloop;
+unsigned int odw_busy_poll;
+unsigned int odw_weight;
+unsigned int odw_budget;
+unsigned int odw_verbose;
+unsigned int odw_stats;
+int main(int argc, char **argv)
+{
+	unsigned int sizes[16] = {64, 128, 256, 512, 1024, 1500};
+	unsigned int nr_sizes = 6, i, path;
+	struct bench b;
+	int ret = EXIT_SUCCESS;
+
+	odw_cmd = (argc > 0) ? argv[0] : "odw-bench";
+
+	memset(&b, 0, sizeof(b));
+	b.sock = -1;
+	b.duration = 1000;
+	b.window = 256;
+	b.rate = 1000000;
+
+	for(i = 1; i < (unsigned int)argc; i++) {
+		if ( !strcmp(argv[i], "--sizes") && i + 1 < (unsigned)argc ) {
+			nr_sizes = parse_sizes(argv[++i], sizes,
+					sizeof(sizes) / sizeof(*sizes));
+			if ( !nr_sizes ) {
+				fprintf(stderr, "%s: bad --sizes: %s\n",
+					odw_cmd, argv[i]);
+				return EXIT_FAILURE;
+			}
+			continue;
+		}
+		if ( !strcmp(argv[i], "--duration") &&
+				i + 1 < (unsigned)argc ) {
+			b.duration = strtoul(argv[++i], NULL, 0);
+			continue;
+		}
+		if ( !strcmp(argv[i], "--rate") && i + 1 < (unsigned)argc ) {
+			b.rate = strtoul(argv[++i], NULL, 0);
+			continue;
+		}
+		if ( !strcmp(argv[i], "--window") &&
+				i + 1 < (unsigned)argc ) {
+			b.window = strtoul(argv[++i], NULL, 0);
+			continue;
+		}
+		if ( !strcmp(argv[i], "--rx-depth") &&
+				i + 1 < (unsigned)argc ) {
+			if ( !dongle_rx_depth(strtoul(argv[++i], NULL, 0)) ) {
+				fprintf(stderr, "%s: bad --rx-depth: %s\n",
+					odw_cmd, argv[i]);
+				return EXIT_FAILURE;
+			}
+			continue;
+		}
+		if ( !strcmp(argv[i], "--eventloop") &&
+				i + 1 < (unsigned)argc ) {
+			odw_eventloop = argv[++i];
+			continue;
+		}
+		if ( !strcmp(argv[i], "--busy-poll") &&
+				i + 1 < (unsigned)argc ) {
+			odw_busy_poll = strtoul(argv[++i], NULL, 0);
+			continue;
+		}
+		if ( !strcmp(argv[i], "--weight") &&
+				i + 1 < (unsigned)argc ) {
+			odw_weight = strtoul(argv[++i], NULL, 0);
+			continue;
+		}
+		if ( !strcmp(argv[i], "--budget") &&
+				i + 1 < (unsigned)argc ) {
+			odw_budget = strtoul(argv[++i], NULL, 0);
+			continue;
+		}
+		if ( !strcmp(argv[i], "--help") || !strcmp(argv[i], "-h") ) {
+			usage(stdout);
+			return EXIT_SUCCESS;
+		}
+		fprintf(stderr, "%s: Unrecognized option: %s\n",
+			odw_cmd, argv[i]);
+		usage(stderr);
+		return EXIT_FAILURE;
+	}
+
+	if ( !b.duration || !b.window ) {
+		fprintf(stderr, "%s: duration and window can't be zero\n",
+			odw_cmd);
+		return EXIT_FAILURE;
+	}
+
+	b.lat.v = malloc(BENCH_SAMPLES * sizeof(*b.lat.v));
+	if ( NULL == b.lat.v ) {
+		fprintf(stderr, "%s: malloc: %s\n", odw_cmd, os_err());
+		return EXIT_FAILURE;
+	}
+
+	if ( !bringup(&b) ) {
+		free(b.lat.v);
+		return EXIT_FAILURE;
+	}
+
+	cpu_open(&b.cpu);
+
+	printf("{\n  \"benchmark\": \"ondawagon-datapath\",\n");
+	printf("  \"eventloop\": \"%s\",\n", b.t.plugin->name);
+	printf("  \"duration_ms\": %u,\n", b.duration);
+	printf("  \"rate_pps\": %u,\n", b.rate);
+	printf("  \"window\": %u,\n", b.window);
+	printf("  \"link_us\": %"PRIu32",\n", dongle_link_us(b.d));
+	if ( b.cpu.scope ) {
+		printf("  \"cycles\": \"%s\",\n", b.cpu.scope);
+	}else{
+		printf("  \"cycles\": null,\n");
+	}
+	printf("  \"results\": [");
+
+	for(i = 0; i < nr_sizes; i++) {
+		for(path = PATH_USB_TO_TAP; path <= PATH_TAP_TO_USB; path++) {
+			if ( !run(&b, path, sizes[i]) ) {
+				ret = EXIT_FAILURE;
+				goto out;
+			}
+		}
+	}
+
+out:
+	printf("\n  ]\n}\n");
+
+	if ( b.cpu.fd >= 0 )
+		close(b.cpu.fd);
+	teardown(&b);
+
+	free(b.lat.v);
+	return ret;
+}
@@ -32,6 +32,7 @@
 #endif
 
 #if __GNUC__ > 2
+#define _cacheline __attribute__((aligned(64)))
 #define _nonull(x...) __attribute__((nonnull (x)))
 #define _constfn __attribute__((const))
 #define _malloc_nocheck __attribute__((malloc))
@@ -82,6 +83,10 @@
 #define _malloc_nocheck
 #endif
 
+#ifndef _cacheline
+#define _cacheline
+#endif
+
 #ifndef _constfn
 #define _constfn
 #endif
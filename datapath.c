@@ -0,0 +1,880 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Packet forwarding between the TAP interface and the data bulk
+ * endpoints of a live dongle. Frames read from the TAP are sent
+ * as one bulk OUT transfer each, and a ring of bulk IN transfers
+ * (--rx-depth) is kept in flight at all times whose completions are
+ * written back to the TAP in order and immediately resubmitted.
+ *
+ * The modem only speaks ethernet, so in TUN mode we pretend to be the
+ * host on the other end of the wire: headers are made up on the way
+ * out, stripped on the way in and the modem's ARPs answered for it.
+ * With a virtio header on the TAP the kernel leaves checksums and TCP
+ * segmentation to us, see offload.c.
+*/
+
+#include <libusb-1.0/libusb.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/if_ether.h>
+#include <linux/virtio_net.h>
+
+#include "compiler.h"
+#include "list.h"
+#include "nbio.h"
+#include "ondawagon.h"
+#include "tapif.h"
+#include "dongle.h"
+#include "pktpool.h"
+#include "usbio.h"
+#include "offload.h"
+#include "xport.h"
+#include "hist.h"
+#include "stats.h"
+#include "trace.h"
+
+#define DP_TX_MAX	16
+#define DP_RX_DEPTH	8
+#define DP_RX_DEPTH_MAX	64
+#define DP_TX_TIMEOUT	1000
+
+/* After this many bulk IN errors in a row, or any failed resubmit, the
+ * rest of the ring is parked and retried from a timer, backing off
+ * between the two limits (ms) until a frame comes through again
+ */
+#define DP_RX_ERRS	8
+#define DP_RETRY_MIN	10
+#define DP_RETRY_MAX	1000
+
+/* ethernet header plus an 802.1q tag */
+#define DP_HDR_LEN	18
+
+/* Largest super-packet the kernel will hand us and the most segments
+ * we expect to cut it in to
+ */
+#define DP_GSO_MAX	65536
+#define DP_GSO_SEGS	64
+
+/* minimum ethernet frame, what our ARP replies are padded to */
+#define DP_ARP_LEN	60
+
+/* locally administered, what the modem sees us as in TUN mode */
+static const uint8_t dp_mac[ETH_ALEN] = {0x02, 0x4f, 0x4e, 0x44, 0x41, 0x00};
+
+struct datapath {
+	struct nbio		dp_io;
+	struct _dongle		*dp_dongle;
+	struct iothread		*dp_thread;
+	struct pktpool		*dp_pool;
+	unsigned int		dp_share;
+	tapif_t			dp_tap;
+	unsigned int		dp_tx_inflight;
+	unsigned int		dp_inflight;
+	unsigned int		dp_running;
+	size_t			dp_tx_len;
+	struct usbio_defer	dp_flush;
+
+	unsigned int		dp_tun;
+	size_t			dp_vnet;
+	uint8_t			*dp_scratch;
+	struct pkt		*dp_seg;
+	uint8_t			dp_peer[ETH_ALEN];
+
+	/* the dongle's, so they outlive any one ifup */
+	struct dongle_counters	*dp_ctr;
+	struct dongle_hist	*dp_hist;
+
+	/* ring of bulk IN transfers in submission order, completions are
+	 * delivered to the TAP strictly from the head
+	 */
+	unsigned int		dp_rx_depth;
+	unsigned int		dp_rx_head;
+
+	/* slots not in flight, consecutive in ring order from dp_rx_park */
+	unsigned int		dp_rx_park;
+	unsigned int		dp_rx_nparked;
+	unsigned int		dp_rx_errs;
+	unsigned int		dp_retry_ms;
+	struct nbio_timer	dp_retry;
+
+	struct rx_slot {
+		struct pkt	*pkt;
+		unsigned int	done;
+	}			dp_rx[0];
+};
+
+static unsigned int rx_depth = DP_RX_DEPTH;
+
+int dongle_rx_depth(unsigned int depth)
+{
+	if ( depth < 1 || depth > DP_RX_DEPTH_MAX )
+		return 0;
+	rx_depth = depth;
+	return 1;
+}
+
+static void tap_wake(struct datapath *dp)
+{
+	if ( !dp->dp_running )
+		return;
+	if ( nbio_get_wait(&dp->dp_io) )
+		return;
+	nbio_wake(dp->dp_thread, &dp->dp_io, NBIO_READ);
+}
+
+static void tx_done(struct libusb_transfer *x)
+{
+	struct pkt *p = x->user_data;
+	struct datapath *dp = p->p_priv;
+
+	dp->dp_inflight--;
+	dp->dp_tx_inflight--;
+	trace_xfer_done(x, x->endpoint, x->status, NULL, x->actual_length);
+
+	if ( x->status != LIBUSB_TRANSFER_COMPLETED &&
+			x->status != LIBUSB_TRANSFER_CANCELLED ) {
+		fprintf(stderr, "%s: %s: tx status %d\n",
+			odw_cmd, dp->dp_dongle->d_serial, x->status);
+		dp->dp_ctr->drop_usb++;
+		stats_usb_err(dp->dp_ctr, usbio_status_err(x->status));
+	}
+
+	if ( x->status == LIBUSB_TRANSFER_COMPLETED ) {
+		hist_since(&dp->dp_hist[DONGLE_HIST_BULK_OUT], p->p_stamp);
+		dp->dp_ctr->tx_pkts++;
+		dp->dp_ctr->tx_bytes += x->actual_length;
+	}
+
+	pkt_put(dp->dp_pool, p);
+	tap_wake(dp);
+}
+
+static void rx_done(struct libusb_transfer *x);
+
+static int rx_submit(struct datapath *dp, struct pkt *p)
+{
+	struct _dongle *d = dp->dp_dongle;
+	int rc;
+
+	libusb_fill_bulk_transfer(p->p_xfer, d->d_xport->x_handle,
+				d->d_data_in_ep,
+				p->p_buf, dp->dp_pool->pp_bufsz,
+				rx_done, p, 0);
+	dp->dp_ctr->sys_submit++;
+	p->p_stamp = hist_now();
+	trace_xfer_submit(p->p_xfer, d->d_data_in_ep, NULL, p->p_xfer->length);
+	rc = d->d_xport->x_ops->submit(d->d_xport, p->p_xfer);
+	if ( rc ) {
+		fprintf(stderr, "%s: %s: rx submit: %s\n",
+			odw_cmd, d->d_serial, libusb_error_name(rc));
+		return 0;
+	}
+
+	dp->dp_inflight++;
+	return 1;
+}
+
+static void tx_fill(struct datapath *dp, struct pkt *p, size_t len);
+static int tx_submit(struct datapath *dp, struct pkt *p);
+
+static void arp_reply(struct datapath *dp, const uint8_t *req, size_t len)
+{
+	const uint8_t *arp = req + ETH_HLEN;
+	struct pkt *p;
+	uint8_t *r;
+
+	/* ethernet/IPv4 requests only */
+	if ( len < ETH_HLEN + 28 )
+		return;
+	if ( memcmp(arp, "\x00\x01\x08\x00\x06\x04\x00\x01", 8) )
+		return;
+
+	p = pkt_get(dp->dp_pool);
+	if ( NULL == p )
+		return;
+
+	memcpy(dp->dp_peer, arp + 8, ETH_ALEN);
+
+	r = p->p_buf;
+	memset(r, 0, DP_ARP_LEN);
+	memcpy(r, arp + 8, ETH_ALEN);
+	memcpy(r + ETH_ALEN, dp_mac, ETH_ALEN);
+	r[12] = ETH_P_ARP >> 8;
+	r[13] = ETH_P_ARP & 0xff;
+
+	r += ETH_HLEN;
+	memcpy(r, arp, 6);
+	r[7] = 2;
+	memcpy(r + 8, dp_mac, ETH_ALEN);
+	memcpy(r + 14, arp + 24, 4);
+	memcpy(r + 18, arp + 8, ETH_ALEN + 4);
+
+	tx_fill(dp, p, DP_ARP_LEN);
+	tx_submit(dp, p);
+}
+
+/* Learn who the modem is, answer its ARPs and pass only IP up */
+static int eth_strip(struct datapath *dp, uint8_t **frame, size_t *len)
+{
+	uint8_t *f = *frame;
+
+	if ( *len < ETH_HLEN )
+		return 0;
+
+	switch((f[12] << 8) | f[13]) {
+	case ETH_P_IP:
+	case ETH_P_IPV6:
+		break;
+	case ETH_P_ARP:
+		if ( dp->dp_running )
+			arp_reply(dp, f, *len);
+		return 0;
+	default:
+		return 0;
+	}
+
+	memcpy(dp->dp_peer, f + ETH_ALEN, ETH_ALEN);
+	*frame = f + ETH_HLEN;
+	*len -= ETH_HLEN;
+	return 1;
+}
+
+/* Fill in the ethernet header in front of an IP packet */
+static int eth_build(struct datapath *dp, uint8_t *f)
+{
+	uint16_t proto;
+
+	switch(f[ETH_HLEN] >> 4) {
+	case 4:
+		proto = ETH_P_IP;
+		break;
+	case 6:
+		proto = ETH_P_IPV6;
+		break;
+	default:
+		return 0;
+	}
+
+	memcpy(f, dp->dp_peer, ETH_ALEN);
+	memcpy(f + ETH_ALEN, dp_mac, ETH_ALEN);
+	f[12] = proto >> 8;
+	f[13] = proto & 0xff;
+	return 1;
+}
+
+static ssize_t tap_write(struct datapath *dp, uint8_t *frame, size_t len)
+{
+	static const struct virtio_net_hdr vh = {
+		.gso_type = VIRTIO_NET_HDR_GSO_NONE,
+	};
+	struct iovec iov[2];
+
+	if ( !dp->dp_vnet )
+		return tapif_write(dp->dp_tap, frame, len);
+
+	iov[0].iov_base = (void *)&vh;
+	iov[0].iov_len = dp->dp_vnet;
+	iov[1].iov_base = frame;
+	iov[1].iov_len = len;
+	return tapif_writev(dp->dp_tap, iov, 2);
+}
+
+static void rx_deliver(struct datapath *dp, struct libusb_transfer *x)
+{
+	uint8_t *frame;
+	size_t len;
+
+	switch(x->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		if ( x->actual_length <= 0 )
+			break;
+		frame = x->buffer;
+		len = x->actual_length;
+		if ( dp->dp_tun && !eth_strip(dp, &frame, &len) ) {
+			dp->dp_ctr->drop_bad++;
+			break;
+		}
+		dp->dp_ctr->sys_write++;
+		if ( tap_write(dp, frame, len) < 0 ) {
+			/* TAP full: drop it on the floor */
+			dp->dp_ctr->drop_tap++;
+			break;
+		}
+		dp->dp_ctr->rx_pkts++;
+		dp->dp_ctr->rx_bytes += x->actual_length;
+		break;
+	default:
+		fprintf(stderr, "%s: %s: rx status %d\n",
+			odw_cmd, dp->dp_dongle->d_serial, x->status);
+		dp->dp_ctr->drop_usb++;
+		stats_usb_err(dp->dp_ctr, usbio_status_err(x->status));
+		break;
+	}
+}
+
+/* Once one slot is parked every slot after it is too, so that they
+ * still go back out in ring order
+ */
+static void rx_park(struct datapath *dp, unsigned int idx)
+{
+	if ( 0 == dp->dp_rx_nparked++ )
+		dp->dp_rx_park = idx;
+
+	/* once per outage, not every time round */
+	if ( dp->dp_retry_ms == DP_RETRY_MIN &&
+			!nbio_timer_pending(&dp->dp_retry) ) {
+		fprintf(stderr, "%s: %s: rx failing, backing off\n",
+			odw_cmd, dp->dp_dongle->d_serial);
+	}
+
+	if ( !nbio_timer_pending(&dp->dp_retry) )
+		nbio_timer_add(dp->dp_thread, &dp->dp_retry, dp->dp_retry_ms);
+}
+
+static void rx_retry(struct iothread *t, struct nbio_timer *tm)
+{
+	struct datapath *dp = container_of(tm, struct datapath, dp_retry);
+
+	if ( !dp->dp_running )
+		return;
+
+	dp->dp_rx_errs = 0;
+	while ( dp->dp_rx_nparked ) {
+		if ( !rx_submit(dp, dp->dp_rx[dp->dp_rx_park].pkt) )
+			break;
+		dp->dp_rx_park = (dp->dp_rx_park + 1) % dp->dp_rx_depth;
+		dp->dp_rx_nparked--;
+	}
+
+	dp->dp_retry_ms *= 2;
+	if ( dp->dp_retry_ms > DP_RETRY_MAX )
+		dp->dp_retry_ms = DP_RETRY_MAX;
+	if ( dp->dp_rx_nparked )
+		nbio_timer_add(t, tm, dp->dp_retry_ms);
+}
+
+/* Runs once libusb has reaped everything that was ready, so all of the
+ * frames which arrived in this iteration go to the TAP back to back.
+ * Resubmitting the head makes it the tail again, so the ring stays in
+ * submission order. A dead endpoint gets backed off from rather than
+ * spun on.
+ */
+static void rx_flush(struct usbio_defer *f)
+{
+	struct datapath *dp = container_of(f, struct datapath, dp_flush);
+	struct rx_slot *slot;
+	unsigned int idx;
+
+	for(slot = &dp->dp_rx[dp->dp_rx_head]; slot->done;
+			slot = &dp->dp_rx[dp->dp_rx_head]) {
+		nbio_spend(dp->dp_thread, 1);
+		rx_deliver(dp, slot->pkt->p_xfer);
+		slot->done = 0;
+		idx = dp->dp_rx_head;
+		dp->dp_rx_head = (dp->dp_rx_head + 1) % dp->dp_rx_depth;
+		if ( !dp->dp_running )
+			continue;
+
+		if ( slot->pkt->p_xfer->status == LIBUSB_TRANSFER_COMPLETED ) {
+			dp->dp_rx_errs = 0;
+			dp->dp_retry_ms = DP_RETRY_MIN;
+		}else{
+			dp->dp_rx_errs++;
+			dp->dp_ctr->retries++;
+		}
+
+		if ( dp->dp_rx_nparked || dp->dp_rx_errs >= DP_RX_ERRS ||
+				!rx_submit(dp, slot->pkt) )
+			rx_park(dp, idx);
+	}
+}
+
+static void rx_done(struct libusb_transfer *x)
+{
+	struct pkt *p = x->user_data;
+	struct datapath *dp = p->p_priv;
+
+	dp->dp_inflight--;
+	trace_xfer_done(x, x->endpoint, x->status, NULL, x->actual_length);
+
+	switch(x->status) {
+	case LIBUSB_TRANSFER_CANCELLED:
+		return;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		fprintf(stderr, "%s: %s: device went away\n",
+			odw_cmd, dp->dp_dongle->d_serial);
+		stats_usb_err(dp->dp_ctr, LIBUSB_ERROR_NO_DEVICE);
+		/* let the other queues pick up its flows */
+		tapif_queue(dp->dp_tap, 0);
+		return;
+	case LIBUSB_TRANSFER_COMPLETED:
+		hist_since(&dp->dp_hist[DONGLE_HIST_BULK_IN], p->p_stamp);
+		break;
+	default:
+		break;
+	}
+
+	dp->dp_rx[p->p_slot].done = 1;
+	if ( p->p_slot == dp->dp_rx_head )
+		usbio_defer(dp->dp_dongle->d_usb, &dp->dp_flush);
+}
+
+static int tx_submit(struct datapath *dp, struct pkt *p)
+{
+	struct _dongle *d = dp->dp_dongle;
+	int rc;
+
+	dp->dp_ctr->sys_submit++;
+	p->p_stamp = hist_now();
+	trace_xfer_submit(p->p_xfer, d->d_data_out_ep, NULL,
+				p->p_xfer->length);
+	rc = d->d_xport->x_ops->submit(d->d_xport, p->p_xfer);
+	if ( rc ) {
+		fprintf(stderr, "%s: %s: tx submit: %s\n",
+			odw_cmd, d->d_serial, libusb_error_name(rc));
+		pkt_put(dp->dp_pool, p);
+		return 0;
+	}
+
+	dp->dp_inflight++;
+	dp->dp_tx_inflight++;
+	return 1;
+}
+
+static void tx_fill(struct datapath *dp, struct pkt *p, size_t len)
+{
+	struct _dongle *d = dp->dp_dongle;
+
+	libusb_fill_bulk_transfer(p->p_xfer, d->d_xport->x_handle,
+				d->d_data_out_ep, p->p_buf, len,
+				tx_done, p, DP_TX_TIMEOUT);
+
+	/* bulk pipe delimits frames by short packets */
+	p->p_xfer->flags = 0;
+	if ( 0 == (len % d->d_data_mps) )
+		p->p_xfer->flags |= LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+
+	p->p_priv = dp;
+}
+
+static void tx_flush(struct datapath *dp, struct pkt **batch, unsigned int *nr)
+{
+	unsigned int i;
+
+	for(i = 0; i < *nr; i++)
+		tx_submit(dp, batch[i]);
+	*nr = 0;
+}
+
+enum tx_state {
+	TX_MORE,
+	TX_QUOTA,
+	TX_FULL,
+	TX_EMPTY,
+	TX_NOMEM,
+};
+
+static void tx_read_err(struct datapath *dp, ssize_t ret)
+{
+	if ( ret < 0 && errno != EAGAIN )
+		fprintf(stderr, "%s: %s: read: %s\n", odw_cmd,
+			tapif_name(dp->dp_tap), os_err());
+}
+
+/* Read straight in to a packet, leaving room for an ethernet header
+ * in TUN mode
+ */
+static enum tx_state tx_read(struct datapath *dp, struct pkt **batch,
+				unsigned int *nr)
+{
+	size_t off = (dp->dp_tun) ? ETH_HLEN : 0;
+	struct pkt *p;
+	ssize_t ret;
+
+	p = pkt_get(dp->dp_pool);
+	if ( NULL == p )
+		return TX_NOMEM;
+
+	dp->dp_ctr->sys_read++;
+	ret = tapif_read(dp->dp_tap, p->p_buf + off, dp->dp_tx_len - off);
+	if ( ret <= 0 ) {
+		pkt_put(dp->dp_pool, p);
+		tx_read_err(dp, ret);
+		return TX_EMPTY;
+	}
+
+	if ( off && !eth_build(dp, p->p_buf) ) {
+		pkt_put(dp->dp_pool, p);
+		dp->dp_ctr->drop_bad++;
+		return TX_MORE;
+	}
+
+	tx_fill(dp, p, ret + off);
+	batch[(*nr)++] = p;
+	return TX_MORE;
+}
+
+static uint8_t *tso_get(void *priv)
+{
+	struct datapath *dp = priv;
+
+	dp->dp_seg = pkt_get(dp->dp_pool);
+	if ( NULL == dp->dp_seg )
+		return NULL;
+	return dp->dp_seg->p_buf;
+}
+
+static void tso_put(void *priv, uint8_t *buf, size_t len)
+{
+	struct datapath *dp = priv;
+
+	dp->dp_ctr->tx_segs++;
+	tx_fill(dp, dp->dp_seg, len);
+	tx_submit(dp, dp->dp_seg);
+	dp->dp_seg = NULL;
+}
+
+/* Frames behind a virtio header may be anything up to 64K, so they go
+ * via the scratch buffer and are copied, or cut up, in to packets.
+ */
+static enum tx_state tx_read_vnet(struct datapath *dp, struct pkt **batch,
+				unsigned int *nr)
+{
+	struct virtio_net_hdr vh;
+	size_t len, l3off;
+	uint8_t *frame;
+	struct pkt *p;
+	ssize_t ret;
+
+	/* don't pull a frame off the TAP unless we have somewhere to put it */
+	p = pkt_get(dp->dp_pool);
+	if ( NULL == p )
+		return TX_NOMEM;
+
+	dp->dp_ctr->sys_read++;
+	ret = tapif_read(dp->dp_tap, dp->dp_scratch + ETH_HLEN,
+				dp->dp_vnet + DP_GSO_MAX);
+	if ( ret <= 0 ) {
+		pkt_put(dp->dp_pool, p);
+		tx_read_err(dp, ret);
+		return TX_EMPTY;
+	}
+	if ( (size_t)ret <= dp->dp_vnet )
+		goto drop;
+
+	memcpy(&vh, dp->dp_scratch + ETH_HLEN, sizeof(vh));
+	frame = dp->dp_scratch + ETH_HLEN + dp->dp_vnet;
+	len = ret - dp->dp_vnet;
+
+	if ( dp->dp_tun ) {
+		/* offsets in the header are from the IP header */
+		frame -= ETH_HLEN;
+		len += ETH_HLEN;
+		vh.csum_start += ETH_HLEN;
+		if ( !eth_build(dp, frame) )
+			goto drop;
+	}
+
+	l3off = ETH_HLEN;
+	if ( ((frame[12] << 8) | frame[13]) == ETH_P_8021Q )
+		l3off += 4;
+
+	if ( (vh.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) !=
+			VIRTIO_NET_HDR_GSO_NONE ) {
+		pkt_put(dp->dp_pool, p);
+
+		/* keep frames on the wire in the order the kernel sent them */
+		tx_flush(dp, batch, nr);
+
+		dp->dp_ctr->tx_gso++;
+		if ( !offload_tso(&vh, frame, len, l3off,
+					dp->dp_pool->pp_bufsz,
+					tso_get, tso_put, dp) )
+			dp->dp_ctr->drop_bad++;
+		return TX_MORE;
+	}
+
+	if ( len > dp->dp_pool->pp_bufsz || !offload_csum(frame, len, &vh) )
+		goto drop;
+
+	memcpy(p->p_buf, frame, len);
+	tx_fill(dp, p, len);
+	batch[(*nr)++] = p;
+	return TX_MORE;
+
+drop:
+	pkt_put(dp->dp_pool, p);
+	dp->dp_ctr->drop_bad++;
+	return TX_MORE;
+}
+
+/* Drain every frame the TAP has for us, up to the in-flight limit,
+ * before handing the whole batch to libusb
+ */
+static void tap_read(struct iothread *t, struct nbio *n)
+{
+	struct datapath *dp = (struct datapath *)n;
+	struct pkt *batch[DP_TX_MAX];
+	enum tx_state state;
+	unsigned int nr;
+
+	for(nr = 0, state = TX_MORE; state == TX_MORE; ) {
+		if ( dp->dp_tx_inflight + nr >= DP_TX_MAX ) {
+			state = TX_FULL;
+			break;
+		}
+		if ( nr >= nbio_quota(t) ) {
+			state = TX_QUOTA;
+			break;
+		}
+		if ( dp->dp_vnet ) {
+			state = tx_read_vnet(dp, batch, &nr);
+		}else{
+			state = tx_read(dp, batch, &nr);
+		}
+	}
+
+	nbio_spend(t, nr);
+	tx_flush(dp, batch, &nr);
+
+	switch(state) {
+	case TX_QUOTA:
+		/* stay active, we get called again after everyone else */
+		break;
+	case TX_EMPTY:
+		nbio_inactive(t, n, NBIO_READ|NBIO_ERROR);
+		break;
+	case TX_NOMEM:
+		/* woken by pkt_put() from any datapath */
+		dp->dp_ctr->tx_pool_stalls++;
+		pktpool_wait(dp->dp_pool, n);
+		break;
+	case TX_FULL:
+	default:
+		/* Enough in flight, stop watching the TAP until one
+		 * completes. If the submits all failed there's nothing
+		 * to wait for, go back to waiting on the TAP.
+		 */
+		if ( dp->dp_tx_inflight ) {
+			nbio_set_wait(t, n, 0);
+		}else{
+			nbio_inactive(t, n, NBIO_READ|NBIO_ERROR);
+		}
+		break;
+	}
+}
+
+static void dp_free(struct datapath *dp)
+{
+	unsigned int i;
+
+	/* transfers which couldn't be drained still point at us */
+	if ( dp->dp_inflight ) {
+		fprintf(stderr, "%s: %s: leaking datapath, %u transfers "
+			"in flight\n", odw_cmd, dp->dp_dongle->d_serial,
+			dp->dp_inflight);
+		return;
+	}
+
+	for(i = 0; i < dp->dp_rx_depth; i++) {
+		if ( dp->dp_rx[i].pkt )
+			pkt_put(dp->dp_pool, dp->dp_rx[i].pkt);
+	}
+
+	pktpool_release(dp->dp_pool, dp->dp_share);
+	tapif_close(dp->dp_tap);
+	free(dp->dp_scratch);
+	free(dp);
+}
+
+static void tap_dtor(struct iothread *t, struct nbio *n)
+{
+	dp_free((struct datapath *)n);
+}
+
+static const struct nbio_ops tap_ops = {
+	.read = tap_read,
+	.write = tap_read,
+	.dtor = tap_dtor,
+};
+
+struct datapath *datapath_start(struct _dongle *d, struct iothread *t,
+				tapif_t tap)
+{
+	struct datapath *dp;
+	unsigned int i, nr;
+	size_t bufsz;
+
+	if ( 0 == d->d_data_mps || 0 == d->d_data_in_ep ||
+			0 == d->d_data_out_ep ) {
+		fprintf(stderr, "%s: %s: no data endpoints\n",
+			odw_cmd, d->d_serial);
+		return NULL;
+	}
+
+	dp = calloc(1, sizeof(*dp) + rx_depth * sizeof(*dp->dp_rx));
+	if ( NULL == dp ) {
+		fprintf(stderr, "%s: calloc: %s\n", odw_cmd, os_err());
+		return NULL;
+	}
+
+	dp->dp_dongle = d;
+	dp->dp_thread = t;
+	dp->dp_tap = tap;
+	dp->dp_ctr = &d->d_stats->s_ctr;
+	dp->dp_hist = d->d_stats->s_hist;
+	d->d_stats->s_ep[DONGLE_HIST_BULK_IN] = d->d_data_in_ep;
+	d->d_stats->s_ep[DONGLE_HIST_BULK_OUT] = d->d_data_out_ep;
+	dp->dp_pool = &d->d_usb->u_pool;
+	dp->dp_tx_len = tapif_mtu(tap) + DP_HDR_LEN;
+	dp->dp_rx_depth = rx_depth;
+	dp->dp_tun = !!(tapif_flags(tap) & TAPIF_TUN);
+	dp->dp_vnet = tapif_hdrlen(tap);
+	memset(dp->dp_peer, 0xff, sizeof(dp->dp_peer));
+	usbio_defer_init(&dp->dp_flush, rx_flush);
+	nbio_timer_init(&dp->dp_retry, rx_retry);
+	dp->dp_retry_ms = DP_RETRY_MIN;
+
+	nr = DP_TX_MAX + dp->dp_rx_depth;
+	if ( dp->dp_vnet ) {
+		dp->dp_scratch = malloc(ETH_HLEN + dp->dp_vnet + DP_GSO_MAX);
+		if ( NULL == dp->dp_scratch ) {
+			fprintf(stderr, "%s: malloc: %s\n", odw_cmd, os_err());
+			free(dp);
+			return NULL;
+		}
+		nr += DP_GSO_SEGS;
+	}
+
+	/* each datapath reserves its share of the thread's pool */
+	bufsz = pktpool_bufsz(tapif_mtu(tap), d->d_data_mps);
+	if ( !pktpool_reserve(dp->dp_pool, nr, bufsz) ) {
+		free(dp->dp_scratch);
+		free(dp);
+		return NULL;
+	}
+	dp->dp_share = nr;
+
+	dp->dp_running = 1;
+	for(i = 0; i < dp->dp_rx_depth; i++) {
+		struct pkt *p;
+
+		p = pkt_get(dp->dp_pool);
+		if ( NULL == p )
+			goto err_cancel;
+		p->p_priv = dp;
+		p->p_slot = i;
+		dp->dp_rx[i].pkt = p;
+		if ( !rx_submit(dp, p) )
+			goto err_cancel;
+	}
+
+	dp->dp_io.fd = tapif_fd(tap);
+	dp->dp_io.ops = &tap_ops;
+	nbio_add(t, &dp->dp_io, NBIO_READ);
+
+	if ( odw_verbose ) {
+		printf("%s: %s: forwarding on %s\n",
+			odw_cmd, d->d_serial, tapif_name(tap));
+	}
+	return dp;
+
+err_cancel:
+	/* the TAP is closed by the caller on failure */
+	dp->dp_tap = NULL;
+	datapath_stop(dp);
+	return NULL;
+}
+
+static int dp_busy(void *priv)
+{
+	struct datapath *dp = priv;
+
+	return dp->dp_inflight != 0;
+}
+
+/* Cancel everything in flight and hand the datapath to the eventloop
+ * to be freed, the TAP goes with it
+ */
+void datapath_stop(struct datapath *dp)
+{
+	struct xport *x = dp->dp_dongle->d_xport;
+	unsigned int i;
+
+	dp->dp_running = 0;
+
+	if ( dp->dp_tap )
+		tapif_queue(dp->dp_tap, 0);
+
+	/* in-flight TX packets are only reachable through the transport */
+	for(i = 0; i < dp->dp_rx_depth; i++) {
+		if ( dp->dp_rx[i].pkt )
+			x->x_ops->cancel(x, dp->dp_rx[i].pkt->p_xfer);
+	}
+
+	usbio_drain(x, dp_busy, dp);
+	usbio_defer_cancel(&dp->dp_flush);
+	nbio_timer_del(dp->dp_thread, &dp->dp_retry);
+
+	if ( NULL == dp->dp_io.ops ) {
+		/* never made it on to the eventloop */
+		dp_free(dp);
+		return;
+	}
+
+	nbio_del(dp->dp_thread, &dp->dp_io);
+}
+
+static double ratio(uint64_t a, uint64_t b)
+{
+	return (b) ? (double)a / (double)b : 0.0;
+}
+
+void datapath_dump(struct datapath *dp, FILE *f)
+{
+	const struct dongle_counters *c = dp->dp_ctr;
+	uint64_t sys = c->sys_read + c->sys_write + c->sys_submit;
+	uint64_t pkts = c->rx_pkts + c->tx_pkts;
+	uint64_t events = dp->dp_dongle->d_usb->u_stats->s_ctr.usb_events;
+
+	fprintf(f, "%s: %s: rx %"PRIu64" pkts %"PRIu64" bytes "
+		"%"PRIu64" drops\n", tapif_name(dp->dp_tap),
+		dp->dp_dongle->d_serial,
+		c->rx_pkts, c->rx_bytes, c->drop_tap + c->drop_usb);
+	fprintf(f, "%s: %s: tx %"PRIu64" pkts %"PRIu64" bytes "
+		"%"PRIu64" drops\n",
+		tapif_name(dp->dp_tap), dp->dp_dongle->d_serial,
+		c->tx_pkts, c->tx_bytes, c->drop_bad);
+	if ( dp->dp_vnet ) {
+		fprintf(f, "%s: %s: offload: %"PRIu64" super-packets in "
+			"%"PRIu64" segments\n",
+			tapif_name(dp->dp_tap), dp->dp_dongle->d_serial,
+			c->tx_gso, c->tx_segs);
+	}
+	fprintf(f, "%s: %s: syscalls: %"PRIu64" read %"PRIu64" write "
+		"%"PRIu64" submit, %.2f per packet\n",
+		tapif_name(dp->dp_tap), dp->dp_dongle->d_serial,
+		c->sys_read, c->sys_write, c->sys_submit,
+		ratio(sys, pkts));
+	fprintf(f, "%s: %s: libusb event dispatches: %"PRIu64
+		" (thread), %.2f packets per dispatch\n",
+		tapif_name(dp->dp_tap), dp->dp_dongle->d_serial,
+		events, ratio(pkts, events));
+}
+
+uint64_t datapath_bytes(struct datapath *dp)
+{
+	return dp->dp_ctr->rx_bytes + dp->dp_ctr->tx_bytes;
+}
+
+const char *datapath_ifname(struct datapath *dp)
+{
+	return tapif_name(dp->dp_tap);
+}
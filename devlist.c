@@ -12,9 +12,18 @@
 #include <ctype.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
 
+#include "compiler.h"
+#include "list.h"
+#include "nbio.h"
 #include "ondawagon.h"
+#include "tapif.h"
 #include "dongle.h"
+#include "pktpool.h"
+#include "usbio.h"
+#include "usbstr.h"
+#include "xport.h"
 
 static const struct devlist {
 	uint16_t vendor;
@@ -27,21 +36,54 @@ static const struct devlist {
 	{0x19d2, 0x1008, 0},
 };
 
+/* Every dongle we know about, open or not, hashed by serial. With
+ * hotplug, libusb tells us about arrivals and departures as they happen,
+ * its hotplug fd being just another pollfd which nbio services. Arrivals
+ * queue up on devreg_pending and are probed for their serial number
+ * after event handling since that takes synchronous control transfers.
+ * Without hotplug the bus gets re-scanned on demand, and every so often
+ * once the loop is running, and diffed against what we already have.
+ */
+#define DEVREG_HASH_BITS	6
+#define DEVREG_HASH_SIZE	(1U << DEVREG_HASH_BITS)
+#define DEVREG_HASH_MASK	(DEVREG_HASH_SIZE - 1U)
+
+/* how long to give mode-switched dongles to come back, and how often
+ * to look if there's no hotplug to tell us, while waiting on them and
+ * otherwise
+ */
+#define DEVREG_REENUM_MS	20000
+#define DEVREG_RESCAN_MS	100
+#define DEVREG_POLL_MS		1000
+
+struct devent {
+	struct hlist_node	e_hash;
+	struct list_head	e_list;
+	libusb_device		*e_dev;	/* NULL for emulated dongles */
+	unsigned int		e_flags;
+	uint8_t			e_bus;
+	uint8_t			e_addr;
+	uint8_t			e_seen;
+	uint8_t			e_gone;
+	char			*e_serial;
+	char			*e_product;
+	char			*e_mnfr;
+};
+
 static libusb_context *ctx;
+static struct usbio usbio;
 
-static void do_exit(void)
-{
-	libusb_exit(ctx);
-	ctx = NULL;
-}
+static struct hlist_head devreg[DEVREG_HASH_SIZE];
+static LIST_HEAD(devreg_known);
+static LIST_HEAD(devreg_pending);
+static struct devent *devreg_probing;
+static libusb_hotplug_callback_handle hotplug;
+static int have_hotplug;
+static struct nbio_timer devreg_poll;
+static int devreg_due;
 
-static int do_init(void)
-{
-	if ( NULL == ctx && libusb_init(&ctx) )
-		return 0;
-	atexit(do_exit);
-	return 1;
-}
+static dongle_watch_t watch_fn;
+static void *watch_priv;
 
 /* binary search the known-device table */
 static int find_device(uint16_t vendor, uint16_t product,
@@ -76,7 +118,380 @@ static int find_device(uint16_t vendor, uint16_t product,
 	return 0;
 }
 
-static int do_device(libusb_device *dev, struct list_head *list)
+/* FNV-1a */
+static unsigned int serial_hash(const char *serial)
+{
+	uint32_t h = 0x811c9dc5;
+
+	for(; *serial; serial++)
+		h = (h ^ (uint8_t)*serial) * 0x01000193;
+
+	return (h ^ (h >> DEVREG_HASH_BITS)) & DEVREG_HASH_MASK;
+}
+
+static struct devent *devreg_find(const char *serial)
+{
+	struct hlist_node *n;
+	struct devent *e;
+
+	hlist_for_each(n, &devreg[serial_hash(serial)]) {
+		e = hlist_entry(n, struct devent, e_hash);
+		if ( !strcmp(e->e_serial, serial) )
+			return e;
+	}
+
+	return NULL;
+}
+
+static void devreg_notify(struct devent *e, unsigned int ev)
+{
+	struct dongle_event de;
+
+	if ( NULL == watch_fn )
+		return;
+
+	de.ev = ev;
+	de.serial = e->e_serial;
+	de.product = e->e_product;
+	de.mnfr = e->e_mnfr;
+	de.bus = e->e_bus;
+	de.addr = e->e_addr;
+	de.needs_ready = !!(e->e_flags & DEVLIST_ZEROCD);
+	watch_fn(watch_priv, &de);
+}
+
+static struct devent *devent_new(libusb_device *dev, uint8_t bus,
+					uint8_t addr, unsigned int flags)
+{
+	struct devent *e;
+
+	e = calloc(1, sizeof(*e));
+	if ( NULL == e ) {
+		fprintf(stderr, "%s: calloc: %s\n", odw_cmd, os_err());
+		return NULL;
+	}
+
+	e->e_dev = (dev) ? libusb_ref_device(dev) : NULL;
+	e->e_bus = bus;
+	e->e_addr = addr;
+	e->e_flags = flags;
+	INIT_HLIST_NODE(&e->e_hash);
+	list_add_tail(&e->e_list, &devreg_pending);
+	return e;
+}
+
+static void devent_free(struct devent *e)
+{
+	if ( !hlist_unhashed(&e->e_hash) )
+		hlist_del(&e->e_hash);
+	list_del(&e->e_list);
+	if ( e->e_dev )
+		libusb_unref_device(e->e_dev);
+	free(e->e_serial);
+	free(e->e_product);
+	free(e->e_mnfr);
+	free(e);
+}
+
+static struct _dongle *devent_open(struct usbio *u, struct devent *e)
+{
+	if ( NULL == e->e_dev )
+		return dongle__open_emu(u, e->e_addr - 1U, e->e_flags);
+	return dongle__open(u, e->e_dev, e->e_flags);
+}
+
+static struct devent *devent_arrived(libusb_device *dev)
+{
+	struct libusb_device_descriptor desc;
+	unsigned int flags;
+
+	if ( libusb_get_device_descriptor(dev, &desc) )
+		return NULL;
+	if ( !find_device(desc.idVendor, desc.idProduct, &flags) )
+		return NULL; /* we don't care about this device */
+
+	return devent_new(dev, libusb_get_bus_number(dev),
+				libusb_get_device_address(dev), flags);
+}
+
+static void devent_left(struct devent *e)
+{
+	if ( e == devreg_probing ) {
+		e->e_gone = 1;
+		return;
+	}
+
+	if ( !hlist_unhashed(&e->e_hash) )
+		devreg_notify(e, DONGLE_LEFT);
+	devent_free(e);
+}
+
+static struct devent *devent_by_dev(libusb_device *dev)
+{
+	struct devent *e;
+
+	if ( devreg_probing && devreg_probing->e_dev == dev )
+		return devreg_probing;
+
+	list_for_each_entry(e, &devreg_pending, e_list) {
+		if ( e->e_dev == dev )
+			return e;
+	}
+
+	list_for_each_entry(e, &devreg_known, e_list) {
+		if ( e->e_dev == dev )
+			return e;
+	}
+
+	return NULL;
+}
+
+/* Called from within libusb event handling, so no I/O on the device */
+static int LIBUSB_CALL hotplug_cb(libusb_context *c, libusb_device *dev,
+				libusb_hotplug_event event, void *priv)
+{
+	struct devent *e;
+
+	switch(event) {
+	case LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED:
+		devent_arrived(dev);
+		break;
+	case LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT:
+		e = devent_by_dev(dev);
+		if ( e )
+			devent_left(e);
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static int devent_set_strings(struct devent *e, const char *serial,
+				const char *product, const char *mnfr)
+{
+	e->e_serial = strdup(serial);
+	e->e_product = strdup(product);
+	e->e_mnfr = strdup(mnfr);
+	return (e->e_serial && e->e_product && e->e_mnfr);
+}
+
+static int devent_strings(struct devent *e)
+{
+	uint8_t ports[7];
+	struct _dongle *d;
+	struct usbstr s;
+	int nports, ret;
+
+	if ( e->e_dev ) {
+		nports = libusb_get_port_numbers(e->e_dev, ports,
+							sizeof(ports));
+		if ( nports > 0 && usbstr_lookup(e->e_bus, ports, nports,
+							e->e_addr, &s) )
+			return devent_set_strings(e, s.serial,
+							s.product, s.mnfr);
+	}
+
+	devreg_probing = e;
+	d = devent_open(&usbio, e);
+	devreg_probing = NULL;
+	if ( NULL == d )
+		return 0;
+
+	ret = !e->e_gone && devent_set_strings(e, d->d_serial,
+						d->d_product, d->d_mnfr);
+	dongle_close(d);
+	return ret;
+}
+
+/* Find out about everything that's turned up since last time */
+static void devreg_probe(void)
+{
+	struct devent *e, *old;
+
+	while ( !list_empty(&devreg_pending) ) {
+		e = list_entry(devreg_pending.next, struct devent, e_list);
+		list_del(&e->e_list);
+		INIT_LIST_HEAD(&e->e_list);
+
+		if ( !devent_strings(e) ) {
+			devent_free(e);
+			continue;
+		}
+
+		/* re-attached before we heard it go */
+		old = devreg_find(e->e_serial);
+		if ( old )
+			devent_left(old);
+
+		hlist_add_head(&e->e_hash, &devreg[serial_hash(e->e_serial)]);
+		list_add_tail(&e->e_list, &devreg_known);
+		devreg_notify(e, DONGLE_ARRIVED);
+	}
+}
+
+static struct devent *devent_by_emu(unsigned int idx)
+{
+	struct devent *e;
+
+	list_for_each_entry(e, &devreg_pending, e_list) {
+		if ( NULL == e->e_dev && e->e_addr == idx + 1U )
+			return e;
+	}
+
+	list_for_each_entry(e, &devreg_known, e_list) {
+		if ( NULL == e->e_dev && e->e_addr == idx + 1U )
+			return e;
+	}
+
+	return NULL;
+}
+
+/* Emulated dongles re-enumerate too, but only tell anyone if asked */
+static void devreg_rescan_emu(void)
+{
+	struct libusb_device_descriptor desc;
+	unsigned int i, flags;
+	struct devent *e;
+
+	for(i = 0; i < xport_emu_count(); i++) {
+		e = devent_by_emu(i);
+
+		if ( !xport_emu_present(i, &desc) ||
+				!find_device(desc.idVendor, desc.idProduct,
+						&flags) ) {
+			if ( e )
+				devent_left(e);
+			continue;
+		}
+
+		if ( e && e->e_flags == flags )
+			continue;
+		if ( e )
+			devent_left(e);
+
+		devent_new(NULL, XPORT_EMU_BUS, i + 1U, flags);
+	}
+}
+
+/* No hotplug, so work out what changed the hard way */
+static void devreg_rescan(void)
+{
+	libusb_device **devlist;
+	struct devent *e, *tmp;
+	ssize_t numdev, i;
+
+	numdev = libusb_get_device_list(ctx, &devlist);
+	if ( numdev < 0 )
+		return;
+
+	list_for_each_entry(e, &devreg_pending, e_list)
+		e->e_seen = 0;
+	list_for_each_entry(e, &devreg_known, e_list)
+		e->e_seen = 0;
+
+	for(i = 0; i < numdev; i++) {
+		e = devent_by_dev(devlist[i]);
+		if ( NULL == e )
+			e = devent_arrived(devlist[i]);
+		if ( e )
+			e->e_seen = 1;
+	}
+
+	list_for_each_entry_safe(e, tmp, &devreg_pending, e_list) {
+		if ( !e->e_seen )
+			devent_left(e);
+	}
+	list_for_each_entry_safe(e, tmp, &devreg_known, e_list) {
+		if ( !e->e_seen )
+			devent_left(e);
+	}
+
+	libusb_free_device_list(devlist, 1);
+}
+
+static void devreg_sync(int rescan)
+{
+	if ( rescan && xport_emu_count() ) {
+		devreg_rescan_emu();
+	}else if ( rescan && !have_hotplug ) {
+		devreg_rescan();
+	}
+	devreg_probe();
+}
+
+static void devreg_init(void)
+{
+	int rc;
+
+	/* emulated dongles stand in for the real ones */
+	if ( xport_emu_count() )
+		return;
+
+	if ( !libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) )
+		return;
+
+	rc = libusb_hotplug_register_callback(ctx,
+				LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+				LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+				LIBUSB_HOTPLUG_ENUMERATE,
+				LIBUSB_HOTPLUG_MATCH_ANY,
+				LIBUSB_HOTPLUG_MATCH_ANY,
+				LIBUSB_HOTPLUG_MATCH_ANY,
+				hotplug_cb, NULL, &hotplug);
+	if ( rc ) {
+		fprintf(stderr, "%s: hotplug: %s\n",
+			odw_cmd, libusb_error_name(rc));
+		return;
+	}
+
+	have_hotplug = 1;
+}
+
+static void devreg_fini(void)
+{
+	struct devent *e, *tmp;
+
+	if ( have_hotplug ) {
+		libusb_hotplug_deregister_callback(ctx, hotplug);
+		have_hotplug = 0;
+	}
+
+	watch_fn = NULL;
+	list_for_each_entry_safe(e, tmp, &devreg_pending, e_list)
+		devent_free(e);
+	list_for_each_entry_safe(e, tmp, &devreg_known, e_list)
+		devent_free(e);
+}
+
+static void do_exit(void)
+{
+	devreg_fini();
+	usbstr_flush();
+	usbio_fini(&usbio);
+	libusb_exit(ctx);
+	ctx = NULL;
+}
+
+static int do_init(void)
+{
+	if ( NULL != ctx )
+		return 1;
+	if ( libusb_init(&ctx) )
+		return 0;
+	if ( !usbio_init(&usbio, ctx, "main") ) {
+		libusb_exit(ctx);
+		ctx = NULL;
+		return 0;
+	}
+	devreg_init();
+	atexit(do_exit);
+	return 1;
+}
+
+static int do_device(struct usbio *u, libusb_device *dev,
+			struct list_head *list)
 {
 	struct libusb_device_descriptor desc;
 	unsigned int flags;
@@ -88,14 +503,7 @@ static int do_device(libusb_device *dev, struct list_head *list)
 	if ( !find_device(desc.idVendor, desc.idProduct, &flags) )
 		return 1; /* we don't care about this device */
 
-#if 0
-	printf("%03d.%03d = %04x:%04x\n",
-		libusb_get_bus_number(dev),
-		libusb_get_device_address(dev),
-		desc.idVendor, desc.idProduct);
-#endif
-
-	d = dongle__open(dev, flags);
+	d = dongle__open(u, dev, flags);
 	if ( NULL == d )
 		return 0;
 
@@ -103,75 +511,296 @@ static int do_device(libusb_device *dev, struct list_head *list)
 	return 1;
 }
 
-static int do_all_devices(dongle_t **dongles, size_t *nmemb)
+int dongle_list_all(dongle_t **dongles, size_t *nmemb)
 {
-	libusb_device **devlist;
-	struct _dongle *d, *tmp;
-	ssize_t numdev, i;
-	LIST_HEAD(list);
-	int ret = 0;
+	struct devent *e;
+	struct _dongle *d;
+	int ret = 1;
 	size_t n;
 
 	*dongles = NULL;
 	*nmemb = 0;
 
 	if ( !do_init() )
-		goto out;
+		return 0;
 
-	numdev = libusb_get_device_list(ctx, &devlist);
-	if ( numdev <= 0 )
-		goto out;
+	devreg_sync(1);
 
-	for(ret = 1, i = 0; i < numdev; i++) {
-		if ( !do_device(devlist[i], &list) )
-			ret = 0;
+	n = 0;
+	list_for_each_entry(e, &devreg_known, e_list) {
+		n++;
 	}
 
-	libusb_free_device_list(devlist, 1);
+	*dongles = calloc(n, sizeof(**dongles));
+	if ( NULL == *dongles && n )
+		return 0;
 
 	n = 0;
-	list_for_each_entry(d, &list, d_list) {
-		n++;
+	list_for_each_entry(e, &devreg_known, e_list) {
+		d = devent_open(&usbio, e);
+		if ( NULL == d ) {
+			ret = 0;
+			continue;
+		}
+		(*dongles)[n++] = d;
 	}
 
-	*dongles = calloc(n, sizeof(*dongles));
-	if ( NULL == *dongles ) {
+	*nmemb = n;
+	return ret;
+}
+
+dongle_t dongle_open(const char *serial)
+{
+	struct devent *e;
+	struct _dongle *d;
+
+	if ( !do_init() )
+		return NULL;
+
+	devreg_sync(1);
+
+	e = devreg_find(serial);
+	if ( NULL == e )
+		return NULL;
+
+	/* the address could have been re-used since we probed it */
+	d = devent_open(&usbio, e);
+	if ( d && strcmp(d->d_serial, serial) ) {
+		dongle_close(d);
+		d = NULL;
+	}
+
+	return d;
+}
+
+/* Tell fn about everything we know of now and then about arrivals and
+ * departures as they're seen by dongle_loop_pump(), NULL to stop
+ */
+int dongle_watch(dongle_watch_t fn, void *priv)
+{
+	struct devent *e;
+
+	watch_fn = NULL;
+	if ( NULL == fn )
+		return 1;
+
+	if ( !do_init() )
+		return 0;
+
+	devreg_sync(1);
+
+	watch_fn = fn;
+	watch_priv = priv;
+
+	list_for_each_entry(e, &devreg_known, e_list)
+		devreg_notify(e, DONGLE_ARRIVED);
+
+	return 1;
+}
+
+static unsigned int msecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000U + ts.tv_nsec / 1000000U;
+}
+
+static int devreg_back(const char *serial)
+{
+	struct devent *e = devreg_find(serial);
+	return (e && !(e->e_flags & DEVLIST_ZEROCD));
+}
+
+/* Wait for switched dongles to re-enumerate, rather than polling with
+ * a sleep in between this picks each one up as soon as it's back
+ */
+static int devreg_wait(char **serial, uint8_t *ok, size_t nmemb)
+{
+	unsigned int start = msecs(), now;
+	size_t i, left = 0;
+	int ret = 1;
+
+	for(i = 0; i < nmemb; i++)
+		left += ok[i];
+
+	for(now = start; left && now - start < DEVREG_REENUM_MS; ) {
+		usbio_pump(&usbio, DEVREG_RESCAN_MS);
+		devreg_sync(1);
+		now = msecs();
+
+		for(i = 0; i < nmemb; i++) {
+			if ( !ok[i] || !devreg_back(serial[i]) )
+				continue;
+			printf("%s: %s: ready after %u ms\n",
+				odw_cmd, serial[i], now - start);
+			ok[i] = 0;
+			left--;
+		}
+	}
+
+	for(i = 0; i < nmemb; i++) {
+		if ( !ok[i] )
+			continue;
+		fprintf(stderr, "%s: %s: didn't come back\n",
+			odw_cmd, serial[i]);
 		ret = 0;
+	}
+
+	return ret;
+}
+
+/* Mode-switch every ZeroCD dongle at once and wait for all of them to
+ * come back as modems, so the whole lot take as long as the slowest.
+ * Needs the loop. nready is how many are ready to go afterwards.
+ */
+int dongle_ready_all(size_t *nready)
+{
+	struct _dongle **d = NULL;
+	char **serial = NULL;
+	uint8_t *ok = NULL;
+	struct devent *e;
+	size_t i, n, nz;
+	int ret = 0;
+
+	*nready = 0;
+
+	if ( !do_init() || NULL == usbio.u_io )
+		return 0;
+
+	devreg_sync(1);
+
+	nz = 0;
+	list_for_each_entry(e, &devreg_known, e_list) {
+		if ( e->e_flags & DEVLIST_ZEROCD )
+			nz++;
+	}
+
+	d = calloc(nz, sizeof(*d));
+	serial = calloc(nz, sizeof(*serial));
+	ok = calloc(nz, sizeof(*ok));
+	if ( nz && (NULL == d || NULL == serial || NULL == ok) ) {
+		fprintf(stderr, "%s: calloc: %s\n", odw_cmd, os_err());
 		goto out;
 	}
 
 	n = 0;
-	list_for_each_entry_safe(d, tmp, &list, d_list) {
-		(*dongles)[n++] = d;
-		list_del(&d->d_list);
+	ret = 1;
+	list_for_each_entry(e, &devreg_known, e_list) {
+		if ( !(e->e_flags & DEVLIST_ZEROCD) )
+			continue;
+		serial[n] = strdup(e->e_serial);
+		d[n] = devent_open(&usbio, e);
+		if ( NULL == d[n] || NULL == serial[n] ) {
+			if ( d[n] )
+				dongle_close(d[n]);
+			free(serial[n]);
+			ret = 0;
+			continue;
+		}
+		n++;
 	}
 
-	*nmemb = n;
+	if ( dongle__ready_many(d, n, ok) != n )
+		ret = 0;
+
+	for(i = 0; i < n; i++)
+		dongle_close(d[i]);
+
+	if ( !devreg_wait(serial, ok, n) )
+		ret = 0;
+
+	for(i = 0; i < n; i++)
+		free(serial[i]);
+
+	list_for_each_entry(e, &devreg_known, e_list) {
+		if ( !(e->e_flags & DEVLIST_ZEROCD) )
+			(*nready)++;
+	}
 
 out:
+	free(ok);
+	free(serial);
+	free(d);
 	return ret;
 }
 
-int dongle_list_all(dongle_t **dev, size_t *nmemb)
+/* Open the dongle at a given bus address, on any libusb context */
+struct _dongle *dongle__open_at(struct usbio *u, uint8_t bus, uint8_t addr)
 {
-	return do_all_devices(dev, nmemb);
-}
+	libusb_device **devlist;
+	struct _dongle *d = NULL;
+	ssize_t numdev, i;
+	LIST_HEAD(list);
 
-dongle_t dongle_open(const char *serial)
-{
-	dongle_t *list;
-	size_t i, nmemb;
-	dongle_t ret;
+	if ( bus == XPORT_EMU_BUS ) {
+		struct libusb_device_descriptor desc;
+		unsigned int flags;
 
-	dongle_list_all(&list, &nmemb);
-	for(ret = NULL, i = 0; i < nmemb; i++) {
-		if ( !strcmp(dongle_serial(list[i]), serial) ) {
-			ret = list[i];
-		}else{
-			dongle_close(list[i]);
+		if ( !addr || !xport_emu_present(addr - 1U, &desc) ||
+				!find_device(desc.idVendor, desc.idProduct,
+						&flags) )
+			return NULL;
+		return dongle__open_emu(u, addr - 1U, flags);
+	}
+
+	numdev = libusb_get_device_list(u->u_ctx, &devlist);
+	if ( numdev <= 0 )
+		return NULL;
+
+	for(i = 0; i < numdev; i++) {
+		if ( libusb_get_bus_number(devlist[i]) != bus ||
+				libusb_get_device_address(devlist[i]) != addr )
+			continue;
+		if ( do_device(u, devlist[i], &list) && !list_empty(&list) ) {
+			d = list_entry(list.next, struct _dongle, d_list);
+			list_del(&d->d_list);
 		}
+		break;
 	}
-	free(list);
 
-	return ret;
+	libusb_free_device_list(devlist, 1);
+	return d;
+}
+
+/* Replace all of the hardware with emulated dongles */
+int dongle_emulate(const char *spec)
+{
+	return xport_emu_conf(spec);
+}
+
+/* The rescan itself waits for dongle_loop_pump(), probing new arrivals
+ * takes synchronous transfers which can't be done from a callback
+ */
+static void devreg_tick(struct iothread *t, struct nbio_timer *tm)
+{
+	devreg_due = 1;
+	nbio_timer_add(t, tm, DEVREG_POLL_MS);
+}
+
+int dongle_loop_init(struct iothread *t)
+{
+	if ( !do_init() )
+		return 0;
+	if ( !usbio_attach(&usbio, t) )
+		return 0;
+
+	nbio_timer_init(&devreg_poll, devreg_tick);
+	if ( !have_hotplug )
+		nbio_timer_add(t, &devreg_poll, DEVREG_POLL_MS);
+	return 1;
+}
+
+void dongle_loop_fini(void)
+{
+	if ( usbio.u_io )
+		nbio_timer_del(usbio.u_io, &devreg_poll);
+	usbio_detach(&usbio);
+}
+
+void dongle_loop_pump(int mto)
+{
+	usbio_pump(&usbio, mto);
+	devreg_sync(devreg_due);
+	devreg_due = 0;
 }
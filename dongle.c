@@ -14,10 +14,19 @@
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 
+#include "compiler.h"
+#include "list.h"
+#include "nbio.h"
 #include "ondawagon.h"
-#include "dongle.h"
 #include "tapif.h"
+#include "dongle.h"
+#include "pktpool.h"
+#include "usbio.h"
+#include "xport.h"
+#include "stats.h"
+#include "trace.h"
 
 const char *dongle_serial(dongle_t d)
 {
@@ -35,9 +44,34 @@ const char *dongle_product(dongle_t d)
 	return d->d_product;
 }
 
+unsigned int dongle_busnum(dongle_t d)
+{
+	return d->d_xport->x_ops->busnum(d->d_xport);
+}
+
+unsigned int dongle_devnum(dongle_t d)
+{
+	return d->d_xport->x_ops->devnum(d->d_xport);
+}
+
+uint64_t dongle_bytes(dongle_t d)
+{
+	return (d->d_dp) ? datapath_bytes(d->d_dp) : 0;
+}
+
+/* Name of the network interface, NULL unless it's up */
+const char *dongle_ifname(dongle_t d)
+{
+	return (d->d_dp) ? datapath_ifname(d->d_dp) : NULL;
+}
+
 void dongle_close(dongle_t d)
 {
-	libusb_close(d->d_handle);
+	handshake_abort(d);
+	atchan_free(d->d_at);
+	dongle_ifdown(d);
+	d->d_xport->x_ops->close(d->d_xport);
+	stats_free(d->d_stats);
 	free(d->d_product);
 	free(d->d_serial);
 	free(d->d_mnfr);
@@ -71,9 +105,10 @@ static char *get_string(struct _dongle *d, unsigned int idx)
 	uint8_t buf[256];
 	int ret;
 
-	ret = libusb_get_string_descriptor(d->d_handle, idx,
-					0x0409,
-					buf, sizeof(buf));
+	ret = usbio_control_sync(d->d_usb, d->d_xport, LIBUSB_ENDPOINT_IN,
+				LIBUSB_REQUEST_GET_DESCRIPTOR,
+				(LIBUSB_DT_STRING << 8) | idx, 0x0409,
+				buf, sizeof(buf), 1000);
 	if ( ret <= 2 )
 		return NULL;
 	if ( buf[0] != ret )
@@ -84,229 +119,107 @@ static char *get_string(struct _dongle *d, unsigned int idx)
 	return unidecode(buf + 2, ret - 2);
 }
 
-static int kill_kernel_driver(libusb_device_handle *h, int kill_msd)
+static int kill_kernel_driver(struct xport *x, int kill_msd)
 {
 	struct libusb_config_descriptor *conf;
-	libusb_device *dev;
 	unsigned int i, num;
 	int ret;
 
-	dev = libusb_get_device(h);
-	if ( libusb_get_active_config_descriptor(dev, &conf) ) {
+	if ( x->x_ops->get_config(x, &conf) ) {
 		return 0;
 	}
 
 	num = conf->bNumInterfaces - ((kill_msd) ? 0 : 1);
 
 	for(ret = 1, i = 0; i < num; i++) {
-		if ( libusb_detach_kernel_driver(h, i) && errno != ENODATA )
+		if ( x->x_ops->detach_kernel(x, i) && errno != ENODATA )
 			ret = 0;
 	}
 
-	libusb_free_config_descriptor(conf);
+	x->x_ops->free_config(x, conf);
 	return ret;
 }
 
-int dongle_needs_ready(dongle_t d)
+static void find_data_endpoints(struct _dongle *d,
+				const struct libusb_config_descriptor *conf)
 {
-	return d->d_state == DONGLE_STATE_ZEROCD;
-}
+	const struct libusb_interface_descriptor *intf;
+	const struct libusb_endpoint_descriptor *ep;
+	unsigned int i;
 
-static void _hex_dumpf(FILE *f, const uint8_t *tmp, size_t len, size_t llen)
-{
-	size_t i, j;
-	size_t line;
-
-	if ( NULL == f || 0 == len )
+	if ( conf->bNumInterfaces <= DONGLE_DATA_IFACE )
+		return;
+	if ( conf->interface[DONGLE_DATA_IFACE].num_altsetting < 1 )
 		return;
 
-	for(j = 0; j < len; j += line, tmp += line) {
-		if ( j + llen > len ) {
-			line = len - j;
+	intf = &conf->interface[DONGLE_DATA_IFACE].altsetting[0];
+	for(i = 0; i < intf->bNumEndpoints; i++) {
+		ep = &intf->endpoint[i];
+		if ( (ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) !=
+				LIBUSB_TRANSFER_TYPE_BULK )
+			continue;
+		if ( ep->bEndpointAddress & LIBUSB_ENDPOINT_IN ) {
+			d->d_data_in_ep = ep->bEndpointAddress;
 		}else{
-			line = llen;
+			d->d_data_out_ep = ep->bEndpointAddress;
+			d->d_data_mps = ep->wMaxPacketSize;
 		}
-
-		fprintf(f, " | %05x : ", j);
-
-		for(i = 0; i < line; i++) {
-			if ( isprint(tmp[i]) ) {
-				fprintf(f, "%c", tmp[i]);
-			}else{
-				fprintf(f, ".");
-			}
-		}
-
-		for(; i < llen; i++)
-			fprintf(f, " ");
-
-		for(i = 0; i < line; i++)
-			fprintf(f, " %02x", tmp[i]);
-
-		fprintf(f, "\n");
 	}
-	fprintf(f, "\n");
 }
 
-static void hex_dump(const uint8_t *ptr, size_t len, size_t llen)
+int dongle_needs_ready(dongle_t d)
 {
-	_hex_dumpf(stdout, ptr, len, llen);
+	return d->d_state == DONGLE_STATE_ZEROCD;
 }
 
-static int do_init_cycle(struct _dongle *d, const uint8_t *ptr, size_t len)
+static uint64_t now_us(void)
 {
-	uint8_t buf[4096];
-	int ret, rc;
-
-	printf("--- Init Cycle ---\n");
-
-	ret = libusb_control_transfer(d->d_handle, 0x21, 0x0, 0, 4,
-					(uint8_t *)ptr, len, 1000);
-	if ( ret < 0 ) {
-		fprintf(stderr, "%s: libusb_control_transfer_x: %s\n",
-			odw_cmd, os_err());
-		return 0;
-	}
+	struct timespec ts;
 
-	rc = libusb_bulk_transfer(d->d_handle,
-					LIBUSB_ENDPOINT_IN | 6,
-					buf, 8,
-					&ret, 1000);
-	if ( rc > 0 ) {
-		printf("Got %d bytes\n", ret);
-		hex_dump(buf, ret, 16);
-	}
-
-	ret = libusb_control_transfer(d->d_handle, 0xa1, 0x1, 0, 4,
-					buf, sizeof(buf), 1000);
-	if ( ret < 0 ) {
-		fprintf(stderr, "%s: libusb_control_transfer_x: %s\n",
-			odw_cmd, os_err());
-		return 0;
-	}
-	hex_dump(buf, ret, 16);
-
-	return 1;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
 }
 
-static int init_stuff(struct _dongle *d)
-{
-	const uint8_t msg_1[2] = { 0, 0 };
-	const uint8_t msg_2[16] = {1, 0xf, 0, 0, 0, 0, 0, 1,
-				0x21, 0, 4, 0, 1, 1, 0, 0xff};
-	const uint8_t msg_3[16] = {1, 0xf, 0, 0, 0, 0, 0, 2,
-				0x22, 0, 4, 0, 1, 1, 0, 0x2};
-	const uint8_t msg_4[13] = {1, 0xc, 0, 0, 2, 1, 0, 1,
-				0, 0x21, 0, 0, 0}; /* qualcomm inc */
-	const uint8_t msg_5[13] = {1, 0xc, 0, 0, 2, 1, 0, 2,
-				0, 0x24, 0, 0, 0};
-	const uint8_t msg_6[13] = {1, 0xc, 0, 0, 2, 1, 0, 3,
-				0, 0x25, 0, 0, 0}; /* returns IMEI */
-	const uint8_t msg_7[17] = {1, 0x10, 0, 0, 0, 0, 0, 3,
-				0x23, 0, 5, 0, 1, 2, 0, 2, 1};
-	const uint8_t msg_8[16] = {1, 0xf, 0, 0, 0, 0, 0, 4,
-				0x22, 0, 4, 0, 1, 1, 0, 1};
-	const uint8_t msg_9[16] = {1, 0xf, 0, 0, 0, 0, 0, 5,
-				0x20, 0, 4, 0, 1, 1, 0, 0};
-#if 0
-	const uint8_t msg_10[13] = {1, 0xc, 0, 0, 2, 2, 0, 8,
-				0, 0x21, 0, 0, 0}; /* returns MTU */
-	const uint8_t msg_11[13] = {1, 0xc, 0, 0, 2, 2, 0, 0xb,
-				0, 0x24, 0, 0, 0}; /* returns firmware ver */
-#endif
-	uint8_t buf[4096];
-	int ret;
-
-	ret = libusb_control_transfer(d->d_handle, 0x21, 0x02, 1, 4,
-				(uint8_t *)msg_1, sizeof(msg_1), 10000);
-	if ( ret < 0 ) {
-		fprintf(stderr, "%s: libusb_control_transfer_1: %d %s\n",
-			odw_cmd, ret, os_err());
-		//return 0;
-	}
-
-	if ( !do_init_cycle(d, msg_2, sizeof(msg_2)) )
-		return 0;
-	if ( !do_init_cycle(d, msg_3, sizeof(msg_3)) )
-		return 0;
-	if ( !do_init_cycle(d, msg_4, sizeof(msg_4)) )
-		return 0;
-	if ( !do_init_cycle(d, msg_5, sizeof(msg_5)) )
-		return 0;
-	if ( !do_init_cycle(d, msg_6, sizeof(msg_6)) )
-		return 0;
-	if ( !do_init_cycle(d, msg_7, sizeof(msg_7)) )
-		return 0;
-	if ( !do_init_cycle(d, msg_8, sizeof(msg_8)) )
-		return 0;
-	if ( !do_init_cycle(d, msg_9, sizeof(msg_9)) )
-		return 0;
-#if 0
-	if ( !do_init_cycle(d, msg_10, sizeof(msg_10)) )
-		return 0;
-	if ( !do_init_cycle(d, msg_11, sizeof(msg_11)) )
-		return 0;
-#endif
-
-	printf("--- Should return zero ---\n");
-	ret = libusb_control_transfer(d->d_handle, 0xa1, 0xfe, 0, 5,
-					buf, 1, 1000);
-	if ( ret < 0 ) {
-		fprintf(stderr, "%s: libusb_control_transfer_final: %s\n",
-			odw_cmd, os_err());
-		return 0;
-	}
-	hex_dump(buf, ret, 16);
-
-	return 1;
-}
-
-int dongle_init(dongle_t d)
+/* Set config #1 and claim everything on it */
+static int claim_all(struct _dongle *d)
 {
 	struct libusb_config_descriptor *conf = NULL;
-	libusb_device *dev;
+	struct xport *x = d->d_xport;
 	unsigned int i, j;
 
-	if ( d->d_state == DONGLE_STATE_ZEROCD ) {
-		fprintf(stderr, "%s: Device needs to be made ready\n", odw_cmd);
-		return 0;
-	}
-
-	if ( d->d_state >= DONGLE_STATE_LIVE )
-		return 1;
-
 	/* First pass killing drivers, so we can set config */
-	if ( !kill_kernel_driver(d->d_handle, 1) )
+	if ( !kill_kernel_driver(x, 1) )
 		goto err;
 
-	if ( libusb_set_configuration(d->d_handle, 1) ) {
+	if ( x->x_ops->set_config(x, 1) ) {
 		fprintf(stderr, "%s: libusb_set_configuration: %s\n",
 			odw_cmd, os_err());
 		goto err;
 	}
 
-	printf("%s: set config #1\n", odw_cmd);
+	if ( odw_verbose )
+		printf("%s: set config #1\n", odw_cmd);
 
-	dev = libusb_get_device(d->d_handle);
-	if ( libusb_get_active_config_descriptor(dev, &conf) )
+	if ( x->x_ops->get_config(x, &conf) )
 		goto err;
 
 	/* Claim all interfaces */
 	for(i = 0; i < conf->bNumInterfaces - 1U; i++) {
-		libusb_detach_kernel_driver(d->d_handle, i);
-		if ( libusb_claim_interface(d->d_handle, i) < 0 ) {
+		x->x_ops->detach_kernel(x, i);
+		if ( x->x_ops->claim(x, i) < 0 ) {
 			fprintf(stderr, "%s: libusb_claim_interface: %s\n",
 				odw_cmd, os_err());
 			goto err_release;
 		}
-		printf("%s: claimed interface %u\n", odw_cmd, i);
+		if ( odw_verbose )
+			printf("%s: claimed interface %u\n", odw_cmd, i);
 	}
 
-	libusb_free_config_descriptor(conf);
+	x->x_ops->free_config(x, conf);
 
 	/* Re-check that we claimed interfaces on the right config and
 	 * it didn't get changed from under us */
-	if ( libusb_get_active_config_descriptor(dev, &conf) ) {
+	if ( x->x_ops->get_config(x, &conf) ) {
 		conf = NULL;
 		goto err_release;
 	}
@@ -317,64 +230,174 @@ int dongle_init(dongle_t d)
 		goto err;
 	}
 
-	libusb_free_config_descriptor(conf);
+	find_data_endpoints(d, conf);
 
-	init_stuff(d);
-	d->d_state = DONGLE_STATE_LIVE;
+	x->x_ops->free_config(x, conf);
 	return 1;
 
 err_release:
 	for(j = 0; j < i; j++)
-		libusb_release_interface(d->d_handle, j);
+		x->x_ops->release(x, j);
 err:
 	if ( conf )
-		libusb_free_config_descriptor(conf);
+		x->x_ops->free_config(x, conf);
 	return 0;
 }
 
-int dongle_ready(dongle_t d)
+static void init_done(struct _dongle *d, int ok)
 {
-	static const uint8_t buf[0x1f] = {
-		0x55, 0x53, 0x42, 0x43, 0x68, 0xcd, 0xb7, 0xff,
-		0x24, 0x00, 0x00, 0x00, 0x80, 0x00, 0x06, 0x85,
-		0x00, 0x00, 0x00, 0x24, 0x00, 0x00, 0x00, 0x00,
-		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	};
-	int ret, rc;
+	d->d_link_us = now_us() - d->d_init_start;
 
-	if ( d->d_state != DONGLE_STATE_ZEROCD )
+	/* A modem which didn't like the handshake may well still work,
+	 * it always used to be let through
+	 */
+	trace_state(d, TRACE_MACHINE_DONGLE, d->d_state, DONGLE_STATE_LIVE);
+	d->d_state = DONGLE_STATE_LIVE;
+
+	d->d_at = atchan_new(d);
+	urc_init(d);
+
+	if ( odw_verbose ) {
+		printf("%s: %s: link in %"PRIu32" us\n",
+			odw_cmd, d->d_serial, d->d_link_us);
+	}
+
+	(*d->d_init_done)(d, ok, d->d_init_priv);
+}
+
+/* Claim the dongle and get its handshake in flight, done is called
+ * from the eventloop once it's live. Returns zero, without calling
+ * done, if it couldn't get that far.
+ */
+int dongle__init_start(struct _dongle *d, dongle_init_done_t done,
+			void *priv)
+{
+	uint64_t now;
+
+	if ( d->d_state == DONGLE_STATE_ZEROCD ) {
+		fprintf(stderr, "%s: Device needs to be made ready\n", odw_cmd);
+		return 0;
+	}
+
+	if ( d->d_state >= DONGLE_STATE_LIVE || d->d_hs )
+		return 0;
+
+	if ( NULL == d->d_stats ) {
+		d->d_stats = stats_new(DONGLE_COUNTERS_DONGLE, d->d_serial);
+		if ( NULL == d->d_stats )
+			return 0;
+	}
+
+	trace_name(d, d->d_serial);
+	d->d_init_start = now_us();
+	d->d_init_done = done;
+	d->d_init_priv = priv;
+
+	if ( !claim_all(d) )
+		return 0;
+
+	now = now_us();
+	d->d_phase_us[DONGLE_PHASE_CLAIM] = now - d->d_init_start;
+
+	return handshake_start(d, init_done);
+}
+
+struct init_sync {
+	int complete;
+	int ok;
+};
+
+static void init_sync_done(struct _dongle *d, int ok, void *priv)
+{
+	struct init_sync *s = priv;
+
+	s->ok = ok;
+	s->complete = 1;
+}
+
+int dongle_init(dongle_t d)
+{
+	struct init_sync s = { 0, 0 };
+
+	if ( d->d_state >= DONGLE_STATE_LIVE )
 		return 1;
 
+	if ( !dongle__init_start(d, init_sync_done, &s) )
+		return 0;
+
+	usbio_run(d->d_usb, d->d_xport, &s.complete);
+	return 1;
+}
+
+uint32_t dongle_link_us(dongle_t d)
+{
+	return d->d_link_us;
+}
+
+static const uint8_t eject_cbw[0x1f] = {
+	0x55, 0x53, 0x42, 0x43, 0x68, 0xcd, 0xb7, 0xff,
+	0x24, 0x00, 0x00, 0x00, 0x80, 0x00, 0x06, 0x85,
+	0x00, 0x00, 0x00, 0x24, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+/* Get as far as having the eject command in flight */
+static struct usbio_req *ready_start(struct _dongle *d)
+{
+	struct xport *x = d->d_xport;
+	struct usbio_req *r;
+	int rc;
+
 	printf("%s: Mode-switching %s\n", odw_cmd, d->d_serial);
-	if ( !kill_kernel_driver(d->d_handle, 1) ) {
+	if ( !kill_kernel_driver(x, 1) ) {
 		fprintf(stderr, "%s: kill_kernel_driver: %s\n",
 			odw_cmd, os_err());
-		return 0;
+		return NULL;
 	}
 
-	if ( libusb_set_configuration(d->d_handle, 1) ) {
+	if ( x->x_ops->set_config(x, 1) ) {
 		fprintf(stderr, "%s: libusb_set_configuration: %s\n",
 			odw_cmd, os_err());
-		return 0;
+		return NULL;
 	}
 
 	/* FIXME: wrong interface to claim */
-	if ( libusb_claim_interface(d->d_handle, 0) ) {
+	if ( x->x_ops->claim(x, 0) ) {
 		fprintf(stderr, "%s: libusb_claim_interface: %s\n",
 		odw_cmd, os_err());
-		return 0;
+		return NULL;
 	}
 
-	rc = libusb_bulk_transfer(d->d_handle, 1,
-				(uint8_t *)buf, sizeof(buf),
-				&ret, 1000);
-	if ( rc < 0 || (size_t)ret != sizeof(buf) ) {
+	r = usbio_req_new(sizeof(eject_cbw));
+	if ( NULL == r )
+		return NULL;
+
+	memcpy(usbio_req_data(r), eject_cbw, sizeof(eject_cbw));
+	rc = usbio_bulk(r, x, 1, sizeof(eject_cbw), 1000, NULL, NULL);
+	if ( rc ) {
 		fprintf(stderr, "%s: libusb_bulk_transfer: %s\n",
-			odw_cmd, os_err());
+			odw_cmd, libusb_error_name(rc));
+		usbio_req_free(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+static int ready_finish(struct _dongle *d, struct usbio_req *r)
+{
+	struct xport *x = d->d_xport;
+	int rc;
+
+	rc = usbio_wait(d->d_usb, r);
+	usbio_req_free(r);
+	if ( rc < 0 || (size_t)rc != sizeof(eject_cbw) ) {
+		fprintf(stderr, "%s: libusb_bulk_transfer: %s\n",
+			odw_cmd, libusb_error_name(rc));
 		return 0;
 	}
 
-	if ( libusb_reset_device(d->d_handle) ) {
+	if ( x->x_ops->reset(x) ) {
 		fprintf(stderr, "%s: libusb_reset_device: %s\n",
 			odw_cmd, os_err());
 		return 0;
@@ -383,7 +406,52 @@ int dongle_ready(dongle_t d)
 	return 1;
 }
 
-struct _dongle *dongle__open(libusb_device *dev, unsigned int flags)
+/* Mode-switch a batch of dongles, all with their eject commands in
+ * flight at once. Returns how many of them are switching, and which
+ * in ok if it's given. They go away and come back re-enumerated as
+ * modems.
+ */
+size_t dongle__ready_many(struct _dongle **d, size_t nmemb, uint8_t *ok)
+{
+	struct usbio_req **r;
+	size_t i, ret = 0;
+
+	r = calloc(nmemb, sizeof(*r));
+	if ( NULL == r ) {
+		fprintf(stderr, "%s: calloc: %s\n", odw_cmd, os_err());
+		return 0;
+	}
+
+	for(i = 0; i < nmemb; i++) {
+		if ( d[i]->d_state == DONGLE_STATE_ZEROCD )
+			r[i] = ready_start(d[i]);
+	}
+
+	for(i = 0; i < nmemb; i++) {
+		if ( ok )
+			ok[i] = 0;
+		if ( r[i] && ready_finish(d[i], r[i]) ) {
+			if ( ok )
+				ok[i] = 1;
+			ret++;
+		}
+	}
+
+	free(r);
+	return ret;
+}
+
+int dongle_ready(dongle_t d)
+{
+	if ( d->d_state != DONGLE_STATE_ZEROCD )
+		return 1;
+
+	return dongle__ready_many(&d, 1, NULL) == 1;
+}
+
+/* Takes ownership of the transport, closing it on failure */
+static struct _dongle *dongle__new(struct usbio *u, struct xport *x,
+					unsigned int flags)
 {
 	struct libusb_device_descriptor desc;
 	struct _dongle *d;
@@ -395,11 +463,11 @@ struct _dongle *dongle__open(libusb_device *dev, unsigned int flags)
 		goto err;
 	}
 
-	if ( libusb_open(dev, &d->d_handle) ) {
-		fprintf(stderr, "%s: libusb_open: %s\n",
-			odw_cmd, os_err());
-		goto err_free;
-	}
+	d->d_usb = u;
+	d->d_xport = x;
+	d->d_at_in_ep = LIBUSB_ENDPOINT_IN | 2;
+	d->d_at_out_ep = LIBUSB_ENDPOINT_OUT | 2;
+	INIT_LIST_HEAD(&d->d_list);
 
 	if ( flags & DEVLIST_ZEROCD ) {
 		d->d_state = DONGLE_STATE_ZEROCD;
@@ -407,14 +475,14 @@ struct _dongle *dongle__open(libusb_device *dev, unsigned int flags)
 		d->d_state = DONGLE_STATE_READY;
 	}
 
-	if ( libusb_get_device_descriptor(dev, &desc) )
-		goto err_close;
+	if ( x->x_ops->get_desc(x, &desc) )
+		goto err_free;
 
 	d->d_serial = get_string(d, desc.iSerialNumber);
 	if ( NULL == d->d_serial ) {
 		fprintf(stderr, "%s: get_serial: %s\n",
 			odw_cmd, os_err());
-		goto err_close;
+		goto err_free;
 	}
 
 	d->d_product = get_string(d, desc.iProduct);
@@ -436,64 +504,147 @@ err_strings:
 	free(d->d_serial);
 	free(d->d_mnfr);
 	free(d->d_product);
-err_close:
-	libusb_close(d->d_handle);
 err_free:
 	free(d);
 err:
+	x->x_ops->close(x);
 	return NULL;
 }
 
-int dongle_atcmd(dongle_t d, const char *cmd)
+struct _dongle *dongle__open(struct usbio *u, libusb_device *dev,
+				unsigned int flags)
 {
-	uint8_t buf[4096];
-	size_t cmd_len = strlen(cmd);
-	int ret, rc, i;
+	struct xport *x;
 
-	if ( d->d_state != DONGLE_STATE_LIVE )
-		return 0;
+	x = xport_libusb_open(u, dev);
+	if ( NULL == x )
+		return NULL;
 
-	//printf("ATCMD %d bytes\n", cmd_len);
-	//hex_dump(cmd, cmd_len, 16);
-	rc = libusb_bulk_transfer(d->d_handle, 2,
-					(uint8_t *)cmd, cmd_len, &ret,
-					1000);
-	if ( rc < 0 || (size_t)ret != cmd_len ) {
-		fprintf(stderr, "%s: libusb_bulk_transfer: %s\n",
-			odw_cmd, os_err());
+	return dongle__new(u, x, flags);
+}
+
+struct _dongle *dongle__open_emu(struct usbio *u, unsigned int idx,
+					unsigned int flags)
+{
+	struct xport *x;
+
+	x = xport_emu_open(u, idx);
+	if ( NULL == x )
+		return NULL;
+
+	return dongle__new(u, x, flags);
+}
+
+int dongle_at(dongle_t d, const char *cmd, dongle_at_t fn, void *priv)
+{
+	if ( d->d_state != DONGLE_STATE_LIVE || NULL == d->d_at )
 		return 0;
+
+	return atchan_send(d->d_at, cmd, fn, priv);
+}
+
+struct atcmd_sync {
+	int complete;
+	int result;
+};
+
+static void atcmd_print(void *priv, int result, const char *resp, size_t len)
+{
+	struct atcmd_sync *s = priv;
+	const char *end = resp + len, *nl, *eol;
+
+	for(; resp && resp < end; resp = nl + 1) {
+		nl = memchr(resp, '\n', end - resp);
+		if ( NULL == nl )
+			nl = end;
+		for(eol = nl; eol > resp && eol[-1] == '\r'; eol--)
+			/* do nothing */;
+		if ( eol > resp )
+			printf("<<< %.*s\n", (int)(eol - resp), resp);
 	}
 
-	i = 0;
-	do {
-		rc = libusb_bulk_transfer(d->d_handle, LIBUSB_ENDPOINT_IN | 2,
-						buf, sizeof(buf),
-						&ret, 3000);
-		if ( rc < 0 ) {
-			fprintf(stderr, "%s: libusb_bulk_transfer: %d\n",
-				odw_cmd, rc);
-			continue;
-		}
+	if ( result == DONGLE_AT_TIMEOUT )
+		printf("<<< (timed out)\n");
 
-		printf("<<< %.*s\n", ret, buf);
-		//hex_dump(buf, ret, 16);
-		i++;
-	}while(i < 2);
+	s->result = result;
+	s->complete = 1;
+}
 
-	return 1;
+/* Send a command and print the response when it comes */
+int dongle_atcmd(dongle_t d, const char *cmd)
+{
+	struct atcmd_sync s = { 0, 0 };
+
+	if ( !dongle_at(d, cmd, atcmd_print, &s) )
+		return 0;
+
+	usbio_run(d->d_usb, d->d_xport, &s.complete);
+	return s.result == DONGLE_AT_OK;
+}
+
+static const char *tap_name = "zte%d";
+static unsigned int tap_flags;
+
+void dongle_tap_flags(unsigned int flags)
+{
+	tap_flags = flags;
 }
 
-int dongle_ifup(dongle_t d)
+/* With TAPIF_MULTI_QUEUE every dongle opens its own queue of the one
+ * named device, so the kernel's flow hashing spreads traffic across
+ * the modems and the worker threads they live on.
+ */
+void dongle_tap_name(const char *ifname)
+{
+	tap_name = ifname;
+}
+
+int dongle_ifup(dongle_t d, struct iothread *t)
 {
 	tapif_t tapif;
 
 	if ( d->d_state != DONGLE_STATE_LIVE )
 		return 0;
 
-	tapif = tapif_open("zte%d");
+	if ( d->d_dp )
+		return 1;
+
+	tapif = tapif_open(tap_name, tap_flags);
 	if ( NULL == tapif )
 		return 0;
 
-	tapif_close(tapif);
+	d->d_dp = datapath_start(d, t, tapif);
+	if ( NULL == d->d_dp ) {
+		tapif_close(tapif);
+		return 0;
+	}
+
 	return 1;
 }
+
+void dongle_stats(dongle_t d, FILE *f)
+{
+	if ( NULL == d->d_dp )
+		return;
+
+	fprintf(f, "%s: %s: link in %"PRIu32" us: claim %"PRIu32
+		" sync %"PRIu32" qmi %"PRIu32" final %"PRIu32"\n",
+		datapath_ifname(d->d_dp), d->d_serial, d->d_link_us,
+		d->d_phase_us[DONGLE_PHASE_CLAIM],
+		d->d_phase_us[DONGLE_PHASE_SYNC],
+		d->d_phase_us[DONGLE_PHASE_QMI],
+		d->d_phase_us[DONGLE_PHASE_FINAL]);
+	datapath_dump(d->d_dp, f);
+}
+
+void dongle_ifdown(dongle_t d)
+{
+	if ( NULL == d->d_dp )
+		return;
+
+	if ( odw_stats || odw_verbose )
+		dongle_stats(d, stdout);
+
+	datapath_stop(d->d_dp);
+	d->d_dp = NULL;
+}
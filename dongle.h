@@ -5,8 +5,28 @@
 
 #define DEVLIST_ZEROCD	(1 << 0)
 
+/* Interface which carries the QMI control channel and network data */
+#define DONGLE_DATA_IFACE	4
+
+/* Bring-up is timed phase by phase, in microseconds */
+#define DONGLE_PHASE_CLAIM	0	/* set config, claim interfaces */
+#define DONGLE_PHASE_SYNC	1	/* control line state */
+#define DONGLE_PHASE_QMI	2	/* QMI request/response cycles */
+#define DONGLE_PHASE_FINAL	3
+#define DONGLE_NR_PHASES	4
+
+struct atchan;
+struct datapath;
+struct handshake;
+struct usbio;
+struct xport;
+struct _dongle;
+
+typedef void (*dongle_init_done_t)(struct _dongle *d, int ok, void *priv);
+
 struct _dongle {
-	libusb_device_handle 	*d_handle;
+	struct usbio		*d_usb;
+	struct xport		*d_xport;
 #define DONGLE_STATE_ZEROCD	0
 #define DONGLE_STATE_READY	1
 #define DONGLE_STATE_LIVE	2
@@ -18,9 +38,55 @@ struct _dongle {
 
 	uint8_t			d_at_in_ep;
 	uint8_t			d_at_out_ep;
+
+	uint8_t			d_data_in_ep;
+	uint8_t			d_data_out_ep;
+	uint16_t		d_data_mps;
+
+	struct datapath		*d_dp;
+
+	struct atchan		*d_at;
+	struct handshake	*d_hs;
+	dongle_init_done_t	d_init_done;
+	void			*d_init_priv;
+	uint64_t		d_init_start;
+	uint32_t		d_phase_us[DONGLE_NR_PHASES];
+	uint32_t		d_link_us;
+
+	struct stats		*d_stats;
 };
 
-struct _dongle *dongle__open(libusb_device *dev, unsigned int flags);
+struct _dongle *dongle__open(struct usbio *u, libusb_device *dev,
+				unsigned int flags);
+struct _dongle *dongle__open_emu(struct usbio *u, unsigned int idx,
+					unsigned int flags);
+struct _dongle *dongle__open_at(struct usbio *u, uint8_t bus, uint8_t addr);
 int dongle__make_live(struct _dongle *d);
+int dongle__init_start(struct _dongle *d, dongle_init_done_t done,
+			void *priv);
+size_t dongle__ready_many(struct _dongle **d, size_t nmemb, uint8_t *ok);
+
+/* atchan.c */
+_private struct atchan *atchan_new(struct _dongle *d);
+_private void atchan_free(struct atchan *a);
+_private int atchan_send(struct atchan *a, const char *cmd,
+				dongle_at_t done, void *priv);
+
+/* urc.c */
+_private int urc_dispatch(struct _dongle *d, const char *line, size_t len);
+_private void urc_init(struct _dongle *d);
+
+/* handshake.c */
+typedef void (*handshake_done_t)(struct _dongle *d, int ok);
+_private int handshake_start(struct _dongle *d, handshake_done_t done);
+_private void handshake_abort(struct _dongle *d);
+
+/* datapath.c */
+_private struct datapath *datapath_start(struct _dongle *d,
+					struct iothread *t, tapif_t tap);
+_private void datapath_stop(struct datapath *dp);
+_private uint64_t datapath_bytes(struct datapath *dp);
+_private const char *datapath_ifname(struct datapath *dp);
+_private void datapath_dump(struct datapath *dp, FILE *f);
 
 #endif /* _DONGLE_H */
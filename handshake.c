@@ -0,0 +1,453 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * The QMI control-plane handshake which takes a claimed dongle to a
+ * live link. It runs as a state machine on async transfers so that a
+ * whole batch of dongles can be brought up from one eventloop. Each
+ * request goes out as soon as the response to the previous one has
+ * been read, the notify endpoint only being waited on to find out
+ * when that is.
+ *
+ * Functions:
+ *  o handshake_start() - Begin the handshake on a claimed dongle
+ *  o handshake_abort() - Cancel a handshake in progress
+*/
+
+#include <libusb-1.0/libusb.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compiler.h"
+#include "list.h"
+#include "nbio.h"
+#include "ondawagon.h"
+#include "tapif.h"
+#include "dongle.h"
+#include "pktpool.h"
+#include "usbio.h"
+#include "xport.h"
+#include "hist.h"
+#include "stats.h"
+#include "trace.h"
+
+#define HS_SYNC		0	/* set the control line state */
+#define HS_SEND		1	/* a QMI request going out */
+#define HS_RECV		2	/* fetching the response to it */
+#define HS_FINAL	3	/* the should-return-zero request */
+#define HS_DONE		4
+
+#define HS_RESP_MAX	4096
+#define HS_NOTIFY_EP	(LIBUSB_ENDPOINT_IN | 6)
+#define HS_NOTIFY_LEN	8
+/* fetches which didn't answer our request before we move on anyway */
+#define HS_TRIES	4
+
+static const uint8_t msg_1[2] = { 0, 0 };
+static const uint8_t msg_2[16] = {1, 0xf, 0, 0, 0, 0, 0, 1,
+			0x21, 0, 4, 0, 1, 1, 0, 0xff};
+static const uint8_t msg_3[16] = {1, 0xf, 0, 0, 0, 0, 0, 2,
+			0x22, 0, 4, 0, 1, 1, 0, 0x2};
+static const uint8_t msg_4[13] = {1, 0xc, 0, 0, 2, 1, 0, 1,
+			0, 0x21, 0, 0, 0}; /* qualcomm inc */
+static const uint8_t msg_5[13] = {1, 0xc, 0, 0, 2, 1, 0, 2,
+			0, 0x24, 0, 0, 0};
+static const uint8_t msg_6[13] = {1, 0xc, 0, 0, 2, 1, 0, 3,
+			0, 0x25, 0, 0, 0}; /* returns IMEI */
+static const uint8_t msg_7[17] = {1, 0x10, 0, 0, 0, 0, 0, 3,
+			0x23, 0, 5, 0, 1, 2, 0, 2, 1};
+static const uint8_t msg_8[16] = {1, 0xf, 0, 0, 0, 0, 0, 4,
+			0x22, 0, 4, 0, 1, 1, 0, 1};
+static const uint8_t msg_9[16] = {1, 0xf, 0, 0, 0, 0, 0, 5,
+			0x20, 0, 4, 0, 1, 1, 0, 0};
+#if 0
+static const uint8_t msg_10[13] = {1, 0xc, 0, 0, 2, 2, 0, 8,
+			0, 0x21, 0, 0, 0}; /* returns MTU */
+static const uint8_t msg_11[13] = {1, 0xc, 0, 0, 2, 2, 0, 0xb,
+			0, 0x24, 0, 0, 0}; /* returns firmware ver */
+#endif
+
+static const struct {
+	const uint8_t *ptr;
+	size_t len;
+}msgs[] = {
+	{ msg_2, sizeof(msg_2) },
+	{ msg_3, sizeof(msg_3) },
+	{ msg_4, sizeof(msg_4) },
+	{ msg_5, sizeof(msg_5) },
+	{ msg_6, sizeof(msg_6) },
+	{ msg_7, sizeof(msg_7) },
+	{ msg_8, sizeof(msg_8) },
+	{ msg_9, sizeof(msg_9) },
+};
+#define NR_MSGS (sizeof(msgs)/sizeof(*msgs))
+
+struct handshake {
+	struct _dongle		*h_dongle;
+	handshake_done_t	h_done;
+	struct usbio_req	*h_ctl;
+	struct usbio_req	*h_notify;
+	struct usbio_defer	h_complete;
+	uint64_t		h_phase;
+	uint64_t		h_sent;
+	uint64_t		h_ctl_start;
+	unsigned int		h_state;
+	unsigned int		h_idx;
+	unsigned int		h_tries;
+	int			h_ctl_busy;
+	int			h_notify_busy;
+	int			h_notified;
+	int			h_ok;
+};
+
+static void hs_state(struct handshake *h, unsigned int state)
+{
+	trace_state(h->h_dongle, TRACE_MACHINE_HANDSHAKE, h->h_state, state);
+	h->h_state = state;
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Close off the current phase and start timing the next */
+static void hs_phase(struct handshake *h, unsigned int phase)
+{
+	uint64_t now = now_us();
+
+	h->h_dongle->d_phase_us[phase] = now - h->h_phase;
+	h->h_phase = now;
+}
+
+/* Only once neither transfer is in flight can we let go of them */
+static void hs_maybe_complete(struct handshake *h)
+{
+	if ( h->h_state != HS_DONE || h->h_ctl_busy || h->h_notify_busy )
+		return;
+	usbio_defer(h->h_dongle->d_usb, &h->h_complete);
+}
+
+static void hs_finish(struct handshake *h, int ok)
+{
+	hs_state(h, HS_DONE);
+	h->h_ok = ok;
+	if ( h->h_notify_busy )
+		usbio_cancel(h->h_notify);
+	hs_maybe_complete(h);
+}
+
+static void hs_fail(struct handshake *h, const char *what, int rc)
+{
+	fprintf(stderr, "%s: %s: handshake: %s: %s\n", odw_cmd,
+		h->h_dongle->d_serial, what, libusb_error_name(rc));
+	stats_usb_err(&h->h_dongle->d_stats->s_ctr, rc);
+	hs_finish(h, 0);
+}
+
+static void ctl_done(struct usbio_req *r);
+static void notify_done(struct usbio_req *r);
+
+static int hs_control(struct handshake *h, uint8_t type, uint8_t req,
+			uint16_t val, uint16_t idx, const uint8_t *data,
+			uint16_t len, unsigned int timeout)
+{
+	struct _dongle *d = h->h_dongle;
+	int rc;
+
+	if ( !(type & LIBUSB_ENDPOINT_IN) )
+		memcpy(usbio_req_data(h->h_ctl), data, len);
+
+	h->h_ctl_start = hist_now();
+	rc = usbio_control(h->h_ctl, d->d_xport, type, req, val, idx, len,
+				timeout, ctl_done, h);
+	if ( rc ) {
+		hs_fail(h, "submit", rc);
+		return 0;
+	}
+
+	h->h_ctl_busy = 1;
+	return 1;
+}
+
+/* Responses are announced on the notify endpoint, keep a read posted
+ * there for as long as we're expecting one
+ */
+static int hs_listen(struct handshake *h)
+{
+	struct _dongle *d = h->h_dongle;
+	int rc;
+
+	if ( h->h_notify_busy )
+		return 1;
+
+	h->h_notified = 0;
+	rc = usbio_bulk(h->h_notify, d->d_xport, HS_NOTIFY_EP,
+			HS_NOTIFY_LEN, 1000, notify_done, h);
+	if ( rc ) {
+		hs_fail(h, "notify", rc);
+		return 0;
+	}
+
+	h->h_notify_busy = 1;
+	return 1;
+}
+
+static void hs_send(struct handshake *h)
+{
+	hs_state(h, HS_SEND);
+	h->h_tries = 0;
+	h->h_sent = now_us();
+
+	if ( !hs_listen(h) )
+		return;
+
+	hs_control(h, 0x21, 0x0, 0, DONGLE_DATA_IFACE,
+			msgs[h->h_idx].ptr, msgs[h->h_idx].len, 1000);
+}
+
+static void hs_fetch(struct handshake *h)
+{
+	hs_control(h, 0xa1, 0x1, 0, DONGLE_DATA_IFACE,
+			NULL, HS_RESP_MAX, 1000);
+}
+
+static void hs_final(struct handshake *h)
+{
+	hs_phase(h, DONGLE_PHASE_QMI);
+	hs_state(h, HS_FINAL);
+	hs_control(h, 0xa1, 0xfe, 0, 5, NULL, 1, 1000);
+}
+
+/* Does a QMUX message answer the request: it must come from the
+ * service, and match the service, client and transaction id. The
+ * transaction id is one byte for the control service, two otherwise.
+ */
+static int qmux_answers(const uint8_t *req, const uint8_t *rsp, size_t len)
+{
+	size_t tid = (req[4]) ? 2 : 1;
+
+	if ( len < 7 + tid || rsp[0] != 1 || !(rsp[3] & 0x80) )
+		return 0;
+	if ( rsp[4] != req[4] || rsp[5] != req[5] )
+		return 0;
+	return !memcmp(rsp + 7, req + 7, tid);
+}
+
+static void hs_response(struct handshake *h, struct usbio_req *r)
+{
+	struct _dongle *d = h->h_dongle;
+	const uint8_t *rsp = usbio_req_data(r);
+
+	if ( !qmux_answers(msgs[h->h_idx].ptr, rsp, r->r_len) ) {
+		/* nothing queued yet, or an indication, wait for more */
+		if ( ++h->h_tries < HS_TRIES ) {
+			d->d_stats->s_ctr.retries++;
+			hs_listen(h);
+			return;
+		}
+		if ( odw_verbose )
+			printf("%s: %s: qmi %u: no answer, carrying on\n",
+				odw_cmd, d->d_serial, h->h_idx + 1);
+	}
+
+	if ( odw_verbose ) {
+		printf("%s: %s: qmi %u/%zu: %d bytes in %"PRIu64" us\n",
+			odw_cmd, d->d_serial, h->h_idx + 1, NR_MSGS,
+			r->r_len, now_us() - h->h_sent);
+	}
+
+	if ( ++h->h_idx < NR_MSGS ) {
+		hs_send(h);
+	}else{
+		hs_final(h);
+	}
+}
+
+static void ctl_done(struct usbio_req *r)
+{
+	struct handshake *h = r->r_priv;
+
+	h->h_ctl_busy = 0;
+
+	if ( r->r_err != LIBUSB_ERROR_INTERRUPTED ) {
+		hist_since(&h->h_dongle->d_stats->s_hist[DONGLE_HIST_CONTROL],
+				h->h_ctl_start);
+	}
+
+	switch(h->h_state) {
+	case HS_SYNC:
+		/* as ever, this one is allowed to fail */
+		if ( r->r_err )
+			stats_usb_err(&h->h_dongle->d_stats->s_ctr, r->r_err);
+		if ( r->r_err && odw_verbose ) {
+			printf("%s: %s: handshake: sync: %s\n",
+				odw_cmd, h->h_dongle->d_serial,
+				libusb_error_name(r->r_err));
+		}
+		hs_phase(h, DONGLE_PHASE_SYNC);
+		hs_send(h);
+		break;
+	case HS_SEND:
+		if ( r->r_err ) {
+			hs_fail(h, "send", r->r_err);
+			break;
+		}
+		hs_state(h, HS_RECV);
+		if ( h->h_notified )
+			hs_fetch(h);
+		break;
+	case HS_RECV:
+		if ( r->r_err ) {
+			hs_fail(h, "receive", r->r_err);
+			break;
+		}
+		hs_response(h, r);
+		break;
+	case HS_FINAL:
+		if ( r->r_err ) {
+			hs_fail(h, "final", r->r_err);
+			break;
+		}
+		hs_phase(h, DONGLE_PHASE_FINAL);
+		hs_finish(h, 1);
+		break;
+	default:
+		hs_maybe_complete(h);
+		break;
+	}
+}
+
+static void notify_done(struct usbio_req *r)
+{
+	struct handshake *h = r->r_priv;
+
+	h->h_notify_busy = 0;
+
+	if ( h->h_state == HS_DONE ) {
+		hs_maybe_complete(h);
+		return;
+	}
+
+	if ( r->r_err == LIBUSB_ERROR_NO_DEVICE ) {
+		hs_fail(h, "notify", r->r_err);
+		return;
+	}
+
+	if ( odw_verbose && !r->r_err ) {
+		printf("%s: %s: notify %d bytes\n",
+			odw_cmd, h->h_dongle->d_serial, r->r_len);
+	}
+
+	/* A timeout means go and ask anyway, as we always used to */
+	h->h_notified = 1;
+	if ( h->h_state == HS_RECV && !h->h_ctl_busy )
+		hs_fetch(h);
+}
+
+static void hs_free(struct handshake *h)
+{
+	usbio_req_free(h->h_ctl);
+	usbio_req_free(h->h_notify);
+	free(h);
+}
+
+static void hs_complete(struct usbio_defer *f)
+{
+	struct handshake *h = container_of(f, struct handshake, h_complete);
+	struct _dongle *d = h->h_dongle;
+	handshake_done_t done = h->h_done;
+	int ok = h->h_ok;
+
+	d->d_hs = NULL;
+	hs_free(h);
+	(*done)(d, ok);
+}
+
+/* The dongle must have had its interfaces claimed, done is called
+ * from the eventloop once the handshake has finished either way
+ */
+int handshake_start(struct _dongle *d, handshake_done_t done)
+{
+	struct handshake *h;
+	int rc;
+
+	h = calloc(1, sizeof(*h));
+	if ( NULL == h ) {
+		fprintf(stderr, "%s: calloc: %s\n", odw_cmd, os_err());
+		return 0;
+	}
+
+	h->h_ctl = usbio_req_new(HS_RESP_MAX);
+	h->h_notify = usbio_req_new(HS_NOTIFY_LEN);
+	if ( NULL == h->h_ctl || NULL == h->h_notify ) {
+		fprintf(stderr, "%s: usbio_req_new: failed\n", odw_cmd);
+		hs_free(h);
+		return 0;
+	}
+
+	h->h_dongle = d;
+	h->h_done = done;
+	hs_state(h, HS_SYNC);
+	h->h_phase = now_us();
+	usbio_defer_init(&h->h_complete, hs_complete);
+
+	memcpy(usbio_req_data(h->h_ctl), msg_1, sizeof(msg_1));
+	h->h_ctl_start = hist_now();
+	rc = usbio_control(h->h_ctl, d->d_xport, 0x21, 0x02, 1,
+				DONGLE_DATA_IFACE, sizeof(msg_1), 10000,
+				ctl_done, h);
+	if ( rc ) {
+		fprintf(stderr, "%s: %s: handshake: %s\n", odw_cmd,
+			d->d_serial, libusb_error_name(rc));
+		hs_free(h);
+		return 0;
+	}
+
+	h->h_ctl_busy = 1;
+	d->d_hs = h;
+	return 1;
+}
+
+static int hs_busy(void *priv)
+{
+	struct handshake *h = priv;
+
+	return h->h_ctl_busy || h->h_notify_busy;
+}
+
+/* Cancel whatever is in flight and wait for it to come back, done is
+ * not called
+ */
+void handshake_abort(struct _dongle *d)
+{
+	struct handshake *h = d->d_hs;
+	struct xport *x = d->d_xport;
+	int idle;
+
+	if ( NULL == h )
+		return;
+
+	hs_state(h, HS_DONE);
+	if ( h->h_ctl_busy )
+		usbio_cancel(h->h_ctl);
+	if ( h->h_notify_busy )
+		usbio_cancel(h->h_notify);
+
+	idle = usbio_drain(x, hs_busy, h);
+
+	usbio_defer_cancel(&h->h_complete);
+	d->d_hs = NULL;
+
+	/* leaked if the transport can't give us the transfers back */
+	if ( idle )
+		hs_free(h);
+}
@@ -0,0 +1,72 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Reading log-linear histograms, recording them is all in hist.h.
+ *
+ * Functions:
+ *  o dongle_hist_lower() - Smallest value which lands in a bucket
+ *  o dongle_hist_merge() - Add one histogram in to another
+ *  o dongle_hist_percentile() - Estimate a percentile
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "compiler.h"
+#include "ondawagon.h"
+#include "hist.h"
+
+uint64_t dongle_hist_lower(unsigned int idx)
+{
+	unsigned int e, sub;
+
+	if ( idx < (1U << DONGLE_HIST_SUB_BITS) )
+		return idx;
+
+	e = (idx >> DONGLE_HIST_SUB_BITS) + DONGLE_HIST_SUB_BITS - 1;
+	sub = idx & ((1U << DONGLE_HIST_SUB_BITS) - 1);
+	return ((1ULL << DONGLE_HIST_SUB_BITS) + sub) <<
+		(e - DONGLE_HIST_SUB_BITS);
+}
+
+void dongle_hist_merge(struct dongle_hist *dst, const struct dongle_hist *src)
+{
+	unsigned int i;
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if ( src->max > dst->max )
+		dst->max = src->max;
+	for(i = 0; i < DONGLE_HIST_BUCKETS; i++)
+		dst->bucket[i] += src->bucket[i];
+}
+
+/* The lower bound of the bucket it falls in, but never more than the
+ * largest value seen. pct is 0 to 100.
+ */
+uint64_t dongle_hist_percentile(const struct dongle_hist *h, double pct)
+{
+	uint64_t rank, seen = 0, v;
+	unsigned int i;
+
+	if ( !h->count )
+		return 0;
+
+	rank = (uint64_t)((pct / 100.0) * (double)h->count + 0.5);
+	if ( rank < 1 )
+		rank = 1;
+
+	for(i = 0; i < DONGLE_HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if ( seen >= rank )
+			break;
+	}
+
+	if ( i >= DONGLE_HIST_BUCKETS )
+		return h->max;
+
+	v = dongle_hist_lower(i);
+	return (v < h->max) ? v : h->max;
+}
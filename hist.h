@@ -0,0 +1,52 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+*/
+#ifndef _HIST_H
+#define _HIST_H
+
+#include <time.h>
+
+static inline uint64_t hist_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Values below 1 << SUB_BITS get a bucket each, after that the top
+ * SUB_BITS bits below the leading one pick the bucket in its octave
+ */
+static inline unsigned int hist_index(uint64_t v)
+{
+	unsigned int e;
+
+	if ( v < (1U << DONGLE_HIST_SUB_BITS) )
+		return v;
+
+	e = 63 - __builtin_clzll(v);
+	return ((e - DONGLE_HIST_SUB_BITS + 1) << DONGLE_HIST_SUB_BITS) +
+		((v >> (e - DONGLE_HIST_SUB_BITS)) &
+			((1U << DONGLE_HIST_SUB_BITS) - 1));
+}
+
+/* Only ever called by the thread which owns h, readers take their
+ * chances same as with the counters
+ */
+static inline void hist_record(struct dongle_hist *h, uint64_t v)
+{
+	h->count++;
+	h->sum += v;
+	if ( v > h->max )
+		h->max = v;
+	h->bucket[hist_index(v)]++;
+}
+
+static inline void hist_since(struct dongle_hist *h, uint64_t start)
+{
+	hist_record(h, hist_now() - start);
+}
+
+#endif /* _HIST_H */
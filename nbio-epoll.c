@@ -13,60 +13,165 @@
 #include <errno.h>
 #include <sys/epoll.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "compiler.h"
 #include "list.h"
 #include "nbio.h"
 #include "os.h"
 
+/* The event array tracks the number of registered fds so one
+ * epoll_wait() can return everything which is ready
+ */
+struct epoll_priv {
+	int			fd;
+	unsigned int		nr_fds;
+	unsigned int		max_ev;
+	struct epoll_event	*ev;
+};
+
+#define EPOLL_MIN_EV	8
+
+static int upsize_evset(struct epoll_priv *p)
+{
+	struct epoll_event *new;
+	unsigned int max;
+
+	max = p->max_ev * 2;
+
+	new = realloc(p->ev, max * sizeof(*p->ev));
+	if ( new == NULL )
+		return 0;
+
+	p->max_ev = max;
+	p->ev = new;
+	return 1;
+}
+
 static int epoll_init(struct iothread *t)
 {
-	t->priv.epoll = epoll_create(1);
-	if ( t->priv.epoll < 0 )
+	struct epoll_priv *p;
+
+	p = calloc(1, sizeof(*p));
+	if ( p == NULL )
 		return 0;
+
+	p->max_ev = EPOLL_MIN_EV;
+	p->ev = malloc(p->max_ev * sizeof(*p->ev));
+	if ( p->ev == NULL )
+		goto err_free;
+
+	p->fd = epoll_create(1);
+	if ( p->fd < 0 )
+		goto err_free_ev;
+
+	t->priv.ptr = p;
 	return 1;
+
+err_free_ev:
+	free(p->ev);
+err_free:
+	free(p);
+	return 0;
 }
 
 static void epoll_fini(struct iothread *t)
 {
-	while ( close(t->priv.epoll) && (errno == EINTR) )
+	struct epoll_priv *p = t->priv.ptr;
+
+	while ( close(p->fd) && (errno == EINTR) )
 		/* do nothing */;
+	free(p->ev);
+	free(p);
 }
 
 static void epoll_active(struct iothread *t, struct nbio *n)
 {
+	struct epoll_priv *p = t->priv.ptr;
+
 	if ( n->ev_priv.poll == 0 )
 		return;
 	if ( n->fd < 0 )
 		return;
 
 	n->ev_priv.poll = 0;
-	epoll_ctl(t->priv.epoll, EPOLL_CTL_DEL, n->fd, NULL);
+	epoll_ctl(p->fd, EPOLL_CTL_DEL, n->fd, NULL);
+	p->nr_fds--;
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Spin with a zero timeout for up to t->busy_poll usecs before going
+ * to sleep, which saves the wakeup latency at the cost of a CPU. The
+ * spin comes out of the timeout, not on top of it, so *mto is left
+ * with whatever is left over, rounded up to a whole msec.
+ */
+static int epoll_busy_wait(struct iothread *t, struct epoll_priv *p,
+				int *mto)
+{
+	uint64_t start, now, spin;
+	int nfd;
+
+	spin = t->busy_poll;
+	if ( *mto > 0 && spin > (uint64_t)*mto * 1000 )
+		spin = (uint64_t)*mto * 1000;
+
+	start = now = now_us();
+	do {
+		nfd = epoll_wait(p->fd, p->ev, p->max_ev, 0);
+		if ( nfd )
+			return nfd;
+		now = now_us();
+	}while ( now - start < spin );
+
+	if ( *mto > 0 ) {
+		spin = now - start;
+		if ( spin >= (uint64_t)*mto * 1000 ) {
+			*mto = 0;
+		}else{
+			*mto -= spin / 1000;
+		}
+	}
+
+	return 0;
 }
 
 static void epoll_pump(struct iothread *t, int mto)
 {
-	struct epoll_event ev[8];
+	struct epoll_priv *p = t->priv.ptr;
 	struct nbio *n;
 	int nfd, i;
 
+	nfd = 0;
+	if ( t->busy_poll && mto )
+		nfd = epoll_busy_wait(t, p, &mto);
+
 again:
-	nfd = epoll_wait(t->priv.epoll, ev, sizeof(ev)/sizeof(*ev), mto);
+	if ( 0 == nfd )
+		nfd = epoll_wait(p->fd, p->ev, p->max_ev, mto);
 	if ( nfd < 0 ) {
-		if ( errno == EINTR )
+		if ( errno == EINTR ) {
+			nfd = 0;
 			goto again;
+		}
 		fprintf(stderr, "epoll_wait: %s\n", os_err());
 		return;
 	}
 
 	for(i=0; i < nfd; i++) {
-		n = ev[i].data.ptr;
+		n = p->ev[i].data.ptr;
 		n->flags = 0;
-		if ( ev[i].events & (EPOLLIN|EPOLLHUP) )
+		if ( p->ev[i].events & (EPOLLIN|EPOLLHUP) )
 			n->flags |= NBIO_READ;
-		if ( ev[i].events & EPOLLOUT )
+		if ( p->ev[i].events & EPOLLOUT )
 			n->flags |= NBIO_WRITE;
-		if ( ev[i].events & EPOLLERR )
+		if ( p->ev[i].events & EPOLLERR )
 			n->flags |= NBIO_ERROR;
 
 		list_move_tail(&n->list, &t->active);
@@ -75,6 +180,7 @@ again:
 
 static void epoll_inactive(struct iothread *t, struct nbio *n)
 {
+	struct epoll_priv *p = t->priv.ptr;
 	struct epoll_event ev;
 
 	if ( n->ev_priv.poll == 1 )
@@ -90,11 +196,14 @@ static void epoll_inactive(struct iothread *t, struct nbio *n)
 		ev.events |= EPOLLOUT;
 
 	/* Eeek */
-	if ( epoll_ctl(t->priv.epoll, EPOLL_CTL_ADD, n->fd, &ev) )
+	if ( epoll_ctl(p->fd, EPOLL_CTL_ADD, n->fd, &ev) )
 		return;
 
 	n->ev_priv.poll = 1;
 
+	/* a short array only costs extra epoll_wait()s, so carry on */
+	if ( ++p->nr_fds > p->max_ev )
+		upsize_evset(p);
 }
 
 static struct eventloop eventloop_epoll = {
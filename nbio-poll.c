@@ -15,24 +15,37 @@
 #include "list.h"
 #include "nbio.h"
 
+/* Dense array of pollfds with a parallel array of their owners. An fd
+ * going active is swap-removed so the array never has holes in it and
+ * every nbio knows its own slot.
+ */
 struct poll_priv {
-	int max_pfd, num_pfd;
+	unsigned int max_pfd, num_pfd;
 	struct pollfd *pfd;
+	struct nbio **owner;
 };
 
+#define POLL_MIN_PFD	8
+
 static int upsize_pfdset(struct poll_priv *p)
 {
 	unsigned int max;
 	struct pollfd *new;
+	struct nbio **owner;
 
-	max = p->max_pfd + 8;
+	max = (p->max_pfd) ? p->max_pfd * 2 : POLL_MIN_PFD;
 
 	new = realloc(p->pfd, max * sizeof(*p->pfd));
 	if ( new == NULL )
 		return 0;
+	p->pfd = new;
+
+	owner = realloc(p->owner, max * sizeof(*p->owner));
+	if ( owner == NULL )
+		return 0;
+	p->owner = owner;
 
 	p->max_pfd = max;
-	p->pfd = new;
 	return 1;
 }
 
@@ -46,6 +59,7 @@ static int poll_init(struct iothread *t)
 	}
 
 	if ( !upsize_pfdset(p) ) {
+		free(p->pfd);
 		free(p);
 		return 0;
 	}
@@ -58,14 +72,42 @@ static int poll_init(struct iothread *t)
 static void poll_fini(struct iothread *t)
 {
 	struct poll_priv *p = t->priv.ptr;
+	free(p->owner);
 	free(p->pfd);
 	free(p);
 }
 
+/* ev_priv of a brand new nbio is whatever the caller left there */
+static int slot_of(struct poll_priv *p, struct nbio *n)
+{
+	int idx = n->ev_priv.poll;
+
+	if ( idx < 0 || (unsigned int)idx >= p->num_pfd )
+		return -1;
+	if ( p->owner[idx] != n )
+		return -1;
+	return idx;
+}
+
+static void slot_remove(struct poll_priv *p, unsigned int idx)
+{
+	unsigned int last = --p->num_pfd;
+
+	p->owner[idx]->ev_priv.poll = -1;
+	if ( idx == last )
+		return;
+
+	p->pfd[idx] = p->pfd[last];
+	p->owner[idx] = p->owner[last];
+	p->owner[idx]->ev_priv.poll = idx;
+}
+
 static void poll_pump(struct iothread *t, int mto)
 {
 	struct poll_priv *p = t->priv.ptr;
-	struct nbio *n, *tmp;
+	struct pollfd *pfd;
+	struct nbio *n;
+	unsigned int i;
 	int ret;
 
 again:
@@ -76,23 +118,17 @@ again:
 		return;
 	}
 
-	p->num_pfd = 0;
-
-	list_for_each_entry_safe(n, tmp, &t->inactive, list) {
-		struct pollfd *pfd;
-
-		if ( n->ev_priv.poll < 0 )
-			continue;
-
-		pfd = &p->pfd[n->ev_priv.poll];
-
+	/* A ready slot is replaced by the last one, which was part of
+	 * this poll() too, so look at the same index again
+	 */
+	for(i = 0; ret && i < p->num_pfd; ) {
+		pfd = &p->pfd[i];
 		if ( pfd->revents == 0 ) {
-			p->pfd[p->num_pfd].fd = pfd->fd;
-			p->pfd[p->num_pfd].events = pfd->events;
-			p->num_pfd++;
+			i++;
 			continue;
 		}
 
+		n = p->owner[i];
 		n->flags = 0;
 
 		if ( pfd->revents & (POLLIN|POLLHUP) )
@@ -102,7 +138,8 @@ again:
 		if ( pfd->revents & POLLERR )
 			n->flags |= NBIO_ERROR;
 
-		n->ev_priv.poll = -1;
+		slot_remove(p, i);
+		ret--;
 
 		list_move_tail(&n->list, &t->active);
 	}
@@ -112,23 +149,36 @@ static void poll_inactive(struct iothread *t, struct nbio *n)
 {
 	struct poll_priv *p = t->priv.ptr;
 	struct pollfd *pfd;
+	int idx;
+
+	idx = slot_of(p, n);
+	if ( idx < 0 ) {
+		/* EEK */
+		if ( p->num_pfd >= p->max_pfd &&  !upsize_pfdset(p) )
+			return;
+		idx = p->num_pfd++;
+		p->owner[idx] = n;
+		n->ev_priv.poll = idx;
+	}
 
-	/* EEK */
-	if ( p->num_pfd >= p->max_pfd &&  !upsize_pfdset(p) )
-		return;
-
-	pfd = &p->pfd[p->num_pfd];
+	pfd = &p->pfd[idx];
 	pfd->fd = n->fd;
 	pfd->events = POLLERR|POLLHUP;
+	pfd->revents = 0;
 	if ( n->mask & NBIO_READ )
 		pfd->events |= POLLIN;
 	if ( n->mask & NBIO_WRITE )
 		pfd->events |= POLLOUT;
-	n->ev_priv.poll = p->num_pfd++;
 }
 
 static void poll_active(struct iothread *t, struct nbio *n)
 {
+	struct poll_priv *p = t->priv.ptr;
+	int idx;
+
+	idx = slot_of(p, n);
+	if ( idx >= 0 )
+		slot_remove(p, idx);
 	n->ev_priv.poll = -1;
 }
 
@@ -0,0 +1,255 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Functions:
+ *  o nbio_timer_init() - Set up a timer and its callback
+ *  o nbio_timer_add() - Arm a timer to fire in msec milliseconds
+ *  o nbio_timer_mod() - Re-arm a timer, whether it's pending or not
+ *  o nbio_timer_del() - Cancel a timer
+ *
+ * Timers are hung off a cascading timer wheel in the iothread: insert
+ * and cancel are O(1), expiry is run from nbio_pump() which also uses
+ * the earliest expiry to bound how long the eventloop sleeps.
+*/
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "compiler.h"
+#include "list.h"
+#include "nbio.h"
+
+#define WHEEL_MASK	(NBIO_WHEEL_SIZE - 1)
+#define WHEEL_RANGE	(1ULL << (NBIO_WHEEL_BITS * NBIO_WHEEL_LEVELS))
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned int level_idx(uint64_t when, unsigned int level)
+{
+	return (when >> (level * NBIO_WHEEL_BITS)) & WHEEL_MASK;
+}
+
+static void wheel_file(struct nbio_wheel *w, struct nbio_timer *tm)
+{
+	uint64_t expires = tm->expires;
+	unsigned int level;
+
+	if ( expires < w->clk )
+		expires = w->clk;
+	if ( expires - w->clk >= WHEEL_RANGE )
+		expires = w->clk + WHEEL_RANGE - 1;
+
+	for(level = 0; level < NBIO_WHEEL_LEVELS - 1; level++) {
+		if ( expires - w->clk <
+				(1ULL << ((level + 1) * NBIO_WHEEL_BITS)) )
+			break;
+	}
+
+	tm->level = level;
+	tm->slot = level_idx(expires, level);
+	list_add_tail(&tm->list, &w->slot[level][tm->slot]);
+	w->map[level] |= 1ULL << tm->slot;
+}
+
+static void wheel_unfile(struct nbio_wheel *w, struct nbio_timer *tm)
+{
+	list_del(&tm->list);
+	if ( list_empty(&w->slot[tm->level][tm->slot]) )
+		w->map[tm->level] &= ~(1ULL << tm->slot);
+}
+
+void _nbio_wheel_init(struct nbio_wheel *w)
+{
+	unsigned int i, j;
+
+	memset(w, 0, sizeof(*w));
+	for(i = 0; i < NBIO_WHEEL_LEVELS; i++)
+		for(j = 0; j < NBIO_WHEEL_SIZE; j++)
+			INIT_LIST_HEAD(&w->slot[i][j]);
+	w->clk = now_ms();
+}
+
+void nbio_timer_init(struct nbio_timer *tm,
+			void (*fn)(struct iothread *, struct nbio_timer *))
+{
+	INIT_LIST_HEAD(&tm->list);
+	tm->fn = fn;
+	tm->expires = 0;
+}
+
+int nbio_timer_pending(struct nbio_timer *tm)
+{
+	return !list_empty(&tm->list);
+}
+
+void nbio_timer_add(struct iothread *t, struct nbio_timer *tm,
+			unsigned int msec)
+{
+	struct nbio_wheel *w = &t->wheel;
+
+	assert(!nbio_timer_pending(tm));
+	tm->expires = now_ms() + msec;
+	wheel_file(w, tm);
+	w->nr++;
+}
+
+void nbio_timer_del(struct iothread *t, struct nbio_timer *tm)
+{
+	if ( !nbio_timer_pending(tm) )
+		return;
+	wheel_unfile(&t->wheel, tm);
+	t->wheel.nr--;
+}
+
+void nbio_timer_mod(struct iothread *t, struct nbio_timer *tm,
+			unsigned int msec)
+{
+	nbio_timer_del(t, tm);
+	nbio_timer_add(t, tm, msec);
+}
+
+/* Re-file everything in a higher level slot now that it's in range */
+static void cascade(struct nbio_wheel *w, unsigned int level)
+{
+	unsigned int idx = level_idx(w->clk, level);
+	struct nbio_timer *tm, *tmp;
+	struct list_head list;
+
+	INIT_LIST_HEAD(&list);
+	list_splice(&w->slot[level][idx], &list);
+	w->map[level] &= ~(1ULL << idx);
+
+	list_for_each_entry_safe(tm, tmp, &list, list) {
+		list_del(&tm->list);
+		wheel_file(w, tm);
+	}
+}
+
+/* Returns how many timers fired */
+unsigned int _nbio_wheel_run(struct iothread *t)
+{
+	struct nbio_wheel *w = &t->wheel;
+	struct nbio_timer *tm;
+	struct list_head list;
+	unsigned int idx, level, n = 0;
+	uint64_t now;
+
+	now = now_ms();
+	if ( 0 == w->nr ) {
+		w->clk = now;
+		return 0;
+	}
+
+	while ( w->clk <= now ) {
+		/* each level wrapping pulls a slot down from the one above */
+		for(level = 1; level < NBIO_WHEEL_LEVELS; level++) {
+			if ( level_idx(w->clk, level - 1) )
+				break;
+			cascade(w, level);
+		}
+
+		idx = w->clk & WHEEL_MASK;
+		INIT_LIST_HEAD(&list);
+		list_splice(&w->slot[0][idx], &list);
+		w->map[0] &= ~(1ULL << idx);
+
+		/* so that anything added from a callback lands in a slot
+		 * which is still to come
+		 */
+		w->clk++;
+
+		/* callbacks may add, re-add or delete any timer */
+		while ( !list_empty(&list) ) {
+			tm = list_entry(list.next, struct nbio_timer, list);
+			list_del(&tm->list);
+			w->nr--;
+			tm->fn(t, tm);
+			n++;
+		}
+
+		/* skip to the next level 0 wrap if there's nothing left
+		 * to fire this time round
+		 */
+		idx = w->clk & WHEEL_MASK;
+		if ( idx && 0 == (w->map[0] >> idx) ) {
+			w->clk = (w->clk | WHEEL_MASK) + 1;
+			if ( w->clk > now + 1 )
+				w->clk = now + 1;
+		}
+	}
+
+	return n;
+}
+
+/* First set bit at or after bit 'from', going round, as a distance */
+static int next_bit(uint64_t map, unsigned int from)
+{
+	uint64_t rot;
+
+	if ( 0 == map )
+		return -1;
+
+	from &= WHEEL_MASK;
+	rot = (from) ? (map >> from) | (map << (NBIO_WHEEL_SIZE - from)) : map;
+	return __builtin_ctzll(rot);
+}
+
+/* The earliest time anything can need doing, level 0 slots are exact
+ * and for higher levels it's when the slot is next cascaded
+ */
+static uint64_t wheel_next(struct nbio_wheel *w)
+{
+	uint64_t next = w->clk + WHEEL_RANGE, when;
+	unsigned int level, shift, skip;
+	int d;
+
+	d = next_bit(w->map[0], w->clk);
+	if ( d >= 0 )
+		next = w->clk + d;
+
+	for(level = 1; level < NBIO_WHEEL_LEVELS; level++) {
+		shift = level * NBIO_WHEEL_BITS;
+
+		/* sitting right on a boundary, the current slot is yet
+		 * to be cascaded
+		 */
+		skip = (w->clk & ((1ULL << shift) - 1)) ? 1 : 0;
+
+		d = next_bit(w->map[level], level_idx(w->clk, level) + skip);
+		if ( d < 0 )
+			continue;
+		when = ((w->clk >> shift) + d + skip) << shift;
+		if ( when < next )
+			next = when;
+	}
+
+	return next;
+}
+
+int _nbio_wheel_timeout(struct iothread *t, int mto)
+{
+	struct nbio_wheel *w = &t->wheel;
+	uint64_t next, now;
+
+	if ( 0 == w->nr || 0 == mto )
+		return mto;
+
+	next = wheel_next(w);
+	now = now_ms();
+	if ( next <= now )
+		return 0;
+	if ( mto < 0 || next - now < (uint64_t)mto )
+		return next - now;
+	return mto;
+}
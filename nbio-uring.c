@@ -0,0 +1,489 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Linux io_uring based eventloop. Readiness is still what the nbio
+ * callbacks want, so every fd going inactive queues a one-shot
+ * IORING_OP_POLL_ADD and all of those are submitted by the same
+ * io_uring_enter which waits for completions. Compared with epoll
+ * that saves the epoll_ctl() pair on every inactive/active transition.
+ * One-shot polls check readiness when they're armed, just like an
+ * EPOLL_CTL_ADD does, which nbio_wait_on() relies upon.
+ *
+ * This only stands in for epoll. The TAP is still read and written
+ * with plain syscalls from the datapath callbacks, there are no read
+ * or write SQEs and no registered buffers. Doing that would mean the
+ * datapath holding on to its buffers until a CQE comes back rather
+ * than handing bulk IN buffers straight back to libusb.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "compiler.h"
+#include "list.h"
+#include "nbio.h"
+#include "os.h"
+
+#define URING_ENTRIES	256
+
+/* One armed poll. An nbio which is deleted while its poll is still in
+ * the kernel leaves the request behind, to be freed when the
+ * cancellation completes. Requests whose SQE didn't fit in the ring
+ * wait on u_retry for the next pump, unarmed if they want a poll and
+ * armed, with no nbio, if they want cancelling.
+ */
+struct uring_req {
+	struct list_head	r_list;
+	struct nbio		*r_nbio;
+	unsigned int		r_events;
+	unsigned int		r_armed;
+	unsigned int		r_wait;
+};
+
+struct uring {
+	int			u_fd;
+	unsigned int		u_pending;
+
+	void			*u_ring;
+	size_t			u_ring_sz;
+	struct io_uring_sqe	*u_sqes;
+	size_t			u_sqes_sz;
+
+	unsigned int		*u_sq_head;
+	unsigned int		*u_sq_tail;
+	unsigned int		u_sq_mask;
+	unsigned int		u_sq_entries;
+	unsigned int		*u_sq_array;
+
+	unsigned int		*u_cq_head;
+	unsigned int		*u_cq_tail;
+	unsigned int		u_cq_mask;
+	struct io_uring_cqe	*u_cqes;
+
+	struct list_head	u_busy;
+	struct list_head	u_free;
+	struct list_head	u_retry;
+};
+
+static int sys_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned int submit, unsigned int min,
+				unsigned int flags, void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, min,
+			flags, arg, argsz);
+}
+
+static struct uring_req *req_get(struct uring *u, struct nbio *n)
+{
+	struct uring_req *r;
+
+	if ( list_empty(&u->u_free) ) {
+		r = malloc(sizeof(*r));
+		if ( NULL == r )
+			return NULL;
+	}else{
+		r = list_entry(u->u_free.next, struct uring_req, r_list);
+		list_del(&r->r_list);
+	}
+
+	r->r_nbio = n;
+	r->r_events = 0;
+	r->r_armed = 0;
+	r->r_wait = 0;
+	list_add(&r->r_list, &u->u_busy);
+	n->ev_priv.ptr = r;
+	return r;
+}
+
+static void req_put(struct uring *u, struct uring_req *r)
+{
+	list_move(&r->r_list, &u->u_free);
+}
+
+static int uring_submit(struct uring *u)
+{
+	int ret;
+
+	if ( 0 == u->u_pending )
+		return 1;
+
+	do {
+		ret = sys_uring_enter(u->u_fd, u->u_pending, 0, 0, NULL, 0);
+	}while ( ret < 0 && errno == EINTR );
+
+	if ( ret < 0 )
+		return 0;
+
+	u->u_pending -= ret;
+	return 1;
+}
+
+static struct io_uring_sqe *sqe_get(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head, tail;
+
+	tail = *u->u_sq_tail;
+	head = __atomic_load_n(u->u_sq_head, __ATOMIC_ACQUIRE);
+	if ( tail - head >= u->u_sq_entries ) {
+		if ( !uring_submit(u) )
+			return NULL;
+		head = __atomic_load_n(u->u_sq_head, __ATOMIC_ACQUIRE);
+		if ( tail - head >= u->u_sq_entries )
+			return NULL;
+	}
+
+	sqe = &u->u_sqes[tail & u->u_sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static void sqe_commit(struct uring *u)
+{
+	unsigned int tail = *u->u_sq_tail;
+
+	u->u_sq_array[tail & u->u_sq_mask] = tail & u->u_sq_mask;
+	__atomic_store_n(u->u_sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->u_pending++;
+}
+
+/* Forget about an nbio, cancelling its poll if one is in flight */
+static void req_detach(struct uring *u, struct nbio *n)
+{
+	struct uring_req *r = n->ev_priv.ptr;
+	struct io_uring_sqe *sqe;
+
+	if ( NULL == r )
+		return;
+
+	n->ev_priv.ptr = NULL;
+	r->r_nbio = NULL;
+
+	if ( !r->r_armed ) {
+		req_put(u, r);
+		return;
+	}
+
+	sqe = sqe_get(u);
+	if ( NULL == sqe ) {
+		list_move_tail(&r->r_list, &u->u_retry);
+		return;
+	}
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->addr = (uintptr_t)r;
+	sqe->user_data = 0;
+	sqe_commit(u);
+}
+
+static void req_arm(struct uring *u, struct uring_req *r,
+			struct io_uring_sqe *sqe)
+{
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = r->r_nbio->fd;
+	sqe->poll32_events = r->r_events;
+	sqe->user_data = (uintptr_t)r;
+	sqe_commit(u);
+
+	r->r_armed = 1;
+	list_move(&r->r_list, &u->u_busy);
+}
+
+/* Queue whatever didn't fit last time, the CQ having just been reaped
+ * to make room
+ */
+static void req_retry(struct uring *u)
+{
+	struct uring_req *r, *tmp;
+	struct io_uring_sqe *sqe;
+
+	list_for_each_entry_safe(r, tmp, &u->u_retry, r_list) {
+		sqe = sqe_get(u);
+		if ( NULL == sqe )
+			break;
+
+		if ( r->r_nbio ) {
+			req_arm(u, r, sqe);
+			continue;
+		}
+
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->addr = (uintptr_t)r;
+		sqe->user_data = 0;
+		sqe_commit(u);
+		list_move(&r->r_list, &u->u_busy);
+	}
+}
+
+static int uring_init(struct iothread *t)
+{
+	struct io_uring_params p;
+	struct uring *u;
+	uint8_t *ring;
+
+	u = calloc(1, sizeof(*u));
+	if ( NULL == u )
+		goto err;
+
+	memset(&p, 0, sizeof(p));
+	u->u_fd = sys_uring_setup(URING_ENTRIES, &p);
+	if ( u->u_fd < 0 )
+		goto err_free;
+
+	/* EXT_ARG is 5.11 and gives us timeouts without a timeout SQE */
+	if ( !(p.features & IORING_FEAT_SINGLE_MMAP) ||
+			!(p.features & IORING_FEAT_NODROP) ||
+			!(p.features & IORING_FEAT_EXT_ARG) )
+		goto err_close;
+
+	u->u_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	if ( p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) >
+			u->u_ring_sz )
+		u->u_ring_sz = p.cq_off.cqes +
+				p.cq_entries * sizeof(struct io_uring_cqe);
+
+	u->u_ring = mmap(NULL, u->u_ring_sz, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, u->u_fd, IORING_OFF_SQ_RING);
+	if ( MAP_FAILED == u->u_ring )
+		goto err_close;
+
+	u->u_sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->u_sqes = mmap(NULL, u->u_sqes_sz, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, u->u_fd, IORING_OFF_SQES);
+	if ( MAP_FAILED == u->u_sqes )
+		goto err_unmap;
+
+	ring = u->u_ring;
+	u->u_sq_head = (unsigned int *)(ring + p.sq_off.head);
+	u->u_sq_tail = (unsigned int *)(ring + p.sq_off.tail);
+	u->u_sq_mask = *(unsigned int *)(ring + p.sq_off.ring_mask);
+	u->u_sq_entries = *(unsigned int *)(ring + p.sq_off.ring_entries);
+	u->u_sq_array = (unsigned int *)(ring + p.sq_off.array);
+	u->u_cq_head = (unsigned int *)(ring + p.cq_off.head);
+	u->u_cq_tail = (unsigned int *)(ring + p.cq_off.tail);
+	u->u_cq_mask = *(unsigned int *)(ring + p.cq_off.ring_mask);
+	u->u_cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+	INIT_LIST_HEAD(&u->u_busy);
+	INIT_LIST_HEAD(&u->u_free);
+	INIT_LIST_HEAD(&u->u_retry);
+
+	t->priv.ptr = u;
+	return 1;
+
+err_unmap:
+	munmap(u->u_ring, u->u_ring_sz);
+err_close:
+	close(u->u_fd);
+err_free:
+	free(u);
+err:
+	return 0;
+}
+
+static void uring_fini(struct iothread *t)
+{
+	struct uring *u = t->priv.ptr;
+	struct uring_req *r, *tmp;
+
+	list_for_each_entry_safe(r, tmp, &u->u_busy, r_list)
+		free(r);
+	list_for_each_entry_safe(r, tmp, &u->u_free, r_list)
+		free(r);
+	list_for_each_entry_safe(r, tmp, &u->u_retry, r_list)
+		free(r);
+
+	munmap(u->u_sqes, u->u_sqes_sz);
+	munmap(u->u_ring, u->u_ring_sz);
+	while ( close(u->u_fd) && (errno == EINTR) )
+		/* do nothing */;
+	free(u);
+}
+
+static void uring_inactive(struct iothread *t, struct nbio *n)
+{
+	struct uring *u = t->priv.ptr;
+	struct uring_req *r = n->ev_priv.ptr;
+	struct io_uring_sqe *sqe;
+	unsigned int events;
+
+	events = POLLERR|POLLHUP;
+	if ( n->mask & NBIO_READ )
+		events |= POLLIN;
+	if ( n->mask & NBIO_WRITE )
+		events |= POLLOUT;
+
+	/* still armed from last time, nothing has happened since */
+	if ( r && r->r_armed && r->r_events == events ) {
+		r->r_wait = 1;
+		return;
+	}
+
+	if ( r && r->r_armed ) {
+		req_detach(u, n);
+		r = NULL;
+	}
+
+	if ( NULL == r ) {
+		r = req_get(u, n);
+		if ( NULL == r )
+			return;
+	}
+
+	r->r_events = events;
+	r->r_wait = 1;
+
+	sqe = sqe_get(u);
+	if ( NULL == sqe ) {
+		list_move_tail(&r->r_list, &u->u_retry);
+		return;
+	}
+
+	req_arm(u, r, sqe);
+}
+
+/* An armed poll which fires while we're not interested is ignored,
+ * the callbacks always run until EAGAIN before going inactive again
+ */
+static void uring_active(struct iothread *t, struct nbio *n)
+{
+	struct uring *u = t->priv.ptr;
+	struct uring_req *r = n->ev_priv.ptr;
+
+	if ( NULL == r )
+		return;
+
+	if ( NBIO_DELETED == n->mask ) {
+		req_detach(u, n);
+		return;
+	}
+
+	r->r_wait = 0;
+}
+
+static void uring_reap(struct iothread *t, struct uring *u)
+{
+	struct io_uring_cqe *cqe;
+	struct uring_req *r;
+	unsigned int head, tail;
+	struct nbio *n;
+
+	head = *u->u_cq_head;
+	tail = __atomic_load_n(u->u_cq_tail, __ATOMIC_ACQUIRE);
+
+	for(; head != tail; head++) {
+		cqe = &u->u_cqes[head & u->u_cq_mask];
+		r = (struct uring_req *)(uintptr_t)cqe->user_data;
+		if ( NULL == r )
+			continue;
+
+		r->r_armed = 0;
+		n = r->r_nbio;
+		if ( NULL == n ) {
+			req_put(u, r);
+			continue;
+		}
+
+		if ( !r->r_wait )
+			continue;
+
+		if ( cqe->res < 0 ) {
+			fprintf(stderr, "io_uring: poll: %s\n",
+				strerror(-cqe->res));
+			n->flags = NBIO_ERROR;
+		}else{
+			n->flags = 0;
+			if ( cqe->res & (POLLIN|POLLHUP) )
+				n->flags |= NBIO_READ;
+			if ( cqe->res & POLLOUT )
+				n->flags |= NBIO_WRITE;
+			if ( cqe->res & POLLERR )
+				n->flags |= NBIO_ERROR;
+		}
+
+		r->r_wait = 0;
+		list_move_tail(&n->list, &t->active);
+	}
+
+	__atomic_store_n(u->u_cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void uring_pump(struct iothread *t, int mto)
+{
+	struct uring *u = t->priv.ptr;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int min, flags;
+	int ret;
+
+	/* a full SQ can be down to a full CQ, so reap before retrying
+	 * and don't sleep on anything that turns up
+	 */
+	if ( !list_empty(&u->u_retry) ) {
+		uring_reap(t, u);
+		req_retry(u);
+		if ( !list_empty(&t->active) || !list_empty(&u->u_retry) )
+			mto = 0;
+	}
+
+	memset(&arg, 0, sizeof(arg));
+	flags = IORING_ENTER_EXT_ARG;
+	min = 0;
+
+	/* don't sleep if there's already something to reap */
+	if ( mto && *u->u_cq_head ==
+			__atomic_load_n(u->u_cq_tail, __ATOMIC_ACQUIRE) ) {
+		flags |= IORING_ENTER_GETEVENTS;
+		min = 1;
+		if ( mto > 0 ) {
+			ts.tv_sec = mto / 1000;
+			ts.tv_nsec = (mto % 1000) * 1000000;
+			arg.ts = (uintptr_t)&ts;
+		}
+	}
+
+	if ( min || u->u_pending ) {
+again:
+		ret = sys_uring_enter(u->u_fd, u->u_pending, min, flags,
+					&arg, sizeof(arg));
+		if ( ret < 0 ) {
+			if ( errno == EINTR )
+				goto again;
+			if ( errno != ETIME && errno != EBUSY )
+				fprintf(stderr, "io_uring_enter: %s\n",
+					os_err());
+		}else{
+			u->u_pending -= ret;
+		}
+	}
+
+	uring_reap(t, u);
+}
+
+static struct eventloop eventloop_uring = {
+	.name = "io_uring",
+	.init = uring_init,
+	.fini = uring_fini,
+	.inactive = uring_inactive,
+	.active = uring_active,
+	.pump = uring_pump,
+};
+
+void _eventloop_uring_ctor(void)
+{
+	eventloop_add(&eventloop_uring);
+}
@@ -12,6 +12,10 @@
  *  o nbio_pump() - Pump events
  *  o nbio_add() - Register an fd with read/write/error callbacks
  *  o nbio_del() - Remove an fd
+ *  o nbio_busy_poll() - Spin for a while before blocking
+ *  o nbio_budget() - Set how much work is done per pump
+ *  o nbio_hist() - Record how long each pump takes
+ *  o nbio_timer_*() - See nbio-timer.c
 */
 #include <stdlib.h>
 #include <stdint.h>
@@ -22,11 +26,12 @@
 #include "compiler.h"
 #include "list.h"
 #include "nbio.h"
+#include "ondawagon.h"
+#include "hist.h"
+#include "trace.h"
 
 static struct eventloop *ev_list;
 
-#define NBIO_DELETED 0x80
-
 struct eventloop *eventloop_find(const char *name)
 {
 	struct eventloop *e;
@@ -52,28 +57,44 @@ void eventloop_add(struct eventloop *e)
 
 int nbio_init(struct iothread *t, const char *plugin)
 {
-	if ( NULL == plugin ) {
-		if ( NULL == ev_list ) {
-			fprintf(stderr, "nbio: No eventloop plugins\n");
-			return 0;
-		}
-		t->plugin = ev_list;
-	}else{
+	/* A plugin asked for by name may not be built in, or supported by
+	 * the running kernel, in which case we fall back to the defaults
+	 */
+	if ( plugin ) {
 		t->plugin = eventloop_find(plugin);
+		if ( NULL == t->plugin ) {
+			fprintf(stderr, "nbio: No '%s' eventloop\n", plugin);
+		}else if ( t->plugin->init(t) ) {
+			goto done;
+		}else{
+			fprintf(stderr, "nbio: %s eventloop unavailable\n",
+				plugin);
+		}
 	}
 
-	if ( NULL == t->plugin )
+	if ( NULL == ev_list ) {
+		fprintf(stderr, "nbio: No eventloop plugins\n");
 		return 0;
+	}
 
-	for ( ; !t->plugin->init(t); t->plugin = t->plugin->next ) {
-		if ( plugin || NULL == t->plugin->next )
+	for (t->plugin = ev_list; !t->plugin->init(t);
+			t->plugin = t->plugin->next) {
+		if ( NULL == t->plugin->next )
 			return 0;
 	}
 
-	printf("nbio: using %s eventloop\n", t->plugin->name);
+done:
+	if ( odw_verbose )
+		printf("nbio: using %s eventloop\n", t->plugin->name);
 	INIT_LIST_HEAD(&t->active);
 	INIT_LIST_HEAD(&t->inactive);
 	INIT_LIST_HEAD(&t->deleted);
+	t->busy_poll = 0;
+	t->weight = NBIO_WEIGHT;
+	t->budget = NBIO_BUDGET;
+	t->hist_loop = NULL;
+	t->hist_wait = NULL;
+	_nbio_wheel_init(&t->wheel);
 	return 1;
 }
 
@@ -97,16 +118,25 @@ void nbio_fini(struct iothread *t)
 	t->plugin->fini(t);
 }
 
-void nbio_pump(struct iothread *t, int mto)
+/* Returns zero if the budget ran out with fds still active */
+static int dispatch(struct iothread *t)
 {
 	struct nbio *n, *tmp;
 	struct nbio *d, *tmp2;
+	unsigned int spent;
+
+	t->spent = 0;
 
 	while ( !list_empty(&t->active) ) {
+		if ( t->spent >= t->budget )
+			break;
+
 		list_for_each_entry_safe(n, tmp, &t->active, list) {
 			if ( NBIO_DELETED == n->mask )
 				break;
 
+			spent = t->spent;
+
 			/* write first since it could free up some
 			 * resources in a  tight squeeze
 			 */
@@ -115,6 +145,10 @@ void nbio_pump(struct iothread *t, int mto)
 			if ( (n->flags & n->mask) & NBIO_READ )
 				n->ops->read(t, n);
 
+			/* callbacks which don't count their work cost one */
+			if ( t->spent == spent )
+				t->spent++;
+
 			/* let read/write have a chance to determine
 			 * exact nature of the error
 			 */
@@ -124,6 +158,13 @@ void nbio_pump(struct iothread *t, int mto)
 				list_move_tail(&n->list, &t->deleted);
 				continue;
 			}
+
+			/* used up its quota with more to do, go to the back */
+			if ( n->flags & n->mask )
+				list_move_tail(&n->list, &t->active);
+
+			if ( t->spent >= t->budget )
+				break;
 		}
 	}
 
@@ -132,21 +173,62 @@ void nbio_pump(struct iothread *t, int mto)
 		d->ops->dtor(t, d);
 	}
 
+	return list_empty(&t->active);
+}
+
+/* Timers which expire while we sleep are run before returning, the
+ * fds they wake are dispatched on the next call. If any callbacks ran
+ * or the budget runs out we only check for new events, without
+ * sleeping, so the caller gets to act on what they did and the next
+ * call can service the new events alongside whatever is still active.
+ */
+void nbio_pump(struct iothread *t, int mto)
+{
+	uint64_t start = 0, wait = 0, now;
+
+	if ( t->hist_loop )
+		start = hist_now();
+
+	/* callbacks may have left work for our caller, don't sleep on it */
+	if ( _nbio_wheel_run(t) )
+		mto = 0;
+	if ( !dispatch(t) || t->spent )
+		mto = 0;
+
 #if 0
 	/* redundant ? */
 	list_for_each_entry_safe(n, tmp, &t->inactive, list)
 		t->plugin->inactive(t, n);
 #endif
 
-	if ( !list_empty(&t->inactive) )
+	if ( list_empty(&t->inactive) && 0 == t->wheel.nr )
+		goto out;
+
+	mto = _nbio_wheel_timeout(t, mto);
+	trace_nbio_sleep(t, mto);
+	if ( t->hist_wait ) {
+		now = hist_now();
+		t->plugin->pump(t, mto);
+		wait = hist_now() - now;
+		hist_record(t->hist_wait, wait);
+	}else{
 		t->plugin->pump(t, mto);
+	}
+	trace_nbio_wake(t);
+	_nbio_wheel_run(t);
+
+out:
+	/* the time we spent working, not sleeping */
+	if ( t->hist_loop )
+		hist_record(t->hist_loop, hist_now() - start - wait);
 }
 
 void nbio_del(struct iothread *t, struct nbio *n)
 {
-	t->plugin->active(t, n);
+	/* so the plugin knows it can forget about the fd */
 	n->mask = NBIO_DELETED;
 	n->flags = 0;
+	t->plugin->active(t, n);
 
 	/* sneaky: will also remove from any waitqueues */
 	list_move_tail(&n->list, &t->deleted);
@@ -207,6 +289,30 @@ void nbio_wait_on(struct iothread *t, struct nbio *io, nbio_flags_t wait)
 	t->plugin->inactive(t, io);
 }
 
+/* weight: units of work one callback should do before yielding, budget:
+ * units of work for all callbacks before we go back to the eventloop
+ */
+void nbio_budget(struct iothread *t, unsigned int weight,
+			unsigned int budget)
+{
+	t->weight = (weight) ? weight : NBIO_WEIGHT;
+	t->budget = (budget) ? budget : NBIO_BUDGET;
+}
+
+/* Only honoured by the epoll plugin */
+void nbio_busy_poll(struct iothread *t, unsigned int usecs)
+{
+	t->busy_poll = usecs;
+}
+
+/* Histograms are written only from within nbio_pump() */
+void nbio_hist(struct iothread *t, struct dongle_hist *loop,
+		struct dongle_hist *wait)
+{
+	t->hist_loop = loop;
+	t->hist_wait = wait;
+}
+
 nbio_flags_t nbio_get_wait(struct nbio *io)
 {
 	return io->mask & NBIO_WAIT;
@@ -220,6 +326,9 @@ void nbio_add(struct iothread *t, struct nbio *io, nbio_flags_t wait)
 
 static void __attribute__((constructor)) _ctor(void)
 {
+#ifdef HAVE_IO_URING
+	_eventloop_uring_ctor();
+#endif
 	_eventloop_poll_ctor();
 	_eventloop_epoll_ctor();
 }
@@ -7,6 +7,8 @@
 #define _NBIO_HEADER_INCLUDED_
 
 typedef uint8_t nbio_flags_t;
+struct iothread;
+struct dongle_hist;
 
 /* Represents a given fd */
 struct nbio {
@@ -15,6 +17,7 @@ struct nbio {
 #define NBIO_WRITE	(1<<1)
 #define NBIO_ERROR	(1<<2)
 #define NBIO_WAIT	(NBIO_READ|NBIO_WRITE|NBIO_ERROR)
+#define NBIO_DELETED	0x80
 	nbio_flags_t mask;
 	nbio_flags_t flags;
 	const struct nbio_ops *ops;
@@ -25,16 +28,48 @@ struct nbio {
 	}ev_priv;
 };
 
+/* A one-shot timer, re-add it from the callback to make it periodic */
+struct nbio_timer {
+	struct list_head list;
+	uint64_t expires;
+	void (*fn)(struct iothread *t, struct nbio_timer *tm);
+	uint8_t level;
+	uint8_t slot;
+};
+
+/* Hierarchical timer wheel with millisecond resolution, four levels
+ * of 64 slots reach about four and a half hours, anything further out
+ * is parked in the last slot and re-filed when it comes round
+ */
+#define NBIO_WHEEL_BITS		6
+#define NBIO_WHEEL_SIZE		(1U << NBIO_WHEEL_BITS)
+#define NBIO_WHEEL_LEVELS	4
+struct nbio_wheel {
+	uint64_t clk;
+	unsigned int nr;
+	uint64_t map[NBIO_WHEEL_LEVELS];
+	struct list_head slot[NBIO_WHEEL_LEVELS][NBIO_WHEEL_SIZE];
+};
+
 /* Represents all the I/Os for a given thread */
 struct iothread {
 	struct list_head inactive;
 	struct list_head active;
 	struct eventloop *plugin;
 	union {
-		int epoll;
 		void *ptr;
 	}priv;
 	struct list_head deleted;
+	/* usecs to spin before blocking, 0 to disable */
+	unsigned int busy_poll;
+	/* NAPI style quotas, see nbio_budget() */
+	unsigned int weight;
+	unsigned int budget;
+	unsigned int spent;
+	/* where to record iteration times, NULL not to bother */
+	struct dongle_hist *hist_loop;
+	struct dongle_hist *hist_wait;
+	struct nbio_wheel wheel;
 };
 
 struct nbio_ops {
@@ -52,11 +87,51 @@ _private int nbio_init(struct iothread *, const char *plugin);
 _private void nbio_inactive(struct iothread *, struct nbio *, nbio_flags_t);
 _private void nbio_set_wait(struct iothread *, struct nbio *, nbio_flags_t);
 _private nbio_flags_t nbio_get_wait(struct nbio *io);
+_private void nbio_busy_poll(struct iothread *, unsigned int usecs);
+_private void nbio_budget(struct iothread *, unsigned int weight,
+				unsigned int budget);
+_private void nbio_hist(struct iothread *, struct dongle_hist *loop,
+				struct dongle_hist *wait);
+
+/* Defaults, the weight is kept below the datapath's TX batch (16) so
+ * that a busy TAP yields before it has filled the pipe
+ */
+#define NBIO_WEIGHT	8
+#define NBIO_BUDGET	300
+
+/* Per-callback quota, a callback stopping short because of it should
+ * leave the fd active and it will be called again after the others
+ */
+static inline unsigned int nbio_quota(struct iothread *t)
+{
+	return t->weight;
+}
+
+/* Account for work done by a callback, packets usually */
+static inline void nbio_spend(struct iothread *t, unsigned int units)
+{
+	t->spent += units;
+}
 _private void nbio_to_waitq(struct iothread *, struct nbio *,
 				struct list_head *q);
 _private void nbio_wake(struct iothread *, struct nbio *, nbio_flags_t);
 _private void nbio_wait_on(struct iothread *t, struct nbio *n, nbio_flags_t);
 
+/* timer API */
+_private void nbio_timer_init(struct nbio_timer *tm,
+			void (*fn)(struct iothread *, struct nbio_timer *));
+_private void nbio_timer_add(struct iothread *, struct nbio_timer *,
+				unsigned int msec);
+_private void nbio_timer_mod(struct iothread *, struct nbio_timer *,
+				unsigned int msec);
+_private void nbio_timer_del(struct iothread *, struct nbio_timer *);
+_private int nbio_timer_pending(struct nbio_timer *tm);
+
+/* used by nbio_pump() */
+_private void _nbio_wheel_init(struct nbio_wheel *w);
+_private unsigned int _nbio_wheel_run(struct iothread *t);
+_private int _nbio_wheel_timeout(struct iothread *t, int mto);
+
 /* eventloop plugin API */
 struct eventloop {
 	const char *name;
@@ -72,5 +147,6 @@ _private void eventloop_add(struct eventloop *e);
 _private struct eventloop *eventloop_find(const char *name);
 _private void _eventloop_poll_ctor(void);
 _private void _eventloop_epoll_ctor(void);
+_private void _eventloop_uring_ctor(void);
 
 #endif /* _NBIO_HEADER_INCLUDED_ */
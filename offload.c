@@ -0,0 +1,180 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Functions:
+ *  o offload_csum() - Finish a CHECKSUM_PARTIAL frame
+ *  o offload_tso() - Cut a TCP super-packet in to MSS sized frames
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <linux/virtio_net.h>
+
+#include "compiler.h"
+#include "offload.h"
+
+#define IPPROTO_TCP_	6
+#define TCP_FIN		0x01
+#define TCP_PSH		0x08
+#define TCP_CWR		0x80
+
+static uint16_t get16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+/* RFC 1071 one's complement sum over big-endian 16 bit words */
+uint32_t csum_partial(const uint8_t *buf, size_t len, uint32_t sum)
+{
+	uint64_t acc = sum;
+	size_t i;
+
+	for(i = 0; i + 1 < len; i += 2)
+		acc += get16(buf + i);
+	if ( len & 1 )
+		acc += buf[len - 1] << 8;
+
+	while ( acc >> 32 )
+		acc = (acc & 0xffffffff) + (acc >> 32);
+
+	return acc;
+}
+
+uint16_t csum_fold(uint32_t sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/* The checksum field already holds the pseudo-header sum */
+int offload_csum(uint8_t *frame, size_t len, const struct virtio_net_hdr *vh)
+{
+	uint16_t csum;
+
+	if ( !(vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) )
+		return 1;
+
+	if ( vh->csum_start + vh->csum_offset + 2U > len )
+		return 0;
+
+	csum = ~csum_fold(csum_partial(frame + vh->csum_start,
+					len - vh->csum_start, 0));
+
+	/* zero means no checksum to UDP */
+	if ( 0 == csum && vh->csum_offset == 6 )
+		csum = 0xffff;
+
+	put16(frame + vh->csum_start + vh->csum_offset, csum);
+	return 1;
+}
+
+static uint32_t pseudo_sum(const uint8_t *ip, int v6, size_t l4len)
+{
+	uint32_t sum;
+
+	if ( v6 ) {
+		sum = csum_partial(ip + 8, 32, 0);
+	}else{
+		sum = csum_partial(ip + 12, 8, 0);
+	}
+
+	return sum + IPPROTO_TCP_ + l4len;
+}
+
+int offload_tso(const struct virtio_net_hdr *vh, const uint8_t *frame,
+		size_t len, size_t l3off, size_t bufsz,
+		offload_get_t get, offload_put_t put, void *priv)
+{
+	size_t l4off, hdrlen, plen, off, mss;
+	unsigned int i, nseg;
+	uint32_t seq;
+	uint16_t id;
+	uint8_t *buf, *ip, *tcp;
+	int v6;
+
+	switch(vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+	case VIRTIO_NET_HDR_GSO_TCPV4:
+		v6 = 0;
+		break;
+	case VIRTIO_NET_HDR_GSO_TCPV6:
+		v6 = 1;
+		break;
+	default:
+		return 0;
+	}
+
+	/* don't trust hdr_len, it's only a hint */
+	l4off = vh->csum_start;
+	if ( l4off + 20 > len || l4off < l3off + (v6 ? 40 : 20) )
+		return 0;
+	hdrlen = l4off + (frame[l4off + 12] >> 4) * 4;
+	mss = vh->gso_size;
+	if ( hdrlen > len || 0 == mss || hdrlen + mss > bufsz )
+		return 0;
+
+	nseg = (len - hdrlen + mss - 1) / mss;
+	seq = get32(frame + l4off + 4);
+	id = get16(frame + l3off + 4);
+
+	for(i = 0, off = hdrlen; i < nseg; i++, off += plen) {
+		plen = (len - off < mss) ? len - off : mss;
+
+		buf = get(priv);
+		if ( NULL == buf )
+			return 0;
+
+		memcpy(buf, frame, hdrlen);
+		memcpy(buf + hdrlen, frame + off, plen);
+		ip = buf + l3off;
+		tcp = buf + l4off;
+
+		if ( v6 ) {
+			put16(ip + 4, hdrlen - l3off - 40 + plen);
+		}else{
+			put16(ip + 2, hdrlen - l3off + plen);
+			put16(ip + 4, id + i);
+			put16(ip + 10, 0);
+			put16(ip + 10, ~csum_fold(csum_partial(ip,
+						(ip[0] & 0xf) * 4, 0)));
+		}
+
+		put32(tcp + 4, seq + i * mss);
+		if ( i + 1 < nseg )
+			tcp[13] &= ~(TCP_FIN|TCP_PSH);
+		if ( i )
+			tcp[13] &= ~TCP_CWR;
+
+		put16(tcp + 16, 0);
+		put16(tcp + 16, ~csum_fold(csum_partial(tcp,
+					hdrlen - l4off + plen,
+					pseudo_sum(ip, v6,
+						hdrlen - l4off + plen))));
+
+		put(priv, buf, hdrlen + plen);
+	}
+
+	return 1;
+}
@@ -0,0 +1,29 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+*/
+#ifndef _OFFLOAD_H
+#define _OFFLOAD_H
+
+/* Software versions of the offloads a TAP with IFF_VNET_HDR lets the
+ * kernel skip: checksum completion and TCP segmentation. The dongle
+ * can do neither so we do them on the way out to USB.
+ */
+struct virtio_net_hdr;
+
+/* Returns a buffer of at least the pool buffer size, or NULL */
+typedef uint8_t *(*offload_get_t)(void *priv);
+/* Hand over a finished segment built in a buffer from offload_get_t */
+typedef void (*offload_put_t)(void *priv, uint8_t *buf, size_t len);
+
+_private uint32_t csum_partial(const uint8_t *buf, size_t len, uint32_t sum);
+_private uint16_t csum_fold(uint32_t sum);
+_private int offload_csum(uint8_t *frame, size_t len,
+				const struct virtio_net_hdr *vh);
+_private int offload_tso(const struct virtio_net_hdr *vh,
+				const uint8_t *frame, size_t len, size_t l3off,
+				size_t bufsz, offload_get_t get,
+				offload_put_t put, void *priv);
+
+#endif /* _OFFLOAD_H */
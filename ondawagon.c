@@ -12,35 +12,40 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <unistd.h>
 #include <errno.h>
+#include <sys/signalfd.h>
 
+#include "compiler.h"
+#include "list.h"
+#include "nbio.h"
 #include "ondawagon.h"
+#include "tapif.h"
+#include "worker.h"
 
 const char *os_err(void)
 {
 	return strerror(errno);
 }
 
-static int do_list(void)
+static void list_event(void *priv, const struct dongle_event *ev)
 {
-	dongle_t *list;
-	size_t i, nmemb;
+	printf("%s: %s: %s / %s\n",
+		ev->serial,
+		ev->needs_ready ? "ZEROCD" : "READY",
+		ev->mnfr,
+		ev->product);
+}
 
-	if ( !dongle_list_all(&list, &nmemb) ) {
+/* Straight out of the registry, no need to open anything */
+static int do_list(void)
+{
+	if ( !dongle_watch(list_event, NULL) ) {
 		fprintf(stderr, "%s: there were some errors\n", odw_cmd);
 	}
 
-	for(i = 0; i < nmemb; i++) {
-		printf("%s: %s: %s / %s\n",
-			dongle_serial(list[i]),
-			dongle_needs_ready(list[i]) ? "ZEROCD" : "READY",
-			dongle_manufacturer(list[i]),
-			dongle_product(list[i]));
-		dongle_close(list[i]);
-	}
-
-	free(list);
-
+	dongle_watch(NULL, NULL);
 	return EXIT_SUCCESS;
 }
 
@@ -96,12 +101,10 @@ static int do_shell(const char *ser)
 
 	do_init_history(".ondawagon");
 
-	dongle_atcmd(d, "AT\r0\r");
+	dongle_atcmd(d, "AT");
 	while( (inp = readline("onda$ ") ) ) {
-		char buf[strlen(inp) + 1 + 2];
-		snprintf(buf, sizeof(buf), "%s\r", inp);
 		do_add_history(inp);
-		dongle_atcmd(d, buf);
+		dongle_atcmd(d, inp);
 	}
 
 	rl_free_line_state();
@@ -109,8 +112,125 @@ static int do_shell(const char *ser)
 	return EXIT_SUCCESS;
 }
 
+/* SIGINT/SIGTERM are delivered through a signalfd on the eventloop
+ * so that nbio never has to deal with EINTR
+ */
+struct sig_io {
+	struct nbio io;
+	int stop;
+};
+
+static void sig_read(struct iothread *t, struct nbio *n)
+{
+	struct sig_io *s = (struct sig_io *)n;
+	struct signalfd_siginfo si;
+
+	while ( read(n->fd, &si, sizeof(si)) == sizeof(si) )
+		s->stop = 1;
+
+	nbio_inactive(t, n, NBIO_READ|NBIO_ERROR);
+}
+
+static void sig_dtor(struct iothread *t, struct nbio *n)
+{
+	close(n->fd);
+}
+
+static const struct nbio_ops sig_ops = {
+	.read = sig_read,
+	.write = sig_read,
+	.dtor = sig_dtor,
+};
+
+static int do_signals(struct iothread *t, struct sig_io *s)
+{
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(s, 0, sizeof(*s));
+	s->io.fd = signalfd(-1, &set, SFD_NONBLOCK|SFD_CLOEXEC);
+	if ( s->io.fd < 0 ) {
+		fprintf(stderr, "%s: signalfd: %s\n", odw_cmd, os_err());
+		return 0;
+	}
+
+	s->io.ops = &sig_ops;
+	nbio_add(t, &s->io, NBIO_READ);
+	return 1;
+}
+
+static const char *prom_path;
+static unsigned int prom_interval = 15;
+
+struct loop {
+	struct iothread t;
+	struct sig_io sig;
+	struct nbio_timer prom;
+};
+
+static void prom_tick(struct iothread *t, struct nbio_timer *tm)
+{
+	dongle_counters_prom(prom_path);
+	nbio_timer_add(t, tm, prom_interval * 1000);
+}
+
+/* Last look at the counters, while the dongles are still about */
+static void loop_report(struct loop *l)
+{
+	if ( prom_path )
+		dongle_counters_prom(prom_path);
+	if ( odw_stats )
+		dongle_counters_dump(stdout);
+}
+
+static int loop_init(struct loop *l)
+{
+	if ( !nbio_init(&l->t, odw_eventloop) )
+		return 0;
+	nbio_busy_poll(&l->t, odw_busy_poll);
+	nbio_budget(&l->t, odw_weight, odw_budget);
+
+	if ( !dongle_loop_init(&l->t) )
+		goto err_fini;
+
+	if ( !do_signals(&l->t, &l->sig) )
+		goto err_loop;
+
+	nbio_timer_init(&l->prom, prom_tick);
+	if ( prom_path )
+		nbio_timer_add(&l->t, &l->prom, prom_interval * 1000);
+
+	return 1;
+err_loop:
+	dongle_loop_fini();
+err_fini:
+	nbio_fini(&l->t);
+	return 0;
+}
+
+static void loop_run(struct loop *l)
+{
+	while ( !l->sig.stop )
+		dongle_loop_pump(-1);
+}
+
+static void loop_fini(struct loop *l)
+{
+	if ( nbio_timer_pending(&l->prom) )
+		nbio_timer_del(&l->t, &l->prom);
+	dongle_loop_fini();
+	nbio_fini(&l->t);
+}
+
 static int do_ifup(const char *ser)
 {
+	int ret = EXIT_FAILURE;
+	struct loop l;
 	dongle_t d;
 
 	d = dongle_open(ser);
@@ -119,14 +239,113 @@ static int do_ifup(const char *ser)
 		return EXIT_FAILURE;
 	}
 
-	if ( !dongle_init(d) ) {
+	if ( !loop_init(&l) )
+		goto out_close;
+
+	if ( !dongle_init(d) )
+		goto out_loop;
+
+	if ( !dongle_ifup(d, &l.t) )
+		goto out_loop;
+
+	loop_run(&l);
+	loop_report(&l);
+
+	dongle_ifdown(d);
+	ret = EXIT_SUCCESS;
+out_loop:
+	loop_fini(&l);
+out_close:
+	dongle_close(d);
+	return ret;
+}
+
+/* Arrivals after startup are sticks being plugged in, or browning out
+ * and coming back, and get picked up the same way
+ */
+static void daemon_event(void *priv, const struct dongle_event *ev)
+{
+	size_t *nlive = priv;
+
+	switch(ev->ev) {
+	case DONGLE_ARRIVED:
+		if ( ev->needs_ready ) {
+			fprintf(stderr, "%s: %s: needs to be made ready\n",
+				odw_cmd, ev->serial);
+		}else if ( workers_assign(ev->serial, ev->bus, ev->addr) ) {
+			(*nlive)++;
+		}
+		break;
+	case DONGLE_LEFT:
+		if ( ev->needs_ready )
+			break;
+		printf("%s: %s: went away\n", odw_cmd, ev->serial);
+		workers_release(ev->serial);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Bring up every attached dongle, sharded across worker iothreads.
+ * With ready_all, mode-switch them all first.
+ */
+static int do_daemon(unsigned int nr, const char *policy, int ready_all)
+{
+	size_t nlive = 0, nready = 0;
+	struct loop l;
+	long ncpu;
+
+	if ( !loop_init(&l) )
 		return EXIT_FAILURE;
+
+	if ( ready_all && !dongle_ready_all(&nready) ) {
+		fprintf(stderr, "%s: there were some errors\n", odw_cmd);
+	}
+
+	if ( 0 == nr ) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nr = (ncpu > 0) ? ncpu : 1;
 	}
 
-	if ( !dongle_ifup(d) )
+	if ( !workers_start(nr, policy) ) {
+		loop_fini(&l);
 		return EXIT_FAILURE;
+	}
 
-	return EXIT_SUCCESS;
+	if ( !dongle_watch(daemon_event, &nlive) ) {
+		fprintf(stderr, "%s: there were some errors\n", odw_cmd);
+	}
+
+	if ( nlive ) {
+		printf("%s: serving %zu dongle(s)\n", odw_cmd, nlive);
+		loop_run(&l);
+	}else{
+		fprintf(stderr, "%s: no dongles to serve\n", odw_cmd);
+	}
+
+	dongle_watch(NULL, NULL);
+	loop_report(&l);
+	workers_stop();
+	loop_fini(&l);
+
+	return (nlive) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int do_ready_all(void)
+{
+	size_t nready;
+	struct loop l;
+	int ret;
+
+	if ( !loop_init(&l) )
+		return EXIT_FAILURE;
+
+	ret = dongle_ready_all(&nready);
+	printf("%s: %zu dongle(s) ready\n", odw_cmd, nready);
+
+	loop_fini(&l);
+	return (ret) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 static int do_ready(const char *ser)
@@ -146,6 +365,44 @@ static int do_ready(const char *ser)
 	return EXIT_SUCCESS;
 }
 
+static const char * const creg_stat[] = {
+	"not registered",
+	"registered, home network",
+	"searching",
+	"registration denied",
+	"unknown",
+	"registered, roaming",
+};
+
+/* Registration changes are worth knowing about, the rest of what the
+ * modems have to say only when verbose
+ */
+static void report_urc(void *priv, dongle_t d, const struct dongle_urc *u)
+{
+	switch(u->type) {
+	case DONGLE_URC_CREG:
+		if ( u->stat < 0 ||
+				(size_t)u->stat >= sizeof(creg_stat) /
+					sizeof(*creg_stat) )
+			break;
+		if ( u->lac >= 0 && u->ci >= 0 ) {
+			printf("%s: %s: %s, lac %04lx ci %04lx\n",
+				odw_cmd, dongle_serial(d),
+				creg_stat[u->stat], u->lac, u->ci);
+		}else{
+			printf("%s: %s: %s\n", odw_cmd, dongle_serial(d),
+				creg_stat[u->stat]);
+		}
+		break;
+	default:
+		if ( odw_verbose ) {
+			printf("%s: %s: %.*s\n", odw_cmd, dongle_serial(d),
+				(int)u->len, u->line);
+		}
+		break;
+	}
+}
+
 static void usage(FILE *f)
 {
 	fprintf(f, "%s: ONDA 3G dongle driver\n", odw_cmd);
@@ -161,13 +418,68 @@ static void usage(FILE *f)
 	fprintf(f, " --list             List all dongles\n");
 	fprintf(f, " --ready <serial>   Switch dongle in to 3G mode\n");
 	fprintf(f, " --ifup <serial>    Bring up network interface\n");
+	fprintf(f, " --ready-all        Switch every dongle in to 3G mode "
+		"at once\n");
+	fprintf(f, " --daemon           Bring up all dongles in one process\n");
+	fprintf(f, " --ifup-all         Like --daemon, switching them in to "
+		"3G mode first\n");
+	fprintf(f, " --workers <n>      Worker threads for --daemon "
+		"(default: one per CPU)\n");
+	fprintf(f, " --policy <name>    Dongle placement: round-robin, "
+		"least-loaded\n");
+	fprintf(f, " --rx-depth <n>     Bulk IN transfers kept in flight "
+		"per dongle (default: 8)\n");
+	fprintf(f, " --tun              Use a layer 3 TUN interface "
+		"instead of TAP\n");
+	fprintf(f, " --vnet-hdr         Accept checksum and TSO offloads "
+		"from the kernel\n");
+	fprintf(f, " --shared-tap <if>  One multiqueue interface for all "
+		"dongles\n");
+	fprintf(f, " --creg <n>         Registration reports, AT+CREG=n: "
+		"0, 1 or 2 (default: 2)\n");
+	fprintf(f, " --stats            Print every counter on the way "
+		"out\n");
+	fprintf(f, " --prom <file>      Keep Prometheus metrics in a "
+		"file, for a textfile collector\n");
+	fprintf(f, " --prom-interval <s> How often to rewrite it "
+		"(default: 15)\n");
+	fprintf(f, " --trace <file>     Record events in to per-thread "
+		"rings, saved at exit\n"
+		"                    for odw-trace to decode\n");
+	fprintf(f, " --trace-size <n>   Records kept per thread "
+		"(default: 65536)\n");
+	fprintf(f, " --eventloop <name> epoll, poll or io_uring "
+		"(default: epoll)\n");
+	fprintf(f, " --busy-poll <us>   Spin this long before sleeping "
+		"(epoll only)\n");
+	fprintf(f, " --weight <n>       Packets one fd handles before "
+		"yielding (default: 8)\n");
+	fprintf(f, " --budget <n>       Packets per eventloop iteration "
+		"(default: 300)\n");
+	fprintf(f, " --emulate <spec>   Software dongles instead of hardware: "
+		"n[,rate=pps]\n"
+		"                    [,size=bytes][,latency=us][,loss=%%]"
+		"[,zerocd]\n");
+	fprintf(f, " --verbose, -v      Show the control-plane handshake "
+		"as it happens\n");
 	fprintf(f, " --help, -h         Display this massage\n");
 	fprintf(f, "\n");
 }
 
 const char *odw_cmd;
+const char *odw_eventloop;
+unsigned int odw_busy_poll;
+unsigned int odw_weight;
+unsigned int odw_budget;
+unsigned int odw_verbose;
+unsigned int odw_stats;
 int main(int argc, char **argv)
 {
+	const char *policy = NULL;
+	const char *trace_path = NULL;
+	size_t trace_size = 65536;
+	unsigned int workers = 0;
+	unsigned int tap_flags = 0;
 	int i, ret;
 
 	if ( argc < 1 ) {
@@ -176,12 +488,38 @@ int main(int argc, char **argv)
 	}
 
 	odw_cmd = argv[0];
+	dongle_urc_subscribe(report_urc, NULL);
+
+	/* Commands run as soon as they are parsed, so the trace rings have
+	 * to exist before the main loop; pick these two out first so that
+	 * their order on the command line doesn't matter.
+	 */
+	for(i = 1; i < argc - 1; i++) {
+		if ( !strcmp(argv[i], "--trace-size") ) {
+			trace_size = strtoul(argv[++i], NULL, 0);
+			if ( !trace_size ) {
+				fprintf(stderr, "%s: bad --trace-size: %s\n",
+					odw_cmd, argv[i]);
+				return EXIT_FAILURE;
+			}
+			continue;
+		}
+		if ( !strcmp(argv[i], "--trace") )
+			trace_path = argv[++i];
+	}
+
+	if ( trace_path && !dongle_trace(trace_size) )
+		return EXIT_FAILURE;
 
 	for(ret = EXIT_FAILURE, i = 1; i < argc; i++) {
 		if ( !strcmp(argv[i], "--list") ) {
 			ret = do_list();
 			break;
 		}
+		if ( !strcmp(argv[i], "--ready-all") ) {
+			ret = do_ready_all();
+			break;
+		}
 		if ( !strcmp(argv[i], "--ready") && i + 1 < argc ) {
 			const char *ser = argv[i + 1];
 			ret = do_ready(ser);
@@ -197,6 +535,108 @@ int main(int argc, char **argv)
 			ret = do_ifup(ser);
 			break;
 		}
+		if ( !strcmp(argv[i], "--workers") && i + 1 < argc ) {
+			workers = strtoul(argv[++i], NULL, 0);
+			continue;
+		}
+		if ( !strcmp(argv[i], "--rx-depth") && i + 1 < argc ) {
+			if ( !dongle_rx_depth(strtoul(argv[++i], NULL, 0)) ) {
+				fprintf(stderr, "%s: bad --rx-depth: %s\n",
+					odw_cmd, argv[i]);
+				return EXIT_FAILURE;
+			}
+			continue;
+		}
+		if ( !strcmp(argv[i], "--tun") ) {
+			tap_flags |= TAPIF_TUN;
+			dongle_tap_flags(tap_flags);
+			continue;
+		}
+		if ( !strcmp(argv[i], "--vnet-hdr") ) {
+			tap_flags |= TAPIF_VNET_HDR;
+			dongle_tap_flags(tap_flags);
+			continue;
+		}
+		if ( !strcmp(argv[i], "--shared-tap") && i + 1 < argc ) {
+			tap_flags |= TAPIF_MULTI_QUEUE;
+			dongle_tap_flags(tap_flags);
+			dongle_tap_name(argv[++i]);
+			continue;
+		}
+		if ( !strcmp(argv[i], "--creg") && i + 1 < argc ) {
+			if ( !dongle_urc_creg(strtoul(argv[++i], NULL, 0)) ) {
+				fprintf(stderr, "%s: bad --creg: %s\n",
+					odw_cmd, argv[i]);
+				return EXIT_FAILURE;
+			}
+			continue;
+		}
+		if ( !strcmp(argv[i], "--stats") ) {
+			odw_stats = 1;
+			continue;
+		}
+		if ( !strcmp(argv[i], "--prom") && i + 1 < argc ) {
+			prom_path = argv[++i];
+			continue;
+		}
+		if ( !strcmp(argv[i], "--prom-interval") && i + 1 < argc ) {
+			prom_interval = strtoul(argv[++i], NULL, 0);
+			if ( !prom_interval ) {
+				fprintf(stderr, "%s: bad --prom-interval: %s\n",
+					odw_cmd, argv[i]);
+				return EXIT_FAILURE;
+			}
+			continue;
+		}
+		if ( !strcmp(argv[i], "--trace-size") && i + 1 < argc ) {
+			i++;
+			continue;
+		}
+		if ( !strcmp(argv[i], "--trace") && i + 1 < argc ) {
+			i++;
+			continue;
+		}
+		if ( !strcmp(argv[i], "--busy-poll") && i + 1 < argc ) {
+			odw_busy_poll = strtoul(argv[++i], NULL, 0);
+			continue;
+		}
+		if ( !strcmp(argv[i], "--weight") && i + 1 < argc ) {
+			odw_weight = strtoul(argv[++i], NULL, 0);
+			continue;
+		}
+		if ( !strcmp(argv[i], "--budget") && i + 1 < argc ) {
+			odw_budget = strtoul(argv[++i], NULL, 0);
+			continue;
+		}
+		if ( !strcmp(argv[i], "--eventloop") && i + 1 < argc ) {
+			odw_eventloop = argv[++i];
+			continue;
+		}
+		if ( !strcmp(argv[i], "--emulate") && i + 1 < argc ) {
+			if ( !dongle_emulate(argv[++i]) ) {
+				fprintf(stderr, "%s: bad --emulate: %s\n",
+					odw_cmd, argv[i]);
+				return EXIT_FAILURE;
+			}
+			continue;
+		}
+		if ( !strcmp(argv[i], "--policy") && i + 1 < argc ) {
+			policy = argv[++i];
+			continue;
+		}
+		if ( !strcmp(argv[i], "--daemon") ) {
+			ret = do_daemon(workers, policy, 0);
+			break;
+		}
+		if ( !strcmp(argv[i], "--ifup-all") ) {
+			ret = do_daemon(workers, policy, 1);
+			break;
+		}
+		if ( !strcmp(argv[i], "--verbose") ||
+			!strcmp(argv[i], "-v") ) {
+			odw_verbose = 1;
+			continue;
+		}
 		if ( !strcmp(argv[i], "--help") ||
 			!strcmp(argv[i], "-h") ) {
 			usage(stdout);
@@ -210,5 +650,8 @@ int main(int argc, char **argv)
 		break;
 	}
 
+	if ( trace_path && !dongle_trace_save(trace_path) )
+		ret = EXIT_FAILURE;
+
 	return ret;
 }
@@ -4,17 +4,164 @@
 #include "os.h"
 
 typedef struct _dongle *dongle_t;
+struct iothread;
 
 int dongle_list_all(dongle_t **dev, size_t *nmemb);
 dongle_t dongle_open(const char *serial);
 int dongle_ready(dongle_t d);
+int dongle_ready_all(size_t *nready);
 int dongle_init(dongle_t d);
 void dongle_close(dongle_t d);
 const char *dongle_serial(dongle_t d);
 const char *dongle_manufacturer(dongle_t d);
 const char *dongle_product(dongle_t d);
+unsigned int dongle_busnum(dongle_t d);
+unsigned int dongle_devnum(dongle_t d);
+uint64_t dongle_bytes(dongle_t d);
+uint32_t dongle_link_us(dongle_t d);
+const char *dongle_ifname(dongle_t d);
 int dongle_needs_ready(dongle_t d);
 int dongle_atcmd(dongle_t d, const char *cmd);
-int dongle_ifup(dongle_t d);
+
+/* Queued AT commands, the response runs up to and including the final
+ * result line and is only valid for the duration of the callback
+ */
+#define DONGLE_AT_OK		0
+#define DONGLE_AT_ERROR		1
+#define DONGLE_AT_TIMEOUT	2
+#define DONGLE_AT_GONE		3
+typedef void (*dongle_at_t)(void *priv, int result,
+				const char *resp, size_t len);
+int dongle_at(dongle_t d, const char *cmd, dongle_at_t fn, void *priv);
+
+/* Unsolicited result codes from the modem, fields which weren't in
+ * the report are -1
+ */
+#define DONGLE_URC_CREG		0	/* network registration */
+#define DONGLE_URC_CSQ		1	/* signal quality */
+#define DONGLE_URC_MODE		2	/* system mode, ie. 2G/3G */
+#define DONGLE_URC_RING		3
+#define DONGLE_URC_OTHER	4	/* only the line itself */
+struct dongle_urc {
+	unsigned int	type;
+	const char	*line;
+	size_t		len;
+	int		stat;
+	long		lac;
+	long		ci;
+	int		act;
+	int		rssi;
+	int		ber;
+	int		mode;
+	int		submode;
+};
+typedef void (*dongle_urc_t)(void *priv, dongle_t d,
+				const struct dongle_urc *urc);
+int dongle_urc_subscribe(dongle_urc_t fn, void *priv);
+int dongle_urc_creg(unsigned int n);
+
+int dongle_ifup(dongle_t d, struct iothread *t);
+void dongle_ifdown(dongle_t d);
+void dongle_stats(dongle_t d, FILE *f);
+int dongle_rx_depth(unsigned int depth);
+void dongle_tap_flags(unsigned int flags);
+void dongle_tap_name(const char *ifname);
+int dongle_emulate(const char *spec);
+
+/* Dongles coming and going, including re-enumerating after mode-switch */
+#define DONGLE_ARRIVED	0
+#define DONGLE_LEFT	1
+struct dongle_event {
+	unsigned int	ev;
+	const char	*serial;
+	const char	*product;
+	const char	*mnfr;
+	unsigned int	bus;
+	unsigned int	addr;
+	int		needs_ready;
+};
+typedef void (*dongle_watch_t)(void *priv, const struct dongle_event *ev);
+int dongle_watch(dongle_watch_t fn, void *priv);
+
+/* Counters of a dongle, or of an iothread in which case only loops,
+ * usb_events and the packet pool ones count. USB errors are indexed
+ * by negated libusb error code, anything past the end goes in the
+ * last one.
+ */
+#define DONGLE_USB_ERRORS	14
+struct dongle_counters {
+	uint64_t	rx_pkts;
+	uint64_t	rx_bytes;
+	uint64_t	tx_pkts;
+	uint64_t	tx_bytes;
+	uint64_t	tx_pool_stalls;	/* TAP reads held for a buffer */
+	uint64_t	drop_tap;	/* rx, TAP full */
+	uint64_t	drop_usb;	/* transfer failed, eg. stalled */
+	uint64_t	drop_bad;	/* frames we couldn't handle */
+	uint64_t	retries;
+	uint64_t	usb_err[DONGLE_USB_ERRORS];
+	uint64_t	tx_gso;
+	uint64_t	tx_segs;
+	uint64_t	sys_read;
+	uint64_t	sys_write;
+	uint64_t	sys_submit;
+	uint64_t	at_cmds;
+	uint64_t	at_fails;
+	uint64_t	at_timeouts;
+	uint64_t	at_us;		/* total latency */
+	uint64_t	at_us_max;
+	uint64_t	loops;
+	uint64_t	usb_events;
+	uint64_t	pool_hiwat;	/* most packets out at once */
+	uint64_t	pool_exhausted;	/* pkt_get() found it empty */
+};
+#define DONGLE_COUNTERS_DONGLE	0
+#define DONGLE_COUNTERS_THREAD	1
+typedef void (*dongle_counters_t)(void *priv, const char *name,
+					unsigned int kind,
+					const struct dongle_counters *c);
+void dongle_counters_snapshot(dongle_counters_t fn, void *priv);
+void dongle_counters_dump(FILE *f);
+int dongle_counters_prom(const char *path);
+
+/* Log-linear latency histograms in nanoseconds: a power of two range
+ * split linearly in to 1 << DONGLE_HIST_SUB_BITS buckets, so any value
+ * is within 12.5% of its bucket's lower bound. Every histogram has the
+ * same buckets, so merging them is just adding them up.
+ */
+#define DONGLE_HIST_SUB_BITS	3
+#define DONGLE_HIST_BUCKETS	((64 - DONGLE_HIST_SUB_BITS + 1) << \
+					DONGLE_HIST_SUB_BITS)
+struct dongle_hist {
+	uint64_t	count;
+	uint64_t	sum;
+	uint64_t	max;
+	uint64_t	bucket[DONGLE_HIST_BUCKETS];
+};
+#define DONGLE_HIST_BULK_IN	0 /* submit to completion, per dongle */
+#define DONGLE_HIST_BULK_OUT	1
+#define DONGLE_HIST_CONTROL	2 /* handshake round trips */
+#define DONGLE_HIST_LOOP	3 /* nbio_pump() not blocked, per thread */
+#define DONGLE_HIST_WAIT	4 /* nbio_pump() blocked for events */
+#define DONGLE_NR_HIST		5
+typedef void (*dongle_hist_t)(void *priv, const char *name,
+				unsigned int which, unsigned int ep,
+				const struct dongle_hist *h);
+void dongle_hist_snapshot(dongle_hist_t fn, void *priv);
+void dongle_hist_merge(struct dongle_hist *dst,
+			const struct dongle_hist *src);
+uint64_t dongle_hist_lower(unsigned int idx);
+uint64_t dongle_hist_percentile(const struct dongle_hist *h, double pct);
+
+/* Record events in to a ring of nrec per thread, to save at exit and
+ * decode with odw-trace
+ */
+int dongle_trace(size_t nrec);
+int dongle_trace_save(const char *path);
+
+/* Drive USB I/O for all dongles from an nbio eventloop */
+int dongle_loop_init(struct iothread *t);
+void dongle_loop_fini(void);
+void dongle_loop_pump(int mto);
 
 #endif /* _ONDAWAGON_H */
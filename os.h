@@ -2,6 +2,12 @@
 #define _ONDAWAGON_H
 
 extern const char *odw_cmd;
+extern const char *odw_eventloop;
+extern unsigned int odw_busy_poll;
+extern unsigned int odw_weight;
+extern unsigned int odw_budget;
+extern unsigned int odw_verbose;
+extern unsigned int odw_stats;
 const char *os_err(void);
 
 #endif /* _ONDAWAGON_H */
@@ -0,0 +1,159 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Functions:
+ *  o pktpool_reserve() - Set aside packets, growing the pool if need be
+ *  o pktpool_release() - Give a reservation back
+ *  o pktpool_wait() - Park an fd until a packet is released
+ *  o pkt_get()/pkt_put() - O(1) acquire and release
+*/
+
+#include <libusb-1.0/libusb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "list.h"
+#include "nbio.h"
+#include "ondawagon.h"
+#include "pktpool.h"
+
+#define PKT_ALIGN	64
+
+struct pkt_slab {
+	struct list_head	s_list;
+	unsigned int		s_nr;
+	uint8_t			*s_bufs;
+	struct pkt		s_pkts[0];
+};
+
+static size_t roundup(size_t len, size_t to)
+{
+	return ((len + to - 1) / to) * to;
+}
+
+/* Room for an ethernet header plus an 802.1q tag on top of the MTU,
+ * rounded to whole packets so that bulk IN never overflows
+ */
+size_t pktpool_bufsz(size_t mtu, unsigned int mps)
+{
+	return roundup(mtu + 18, (mps) ? mps : PKT_ALIGN);
+}
+
+/* ctr is where the owning thread counts high water and exhaustion */
+void pktpool_init(struct pktpool *pp, struct iothread *t,
+			struct dongle_counters *ctr)
+{
+	memset(pp, 0, sizeof(*pp));
+	INIT_LIST_HEAD(&pp->pp_free);
+	INIT_LIST_HEAD(&pp->pp_slabs);
+	INIT_LIST_HEAD(&pp->pp_waitq);
+	pp->pp_io = t;
+	pp->pp_ctr = ctr;
+}
+
+static void slab_free(struct pkt_slab *s)
+{
+	unsigned int i;
+
+	for(i = 0; i < s->s_nr; i++)
+		libusb_free_transfer(s->s_pkts[i].p_xfer);
+
+	free(s->s_bufs);
+	free(s);
+}
+
+void pktpool_fini(struct pktpool *pp)
+{
+	struct pkt_slab *s, *tmp;
+
+	if ( pp->pp_inuse )
+		fprintf(stderr, "%s: pktpool: %u packets leaked\n",
+			odw_cmd, pp->pp_inuse);
+
+	list_for_each_entry_safe(s, tmp, &pp->pp_slabs, s_list) {
+		list_del(&s->s_list);
+		slab_free(s);
+	}
+
+	INIT_LIST_HEAD(&pp->pp_free);
+	pp->pp_nr = 0;
+	pp->pp_reserved = 0;
+}
+
+static int pktpool_grow(struct pktpool *pp, unsigned int nr)
+{
+	struct pkt_slab *s;
+	unsigned int i;
+
+	s = calloc(1, sizeof(*s) + nr * sizeof(*s->s_pkts));
+	if ( NULL == s ) {
+		fprintf(stderr, "%s: calloc: %s\n", odw_cmd, os_err());
+		return 0;
+	}
+
+	if ( posix_memalign((void **)&s->s_bufs, PKT_ALIGN,
+				nr * pp->pp_bufsz) ) {
+		fprintf(stderr, "%s: posix_memalign: failed\n", odw_cmd);
+		free(s);
+		return 0;
+	}
+
+	for(i = 0; i < nr; i++) {
+		struct pkt *p = &s->s_pkts[i];
+
+		p->p_xfer = libusb_alloc_transfer(0);
+		if ( NULL == p->p_xfer ) {
+			fprintf(stderr, "%s: libusb_alloc_transfer: failed\n",
+				odw_cmd);
+			s->s_nr = i;
+			slab_free(s);
+			return 0;
+		}
+		p->p_buf = s->s_bufs + i * pp->pp_bufsz;
+	}
+
+	s->s_nr = nr;
+	for(i = 0; i < nr; i++)
+		list_add_tail(&s->s_pkts[i].p_list, &pp->pp_free);
+
+	list_add_tail(&s->s_list, &pp->pp_slabs);
+	pp->pp_nr += nr;
+	return 1;
+}
+
+/* Packets freed up by a release are handed to the next reservation
+ * rather than allocating more
+ */
+int pktpool_reserve(struct pktpool *pp, unsigned int nr, size_t bufsz)
+{
+	if ( 0 == pp->pp_nr ) {
+		pp->pp_bufsz = roundup(bufsz, PKT_ALIGN);
+	}else if ( bufsz > pp->pp_bufsz ) {
+		fprintf(stderr, "%s: pktpool: %zu byte buffers requested "
+			"from a pool of %zu\n", odw_cmd, bufsz, pp->pp_bufsz);
+		return 0;
+	}
+
+	if ( pp->pp_reserved + nr > pp->pp_nr &&
+			!pktpool_grow(pp, pp->pp_reserved + nr - pp->pp_nr) )
+		return 0;
+
+	pp->pp_reserved += nr;
+	return 1;
+}
+
+void pktpool_release(struct pktpool *pp, unsigned int nr)
+{
+	pp->pp_reserved -= nr;
+}
+
+/* Called from within a read callback which found the pool empty */
+void pktpool_wait(struct pktpool *pp, struct nbio *io)
+{
+	nbio_to_waitq(pp->pp_io, io, &pp->pp_waitq);
+}
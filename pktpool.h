@@ -0,0 +1,80 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+*/
+#ifndef _PKTPOOL_H
+#define _PKTPOOL_H
+
+/* A libusb transfer and the buffer it moves data in and out of */
+struct pkt {
+	struct list_head	p_list;
+	struct libusb_transfer	*p_xfer;
+	void			*p_priv;
+	unsigned int		p_slot;
+	uint8_t			*p_buf;
+	uint64_t		p_stamp;
+};
+
+/* Per-iothread pool of packets, never touched by any other thread.
+ * Buffers are all the same size. Datapaths reserve their share when
+ * they come up and hand it back when they stop, the pool only grows
+ * when reservations outrun it. So it's sized for the most datapaths
+ * ever up at once and steady state forwarding is malloc free.
+ */
+struct pktpool {
+	struct list_head	pp_free;
+	struct list_head	pp_slabs;
+	struct list_head	pp_waitq;
+	struct iothread		*pp_io;
+	size_t			pp_bufsz;
+	unsigned int		pp_nr;
+	unsigned int		pp_reserved;
+	unsigned int		pp_inuse;
+	struct dongle_counters	*pp_ctr;
+};
+
+_private void pktpool_init(struct pktpool *pp, struct iothread *t,
+				struct dongle_counters *ctr);
+_private void pktpool_fini(struct pktpool *pp);
+_private int pktpool_reserve(struct pktpool *pp, unsigned int nr,
+				size_t bufsz);
+_private void pktpool_release(struct pktpool *pp, unsigned int nr);
+_private size_t pktpool_bufsz(size_t mtu, unsigned int mps);
+_private void pktpool_wait(struct pktpool *pp, struct nbio *io);
+
+static inline struct pkt *pkt_get(struct pktpool *pp)
+{
+	struct pkt *p;
+
+	if ( unlikely(list_empty(&pp->pp_free)) ) {
+		pp->pp_ctr->pool_exhausted++;
+		return NULL;
+	}
+
+	p = list_entry(pp->pp_free.next, struct pkt, p_list);
+	list_del(&p->p_list);
+
+	if ( ++pp->pp_inuse > pp->pp_ctr->pool_hiwat )
+		pp->pp_ctr->pool_hiwat = pp->pp_inuse;
+
+	return p;
+}
+
+/* LIFO so that the next user gets a cache-hot buffer. Wakes one fd
+ * which went to sleep on an empty pool.
+ */
+static inline void pkt_put(struct pktpool *pp, struct pkt *p)
+{
+	struct nbio *n;
+
+	list_add(&p->p_list, &pp->pp_free);
+	pp->pp_inuse--;
+
+	if ( unlikely(!list_empty(&pp->pp_waitq)) ) {
+		n = list_entry(pp->pp_waitq.next, struct nbio, list);
+		nbio_wake(pp->pp_io, n, NBIO_READ);
+	}
+}
+
+#endif /* _PKTPOOL_H */
@@ -0,0 +1,519 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * The registry of counters and histograms from every dongle and
+ * iothread, and the ways of getting them out: a snapshot for the
+ * caller, a human readable dump and the Prometheus text format.
+ *
+ * Functions:
+ *  o stats_new()/stats_free() - Register and unregister a set
+ *  o dongle_counters_snapshot() - Copy out every set in turn
+ *  o dongle_hist_snapshot() - Copy out every histogram in turn
+ *  o dongle_counters_dump() - Print them all
+ *  o dongle_counters_prom() - Atomically rewrite a Prometheus text file
+*/
+
+#include <libusb-1.0/libusb.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "compiler.h"
+#include "list.h"
+#include "ondawagon.h"
+#include "hist.h"
+#include "stats.h"
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(stats_list);
+
+struct stats *stats_new(unsigned int kind, const char *name)
+{
+	struct stats *s;
+
+	if ( posix_memalign((void **)&s, 64, sizeof(*s)) ) {
+		fprintf(stderr, "%s: posix_memalign: failed\n", odw_cmd);
+		return NULL;
+	}
+
+	memset(s, 0, sizeof(*s));
+	s->s_kind = kind;
+	snprintf(s->s_name, sizeof(s->s_name), "%s", name);
+
+	pthread_mutex_lock(&stats_lock);
+	list_add_tail(&s->s_list, &stats_list);
+	pthread_mutex_unlock(&stats_lock);
+	return s;
+}
+
+void stats_free(struct stats *s)
+{
+	if ( NULL == s )
+		return;
+
+	pthread_mutex_lock(&stats_lock);
+	list_del(&s->s_list);
+	pthread_mutex_unlock(&stats_lock);
+	free(s);
+}
+
+static void stats_copy(void *out, const void *in, size_t len)
+{
+	const uint64_t *src = in;
+	uint64_t *dst = out;
+	size_t i;
+
+	for(i = 0; i < len / sizeof(*src); i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+/* Called with the registry locked, so keep fn short */
+void dongle_counters_snapshot(dongle_counters_t fn, void *priv)
+{
+	struct dongle_counters c;
+	struct stats *s;
+
+	pthread_mutex_lock(&stats_lock);
+	list_for_each_entry(s, &stats_list, s_list) {
+		stats_copy(&c, &s->s_ctr, sizeof(c));
+		(*fn)(priv, s->s_name, s->s_kind, &c);
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static int hist_kind(unsigned int which)
+{
+	return (which >= DONGLE_HIST_LOOP) ?
+		DONGLE_COUNTERS_THREAD : DONGLE_COUNTERS_DONGLE;
+}
+
+/* Same again for histograms, dongles have the USB ones and threads
+ * the eventloop ones
+ */
+void dongle_hist_snapshot(dongle_hist_t fn, void *priv)
+{
+	struct dongle_hist h;
+	struct stats *s;
+	unsigned int i;
+
+	pthread_mutex_lock(&stats_lock);
+	list_for_each_entry(s, &stats_list, s_list) {
+		for(i = 0; i < DONGLE_NR_HIST; i++) {
+			if ( hist_kind(i) != (int)s->s_kind )
+				continue;
+			stats_copy(&h, &s->s_hist[i], sizeof(h));
+			(*fn)(priv, s->s_name, i, s->s_ep[i], &h);
+		}
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void dump_one(void *priv, const char *name, unsigned int kind,
+			const struct dongle_counters *c)
+{
+	FILE *f = priv;
+	unsigned int i;
+
+	if ( kind == DONGLE_COUNTERS_THREAD ) {
+		fprintf(f, "%s: %"PRIu64" loops, %"PRIu64" usb event "
+			"dispatches\n", name, c->loops, c->usb_events);
+		fprintf(f, "%s: pool: %"PRIu64" packets high water, "
+			"%"PRIu64" times exhausted\n", name,
+			c->pool_hiwat, c->pool_exhausted);
+		return;
+	}
+
+	fprintf(f, "%s: rx %"PRIu64" pkts %"PRIu64" bytes, "
+		"tx %"PRIu64" pkts %"PRIu64" bytes\n", name,
+		c->rx_pkts, c->rx_bytes, c->tx_pkts, c->tx_bytes);
+	fprintf(f, "%s: tx held up %"PRIu64" times waiting on the pool\n",
+		name, c->tx_pool_stalls);
+	fprintf(f, "%s: drops: %"PRIu64" tap %"PRIu64" usb "
+		"%"PRIu64" bad, %"PRIu64" retries\n", name,
+		c->drop_tap, c->drop_usb, c->drop_bad, c->retries);
+	fprintf(f, "%s: at: %"PRIu64" cmds %"PRIu64" failed "
+		"%"PRIu64" timed out, %"PRIu64" us avg %"PRIu64" us max\n",
+		name, c->at_cmds, c->at_fails, c->at_timeouts,
+		(c->at_cmds) ? c->at_us / c->at_cmds : 0, c->at_us_max);
+
+	for(i = 1; i < DONGLE_USB_ERRORS; i++) {
+		if ( !c->usb_err[i] )
+			continue;
+		fprintf(f, "%s: %s: %"PRIu64"\n", name,
+			libusb_error_name((i < DONGLE_USB_ERRORS - 1) ?
+				-(int)i : LIBUSB_ERROR_OTHER),
+			c->usb_err[i]);
+	}
+}
+
+static const struct {
+	const char *name;
+	const char *prom;
+	const char *help;
+}hists[DONGLE_NR_HIST] = {
+	[DONGLE_HIST_BULK_IN] = { "bulk in", "odw_usb_bulk_in_seconds",
+		"Bulk IN transfers, submit to completion" },
+	[DONGLE_HIST_BULK_OUT] = { "bulk out", "odw_usb_bulk_out_seconds",
+		"Bulk OUT transfers, submit to completion" },
+	[DONGLE_HIST_CONTROL] = { "control", "odw_usb_control_seconds",
+		"Handshake control transfer round trips" },
+	[DONGLE_HIST_LOOP] = { "loop", "odw_loop_busy_seconds",
+		"Eventloop iterations, less time blocked" },
+	[DONGLE_HIST_WAIT] = { "wait", "odw_loop_wait_seconds",
+		"Time blocked waiting for events" },
+};
+
+struct hist_dump {
+	FILE			*f;
+	unsigned int		nr[DONGLE_NR_HIST];
+	struct dongle_hist	all[DONGLE_NR_HIST];
+};
+
+/* ep is -1 when it's a mixture of them */
+static void hist_print(FILE *f, const char *name, unsigned int which,
+			int ep, const struct dongle_hist *h)
+{
+	fprintf(f, "%s: %s", name, hists[which].name);
+	if ( which <= DONGLE_HIST_BULK_OUT && ep >= 0 )
+		fprintf(f, " ep 0x%02x", ep);
+	fprintf(f, ": %"PRIu64" samples, p50 %.1f p99 %.1f p99.9 %.1f "
+		"max %.1f us\n", h->count,
+		dongle_hist_percentile(h, 50.0) / 1000.0,
+		dongle_hist_percentile(h, 99.0) / 1000.0,
+		dongle_hist_percentile(h, 99.9) / 1000.0,
+		h->max / 1000.0);
+}
+
+static void dump_hist(void *priv, const char *name, unsigned int which,
+			unsigned int ep, const struct dongle_hist *h)
+{
+	struct hist_dump *hd = priv;
+
+	if ( !h->count )
+		return;
+
+	hist_print(hd->f, name, which, ep, h);
+	dongle_hist_merge(&hd->all[which], h);
+	hd->nr[which]++;
+}
+
+void dongle_counters_dump(FILE *f)
+{
+	struct hist_dump *hd;
+	unsigned int i;
+
+	dongle_counters_snapshot(dump_one, f);
+
+	hd = calloc(1, sizeof(*hd));
+	if ( NULL == hd ) {
+		fprintf(stderr, "%s: calloc: %s\n", odw_cmd, os_err());
+		return;
+	}
+
+	hd->f = f;
+	dongle_hist_snapshot(dump_hist, hd);
+
+	/* and how it looks across the board */
+	for(i = 0; i < DONGLE_NR_HIST; i++) {
+		if ( hd->nr[i] > 1 )
+			hist_print(f, "all", i, -1, &hd->all[i]);
+	}
+
+	free(hd);
+}
+
+struct prom_ent {
+	char			name[32];
+	unsigned int		kind;
+	struct dongle_counters	ctr;
+};
+
+/* Histograms go out with a bucket per octave, from about a
+ * microsecond to about half a minute, fixed so that they still add up
+ * across dongles and threads
+ */
+#define PROM_LE_MIN	10
+#define PROM_LE_MAX	35
+#define PROM_NR_LE	(PROM_LE_MAX - PROM_LE_MIN + 1)
+struct prom_hist {
+	char			name[32];
+	unsigned int		which;
+	unsigned int		ep;
+	uint64_t		count;
+	uint64_t		sum;
+	uint64_t		le[PROM_NR_LE];
+};
+
+struct prom_set {
+	struct prom_ent		*ent;
+	size_t			nr;
+	size_t			max;
+	struct prom_hist	*hist;
+	size_t			nr_hist;
+	size_t			max_hist;
+};
+
+static void prom_collect(void *priv, const char *name, unsigned int kind,
+				const struct dongle_counters *c)
+{
+	struct prom_set *set = priv;
+	struct prom_ent *e;
+	size_t max;
+
+	if ( set->nr >= set->max ) {
+		max = (set->max) ? set->max * 2 : 16;
+		e = realloc(set->ent, max * sizeof(*e));
+		if ( NULL == e )
+			return;
+		set->ent = e;
+		set->max = max;
+	}
+
+	e = &set->ent[set->nr++];
+	snprintf(e->name, sizeof(e->name), "%s", name);
+	e->kind = kind;
+	e->ctr = *c;
+}
+
+static void prom_collect_hist(void *priv, const char *name,
+				unsigned int which, unsigned int ep,
+				const struct dongle_hist *h)
+{
+	struct prom_set *set = priv;
+	struct prom_hist *ph;
+	unsigned int i, k, end;
+	uint64_t cum = 0;
+	size_t max;
+
+	if ( set->nr_hist >= set->max_hist ) {
+		max = (set->max_hist) ? set->max_hist * 2 : 16;
+		ph = realloc(set->hist, max * sizeof(*ph));
+		if ( NULL == ph )
+			return;
+		set->hist = ph;
+		set->max_hist = max;
+	}
+
+	ph = &set->hist[set->nr_hist++];
+	snprintf(ph->name, sizeof(ph->name), "%s", name);
+	ph->which = which;
+	ph->ep = ep;
+	ph->count = h->count;
+	ph->sum = h->sum;
+
+	/* Octaves line up with bucket boundaries, so each le counts
+	 * every sample below 2^k ns exactly. A sample of exactly 2^k ns
+	 * shares a bucket with larger ones and lands in the next le up,
+	 * although le is inclusive, so these are off by at most 1ns.
+	 */
+	for(i = 0, k = 0; k < PROM_NR_LE; k++) {
+		end = hist_index(1ULL << (PROM_LE_MIN + k));
+		for(; i < end; i++)
+			cum += h->bucket[i];
+		ph->le[k] = cum;
+	}
+}
+
+#define PROM_COUNTER	0
+#define PROM_GAUGE	1
+static const struct {
+	const char *name;
+	const char *help;
+	size_t off;
+	unsigned int kind;
+	unsigned int type;
+}metrics[] = {
+	{ "odw_rx_packets_total", "Frames from the modem to the TAP",
+		offsetof(struct dongle_counters, rx_pkts),
+		DONGLE_COUNTERS_DONGLE, PROM_COUNTER },
+	{ "odw_rx_bytes_total", "Bytes from the modem to the TAP",
+		offsetof(struct dongle_counters, rx_bytes),
+		DONGLE_COUNTERS_DONGLE, PROM_COUNTER },
+	{ "odw_tx_packets_total", "Frames from the TAP to the modem",
+		offsetof(struct dongle_counters, tx_pkts),
+		DONGLE_COUNTERS_DONGLE, PROM_COUNTER },
+	{ "odw_tx_bytes_total", "Bytes from the TAP to the modem",
+		offsetof(struct dongle_counters, tx_bytes),
+		DONGLE_COUNTERS_DONGLE, PROM_COUNTER },
+	{ "odw_drop_tap_total", "Frames dropped because the TAP was full",
+		offsetof(struct dongle_counters, drop_tap),
+		DONGLE_COUNTERS_DONGLE, PROM_COUNTER },
+	{ "odw_drop_usb_total", "Frames lost to failed transfers",
+		offsetof(struct dongle_counters, drop_usb),
+		DONGLE_COUNTERS_DONGLE, PROM_COUNTER },
+	{ "odw_drop_bad_total", "Frames which couldn't be handled",
+		offsetof(struct dongle_counters, drop_bad),
+		DONGLE_COUNTERS_DONGLE, PROM_COUNTER },
+	{ "odw_retries_total", "Transfers retried after an error",
+		offsetof(struct dongle_counters, retries),
+		DONGLE_COUNTERS_DONGLE, PROM_COUNTER },
+	{ "odw_tx_pool_stalls_total",
+		"Times the TAP waited for a free buffer, nothing was lost",
+		offsetof(struct dongle_counters, tx_pool_stalls),
+		DONGLE_COUNTERS_DONGLE, PROM_COUNTER },
+	{ "odw_syscalls_total", "TAP reads, writes and USB submits",
+		offsetof(struct dongle_counters, sys_submit),
+		DONGLE_COUNTERS_DONGLE, PROM_COUNTER },
+	{ "odw_at_commands_total", "AT commands completed",
+		offsetof(struct dongle_counters, at_cmds),
+		DONGLE_COUNTERS_DONGLE, PROM_COUNTER },
+	{ "odw_at_failures_total", "AT commands which failed",
+		offsetof(struct dongle_counters, at_fails),
+		DONGLE_COUNTERS_DONGLE, PROM_COUNTER },
+	{ "odw_at_timeouts_total", "AT commands which timed out",
+		offsetof(struct dongle_counters, at_timeouts),
+		DONGLE_COUNTERS_DONGLE, PROM_COUNTER },
+	{ "odw_at_latency_microseconds_total",
+		"Time spent waiting on AT commands",
+		offsetof(struct dongle_counters, at_us),
+		DONGLE_COUNTERS_DONGLE, PROM_COUNTER },
+	{ "odw_at_latency_max_microseconds",
+		"Slowest AT command so far",
+		offsetof(struct dongle_counters, at_us_max),
+		DONGLE_COUNTERS_DONGLE, PROM_GAUGE },
+	{ "odw_loop_iterations_total", "Eventloop iterations",
+		offsetof(struct dongle_counters, loops),
+		DONGLE_COUNTERS_THREAD, PROM_COUNTER },
+	{ "odw_usb_event_dispatches_total",
+		"Batches of USB completions handled",
+		offsetof(struct dongle_counters, usb_events),
+		DONGLE_COUNTERS_THREAD, PROM_COUNTER },
+	{ "odw_pool_packets_max", "Most pool packets in use at once",
+		offsetof(struct dongle_counters, pool_hiwat),
+		DONGLE_COUNTERS_THREAD, PROM_GAUGE },
+	{ "odw_pool_exhausted_total", "Packet requests the pool couldn't meet",
+		offsetof(struct dongle_counters, pool_exhausted),
+		DONGLE_COUNTERS_THREAD, PROM_COUNTER },
+};
+
+static uint64_t metric(const struct prom_ent *e, unsigned int i)
+{
+	const uint8_t *ptr = (const uint8_t *)&e->ctr + metrics[i].off;
+	uint64_t v;
+
+	memcpy(&v, ptr, sizeof(v));
+	if ( metrics[i].off == offsetof(struct dongle_counters, sys_submit) )
+		v += e->ctr.sys_read + e->ctr.sys_write;
+	return v;
+}
+
+static void prom_hist(FILE *f, const struct prom_hist *ph)
+{
+	const char *metric = hists[ph->which].prom;
+	char labels[64];
+	unsigned int k;
+
+	if ( ph->which <= DONGLE_HIST_BULK_OUT ) {
+		snprintf(labels, sizeof(labels), "dongle=\"%s\",ep=\"0x%02x\"",
+			ph->name, ph->ep);
+	}else if ( ph->which == DONGLE_HIST_CONTROL ) {
+		snprintf(labels, sizeof(labels), "dongle=\"%s\"", ph->name);
+	}else{
+		snprintf(labels, sizeof(labels), "thread=\"%s\"", ph->name);
+	}
+
+	for(k = 0; k < PROM_NR_LE; k++) {
+		fprintf(f, "%s_bucket{%s,le=\"%.9g\"} %"PRIu64"\n",
+			metric, labels,
+			(double)(1ULL << (PROM_LE_MIN + k)) / 1e9, ph->le[k]);
+	}
+	fprintf(f, "%s_bucket{%s,le=\"+Inf\"} %"PRIu64"\n",
+		metric, labels, ph->count);
+	fprintf(f, "%s_sum{%s} %.9f\n", metric, labels, ph->sum / 1e9);
+	fprintf(f, "%s_count{%s} %"PRIu64"\n", metric, labels, ph->count);
+}
+
+static void prom_write(FILE *f, const struct prom_set *set)
+{
+	const char *label;
+	unsigned int i, j;
+	size_t k;
+
+	for(i = 0; i < sizeof(metrics)/sizeof(*metrics); i++) {
+		label = (metrics[i].kind == DONGLE_COUNTERS_THREAD) ?
+				"thread" : "dongle";
+		fprintf(f, "# HELP %s %s\n", metrics[i].name, metrics[i].help);
+		fprintf(f, "# TYPE %s %s\n", metrics[i].name,
+			(metrics[i].type == PROM_GAUGE) ? "gauge" : "counter");
+		for(k = 0; k < set->nr; k++) {
+			if ( set->ent[k].kind != metrics[i].kind )
+				continue;
+			fprintf(f, "%s{%s=\"%s\"} %"PRIu64"\n",
+				metrics[i].name, label, set->ent[k].name,
+				metric(&set->ent[k], i));
+		}
+	}
+
+	fprintf(f, "# HELP odw_usb_errors_total USB errors by libusb code\n");
+	fprintf(f, "# TYPE odw_usb_errors_total counter\n");
+	for(k = 0; k < set->nr; k++) {
+		if ( set->ent[k].kind != DONGLE_COUNTERS_DONGLE )
+			continue;
+		for(j = 1; j < DONGLE_USB_ERRORS; j++) {
+			if ( !set->ent[k].ctr.usb_err[j] )
+				continue;
+			fprintf(f, "odw_usb_errors_total{dongle=\"%s\","
+				"error=\"%s\"} %"PRIu64"\n", set->ent[k].name,
+				libusb_error_name((j < DONGLE_USB_ERRORS - 1) ?
+					-(int)j : LIBUSB_ERROR_OTHER),
+				set->ent[k].ctr.usb_err[j]);
+		}
+	}
+
+	for(i = 0; i < DONGLE_NR_HIST; i++) {
+		fprintf(f, "# HELP %s %s\n", hists[i].prom, hists[i].help);
+		fprintf(f, "# TYPE %s histogram\n", hists[i].prom);
+		for(k = 0; k < set->nr_hist; k++) {
+			if ( set->hist[k].which == i )
+				prom_hist(f, &set->hist[k]);
+		}
+	}
+}
+
+/* Written to a temporary file and renamed over the top, so scrapers
+ * never see half of it
+ */
+int dongle_counters_prom(const char *path)
+{
+	struct prom_set set;
+	char tmp[strlen(path) + 5];
+	FILE *f;
+	int ret = 0;
+
+	memset(&set, 0, sizeof(set));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	/* snapshot first, so nothing waits on our I/O */
+	dongle_counters_snapshot(prom_collect, &set);
+	dongle_hist_snapshot(prom_collect_hist, &set);
+
+	f = fopen(tmp, "w");
+	if ( NULL == f ) {
+		fprintf(stderr, "%s: %s: %s\n", odw_cmd, tmp, os_err());
+		goto out;
+	}
+
+	prom_write(f, &set);
+
+	if ( fclose(f) ) {
+		fprintf(stderr, "%s: %s: %s\n", odw_cmd, tmp, os_err());
+		goto out;
+	}
+
+	if ( rename(tmp, path) ) {
+		fprintf(stderr, "%s: %s: %s\n", odw_cmd, path, os_err());
+		goto out;
+	}
+
+	ret = 1;
+out:
+	free(set.hist);
+	free(set.ent);
+	return ret;
+}
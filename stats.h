@@ -0,0 +1,36 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+*/
+#ifndef _STATS_H
+#define _STATS_H
+
+/* A set of counters, and latency histograms, registered for export.
+ * They're only ever written by the thread which owns them, with plain
+ * increments, and are read racily by whoever takes a snapshot, which
+ * is fine for 64bit words. Each set starts on its own cache line so
+ * neighbours don't bounce.
+ */
+struct stats {
+	struct dongle_counters	s_ctr;
+	struct list_head	s_list;
+	unsigned int		s_kind;
+	char			s_name[32];
+	uint8_t			s_ep[DONGLE_NR_HIST];
+	struct dongle_hist	s_hist[DONGLE_NR_HIST];
+} _cacheline;
+
+_private struct stats *stats_new(unsigned int kind, const char *name);
+_private void stats_free(struct stats *s);
+
+static inline void stats_usb_err(struct dongle_counters *c, int err)
+{
+	unsigned int i = -err;
+
+	if ( i >= DONGLE_USB_ERRORS )
+		i = DONGLE_USB_ERRORS - 1;
+	c->usb_err[i]++;
+}
+
+#endif /* _STATS_H */
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <sys/types.h>
@@ -6,18 +7,22 @@
 #include <sys/ioctl.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include "ondawagon.h"
 #include "tapif.h"
 
 #define DEV_NET_TUN	"/dev/net/tun"
+#define TAPIF_DEFAULT_MTU	1500
 
 struct _tapif {
 	int fd;
 	char ifname[IFNAMSIZ];
 	size_t mtu;
+	unsigned int flags;
 };
 
 static int fd_nonblock(int fd)
@@ -37,7 +42,27 @@ static int fd_nonblock(int fd)
 	return 1;
 }
 
-tapif_t tapif_open(const char *ifname)
+static size_t get_mtu(const char *ifname)
+{
+	struct ifreq ifr;
+	int s;
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	if ( s < 0 )
+		return TAPIF_DEFAULT_MTU;
+
+	memset(&ifr, 0, sizeof(ifr));
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+	if ( ioctl(s, SIOCGIFMTU, &ifr) || ifr.ifr_mtu <= 0 ) {
+		close(s);
+		return TAPIF_DEFAULT_MTU;
+	}
+
+	close(s);
+	return ifr.ifr_mtu;
+}
+
+tapif_t tapif_open(const char *ifname, unsigned int flags)
 {
 	struct _tapif *t;
 	struct ifreq ifr;
@@ -51,7 +76,12 @@ tapif_t tapif_open(const char *ifname)
 		goto err_free;
 
 	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	ifr.ifr_flags = IFF_NO_PI;
+	ifr.ifr_flags |= (flags & TAPIF_TUN) ? IFF_TUN : IFF_TAP;
+	if ( flags & TAPIF_VNET_HDR )
+		ifr.ifr_flags |= IFF_VNET_HDR;
+	if ( flags & TAPIF_MULTI_QUEUE )
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
 	if ( ifname && *ifname ) {
 		snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
 	}else{
@@ -63,11 +93,25 @@ tapif_t tapif_open(const char *ifname)
 		goto err_close;
 	}
 
+	/* Let the stack skip checksumming and segmentation, we finish
+	 * the job when the frame goes out over USB
+	 */
+	if ( (flags & TAPIF_VNET_HDR) && ioctl(t->fd, TUNSETOFFLOAD,
+				TUN_F_CSUM|TUN_F_TSO4|TUN_F_TSO6) ) {
+		fprintf(stderr, "%s: TUNSETOFFLOAD: %s\n", odw_cmd, os_err());
+		goto err_close;
+	}
+
 	if ( !fd_nonblock(t->fd) )
 		goto err_close;
 
+	t->flags = flags;
 	snprintf(t->ifname, sizeof(t->ifname), "%s", ifr.ifr_name);
-	printf("%s: %s\n", __func__, t->ifname);
+	t->mtu = get_mtu(t->ifname);
+	if ( odw_verbose ) {
+		printf("%s: %s%s\n", __func__, t->ifname,
+			(flags & TAPIF_MULTI_QUEUE) ? " (queue)" : "");
+	}
 	return t;
 err_close:
 	close(t->fd);
@@ -84,3 +128,83 @@ void tapif_close(tapif_t t)
 		free(t);
 	}
 }
+
+int tapif_fd(tapif_t t)
+{
+	return t->fd;
+}
+
+const char *tapif_name(tapif_t t)
+{
+	return t->ifname;
+}
+
+size_t tapif_mtu(tapif_t t)
+{
+	return t->mtu;
+}
+
+unsigned int tapif_flags(tapif_t t)
+{
+	return t->flags;
+}
+
+size_t tapif_hdrlen(tapif_t t)
+{
+	return (t->flags & TAPIF_VNET_HDR) ?
+		sizeof(struct virtio_net_hdr) : 0;
+}
+
+/* Attach or detach a queue of a multiqueue device, the kernel only
+ * steers flows to attached queues
+ */
+int tapif_queue(tapif_t t, int enable)
+{
+	struct ifreq ifr;
+
+	if ( !(t->flags & TAPIF_MULTI_QUEUE) )
+		return 1;
+
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = (enable) ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+	if ( ioctl(t->fd, TUNSETQUEUE, &ifr) ) {
+		fprintf(stderr, "%s: %s: TUNSETQUEUE: %s\n",
+			odw_cmd, t->ifname, os_err());
+		return 0;
+	}
+
+	return 1;
+}
+
+ssize_t tapif_read(tapif_t t, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	do {
+		ret = read(t->fd, buf, len);
+	}while ( ret < 0 && errno == EINTR );
+
+	return ret;
+}
+
+ssize_t tapif_write(tapif_t t, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	do {
+		ret = write(t->fd, buf, len);
+	}while ( ret < 0 && errno == EINTR );
+
+	return ret;
+}
+
+ssize_t tapif_writev(tapif_t t, const struct iovec *iov, int cnt)
+{
+	ssize_t ret;
+
+	do {
+		ret = writev(t->fd, iov, cnt);
+	}while ( ret < 0 && errno == EINTR );
+
+	return ret;
+}
@@ -1,9 +1,34 @@
 #ifndef _TAPIF_H
 #define _TAPIF_H
 
+#include <sys/uio.h>
+
 typedef struct _tapif *tapif_t;
 
-tapif_t tapif_open(const char *ifname);
+/* Layer 3 (TUN) device rather than ethernet (TAP) */
+#define TAPIF_TUN	(1 << 0)
+/* Every frame is preceded by a struct virtio_net_hdr and the kernel
+ * may hand us checksum-offloaded and TSO super-packets
+ */
+#define TAPIF_VNET_HDR	(1 << 1)
+/* Open one more queue of a multiqueue device, opening the same name
+ * again attaches another queue with its own fd
+ */
+#define TAPIF_MULTI_QUEUE	(1 << 2)
+
+tapif_t tapif_open(const char *ifname, unsigned int flags);
 void tapif_close(tapif_t t);
 
+int tapif_fd(tapif_t t);
+const char *tapif_name(tapif_t t);
+size_t tapif_mtu(tapif_t t);
+unsigned int tapif_flags(tapif_t t);
+size_t tapif_hdrlen(tapif_t t);
+int tapif_queue(tapif_t t, int enable);
+
+/* Non-blocking frame I/O, returns -1 with errno set on failure */
+ssize_t tapif_read(tapif_t t, void *buf, size_t len);
+ssize_t tapif_write(tapif_t t, const void *buf, size_t len);
+ssize_t tapif_writev(tapif_t t, const struct iovec *iov, int cnt);
+
 #endif /* _TAPIF_H */
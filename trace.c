@@ -0,0 +1,204 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Flight recorder. Each thread writes timestamped events in to a ring
+ * of its own, without locks or syscalls, overwriting the oldest once
+ * it's full. The rings are written out in one go at exit for odw-trace
+ * to make sense of.
+ *
+ * Functions:
+ *  o dongle_trace() - Start recording
+ *  o dongle_trace_save() - Write every thread's ring to a file
+ *  o trace_thread() - Name the calling thread's ring
+ *  o _trace_rec() - Append an event, see trace.h
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "compiler.h"
+#include "list.h"
+#include "ondawagon.h"
+#include "hist.h"
+#include "trace.h"
+
+struct trace_ring {
+	struct list_head	r_list;
+	char			r_name[32];
+	uint64_t		r_head;
+	uint64_t		r_mask;
+	struct trace_rec	r_rec[0];
+};
+
+int trace_on;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(trace_rings);
+static unsigned int trace_nr_rings;
+static size_t trace_nrec;
+static __thread struct trace_ring *ring;
+static __thread int ring_failed;
+
+/* nrec is rounded up to a power of two */
+int dongle_trace(size_t nrec)
+{
+	size_t n;
+
+	for(n = 1; n < nrec; n <<= 1)
+		/* do nothing */;
+
+	trace_nrec = n;
+	trace_on = 1;
+	trace_thread("main");
+	return NULL != ring;
+}
+
+static struct trace_ring *ring_new(void)
+{
+	struct trace_ring *r;
+
+	if ( posix_memalign((void **)&r, 64,
+			sizeof(*r) + trace_nrec * sizeof(*r->r_rec)) ) {
+		fprintf(stderr, "%s: trace: posix_memalign: failed\n",
+			odw_cmd);
+		ring_failed = 1;
+		return NULL;
+	}
+
+	/* fault it all in now rather than on the datapath */
+	memset(r, 0, sizeof(*r) + trace_nrec * sizeof(*r->r_rec));
+	r->r_mask = trace_nrec - 1;
+	snprintf(r->r_name, sizeof(r->r_name), "thread %p",
+			(void *)pthread_self());
+
+	pthread_mutex_lock(&trace_lock);
+	list_add_tail(&r->r_list, &trace_rings);
+	trace_nr_rings++;
+	pthread_mutex_unlock(&trace_lock);
+
+	ring = r;
+	return r;
+}
+
+void trace_thread(const char *name)
+{
+	if ( !trace_on )
+		return;
+	if ( NULL == ring && NULL == ring_new() )
+		return;
+	snprintf(ring->r_name, sizeof(ring->r_name), "%s", name);
+}
+
+void _trace_rec(unsigned int type, const void *id,
+		uint32_t arg, uint32_t arg2,
+		const void *data, size_t len)
+{
+	struct trace_rec *t;
+	const uint8_t *ptr = data;
+	size_t chunk;
+
+	if ( NULL == ring && (ring_failed || NULL == ring_new()) )
+		return;
+
+	if ( len > TRACE_DATA_MAX )
+		len = TRACE_DATA_MAX;
+
+	t = &ring->r_rec[ring->r_head++ & ring->r_mask];
+	t->t_ns = hist_now();
+	t->t_id = (uintptr_t)id;
+	t->t_arg = arg;
+	t->t_arg2 = arg2;
+	t->t_type = type;
+
+	for(;;) {
+		chunk = (len > TRACE_REC_DATA) ? TRACE_REC_DATA : len;
+		memcpy(t->t_data, ptr, chunk);
+		t->t_len = chunk;
+		ptr += chunk;
+		len -= chunk;
+
+		if ( !len ) {
+			t->t_flags = 0;
+			break;
+		}
+
+		t->t_flags = TRACE_MORE;
+		t = &ring->r_rec[ring->r_head++ & ring->r_mask];
+		t->t_ns = 0;
+		t->t_id = (uintptr_t)id;
+		t->t_arg = t->t_arg2 = 0;
+		t->t_type = TRACE_DATA;
+	}
+}
+
+static int ring_save(FILE *f, struct trace_ring *r)
+{
+	struct trace_file_ring fr;
+	uint64_t first, nr;
+
+	nr = (r->r_head > r->r_mask + 1) ? r->r_mask + 1 : r->r_head;
+	first = r->r_head - nr;
+
+	memset(&fr, 0, sizeof(fr));
+	snprintf(fr.r_name, sizeof(fr.r_name), "%s", r->r_name);
+	fr.r_nr = nr;
+	fr.r_lost = first;
+	if ( fwrite(&fr, sizeof(fr), 1, f) != 1 )
+		return 0;
+
+	/* oldest first, which is the tail end of the array once wrapped */
+	first &= r->r_mask;
+	if ( first + nr > r->r_mask + 1 ) {
+		if ( fwrite(r->r_rec + first, sizeof(*r->r_rec),
+				r->r_mask + 1 - first, f) !=
+				r->r_mask + 1 - first )
+			return 0;
+		nr -= r->r_mask + 1 - first;
+		first = 0;
+	}
+
+	return fwrite(r->r_rec + first, sizeof(*r->r_rec), nr, f) == nr;
+}
+
+/* Call once the threads have stopped writing, ie. at exit */
+int dongle_trace_save(const char *path)
+{
+	struct trace_ring *r;
+	struct trace_file hdr;
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(path, "w");
+	if ( NULL == f ) {
+		fprintf(stderr, "%s: %s: %s\n", odw_cmd, path, os_err());
+		return 0;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.f_magic, TRACE_MAGIC, sizeof(hdr.f_magic));
+	hdr.f_version = TRACE_VERSION;
+	hdr.f_recsz = sizeof(struct trace_rec);
+
+	pthread_mutex_lock(&trace_lock);
+	hdr.f_nr_rings = trace_nr_rings;
+	if ( fwrite(&hdr, sizeof(hdr), 1, f) != 1 )
+		goto out;
+	list_for_each_entry(r, &trace_rings, r_list) {
+		if ( !ring_save(f, r) )
+			goto out;
+	}
+	ret = 1;
+out:
+	pthread_mutex_unlock(&trace_lock);
+
+	if ( fclose(f) )
+		ret = 0;
+	if ( !ret )
+		fprintf(stderr, "%s: %s: %s\n", odw_cmd, path, os_err());
+	return ret;
+}
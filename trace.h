@@ -0,0 +1,152 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+*/
+#ifndef _TRACE_H
+#define _TRACE_H
+
+/* Every trace point is a USDT probe, for perf/bpftrace/systemtap, and
+ * a record in a per-thread ring, for odw-trace to decode afterwards.
+ * With the ring switched off all that's left is a branch on trace_on
+ * and a nop for the probe.
+ */
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define trace_probe2(n, a, b) DTRACE_PROBE2(ondawagon, n, a, b)
+#define trace_probe3(n, a, b, c) DTRACE_PROBE3(ondawagon, n, a, b, c)
+#define trace_probe4(n, a, b, c, d) DTRACE_PROBE4(ondawagon, n, a, b, c, d)
+#else
+#define trace_probe2(n, a, b) do { } while(0)
+#define trace_probe3(n, a, b, c) do { } while(0)
+#define trace_probe4(n, a, b, c, d) do { } while(0)
+#endif
+
+#define TRACE_NONE		0
+#define TRACE_DATA		1 /* more bytes for the record before */
+#define TRACE_NAME		2 /* id is known as data from now on */
+#define TRACE_XFER_SUBMIT	3 /* arg ep, arg2 length */
+#define TRACE_XFER_DONE		4 /* arg ep | status << 8, arg2 length */
+#define TRACE_NBIO_SLEEP	5 /* arg timeout in ms */
+#define TRACE_NBIO_WAKE		6
+#define TRACE_AT_TX		7
+#define TRACE_AT_RX		8
+#define TRACE_STATE		9 /* arg machine, arg2 from << 16 | to */
+#define TRACE_NR_TYPES		10
+
+#define TRACE_MACHINE_DONGLE	0
+#define TRACE_MACHINE_HANDSHAKE	1
+
+/* Records are fixed size so that a wrapped ring can still be walked,
+ * payloads longer than t_data spill in to TRACE_DATA records
+ */
+#define TRACE_REC_DATA	36
+#define TRACE_MORE	(1U << 0)
+struct trace_rec {
+	uint64_t	t_ns;
+	uint64_t	t_id;
+	uint32_t	t_arg;
+	uint32_t	t_arg2;
+	uint16_t	t_type;
+	uint8_t		t_len;
+	uint8_t		t_flags;
+	uint8_t		t_data[TRACE_REC_DATA];
+};
+
+/* Saved as a header, then each ring's header and its records, oldest
+ * first. Host byte order.
+ */
+#define TRACE_MAGIC	"ODWTRACE"
+#define TRACE_VERSION	1
+struct trace_file {
+	char		f_magic[8];
+	uint32_t	f_version;
+	uint32_t	f_recsz;
+	uint32_t	f_nr_rings;
+	uint32_t	f_pad;
+};
+
+struct trace_file_ring {
+	char		r_name[32];
+	uint64_t	r_nr;
+	uint64_t	r_lost;
+};
+
+/* payloads are cut short after this, it's a trace not a capture */
+#define TRACE_DATA_MAX	512
+
+extern int trace_on;
+
+_private void _trace_rec(unsigned int type, const void *id,
+				uint32_t arg, uint32_t arg2,
+				const void *data, size_t len);
+_private void trace_thread(const char *name);
+
+static inline void trace_name(const void *id, const char *name)
+{
+	trace_probe2(name, id, name);
+	if ( unlikely(trace_on) )
+		_trace_rec(TRACE_NAME, id, 0, 0, name, strlen(name));
+}
+
+/* Control-plane transfers have their payload recorded, the datapath's
+ * don't, pass NULL for data
+ */
+static inline void trace_xfer_submit(const void *x, unsigned int ep,
+					const void *data, size_t len)
+{
+	trace_probe3(xfer_submit, x, ep, len);
+	if ( unlikely(trace_on) )
+		_trace_rec(TRACE_XFER_SUBMIT, x, ep, len,
+				data, (data) ? len : 0);
+}
+
+static inline void trace_xfer_done(const void *x, unsigned int ep,
+					int status, const void *data,
+					size_t len)
+{
+	trace_probe4(xfer_done, x, ep, status, len);
+	if ( unlikely(trace_on) )
+		_trace_rec(TRACE_XFER_DONE, x,
+				ep | ((uint32_t)status << 8), len,
+				data, (data) ? len : 0);
+}
+
+static inline void trace_nbio_sleep(const void *t, int mto)
+{
+	trace_probe2(nbio_sleep, t, mto);
+	if ( unlikely(trace_on) )
+		_trace_rec(TRACE_NBIO_SLEEP, t, mto, 0, NULL, 0);
+}
+
+static inline void trace_nbio_wake(const void *t)
+{
+	trace_probe2(nbio_wake, t, 0);
+	if ( unlikely(trace_on) )
+		_trace_rec(TRACE_NBIO_WAKE, t, 0, 0, NULL, 0);
+}
+
+static inline void trace_at_tx(const void *d, const char *cmd, size_t len)
+{
+	trace_probe3(at_tx, d, cmd, len);
+	if ( unlikely(trace_on) )
+		_trace_rec(TRACE_AT_TX, d, 0, len, cmd, len);
+}
+
+static inline void trace_at_rx(const void *d, const char *line, size_t len)
+{
+	trace_probe3(at_rx, d, line, len);
+	if ( unlikely(trace_on) )
+		_trace_rec(TRACE_AT_RX, d, 0, len, line, len);
+}
+
+static inline void trace_state(const void *d, unsigned int machine,
+				unsigned int from, unsigned int to)
+{
+	trace_probe4(state, d, machine, from, to);
+	if ( unlikely(trace_on) )
+		_trace_rec(TRACE_STATE, d, machine, (from << 16) | to,
+				NULL, 0);
+}
+
+#endif /* _TRACE_H */
@@ -0,0 +1,382 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * odw-trace: decode a file written by ondawagon --trace. Events from
+ * every thread are merged in to one timeline, with payloads shown as
+ * a hex dump.
+ *
+ * Functions:
+ *  o load_ring() - Read a ring, folding payloads back together
+ *  o print_ev() - Render one event
+*/
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "compiler.h"
+#include "trace.h"
+
+struct ev {
+	uint64_t	ns;
+	uint64_t	id;
+	uint32_t	arg;
+	uint32_t	arg2;
+	unsigned int	type;
+	unsigned int	ring;
+	size_t		seq;
+	size_t		len;
+	uint8_t		*data;
+};
+
+struct name {
+	uint64_t	id;
+	char		name[TRACE_DATA_MAX + 1];
+};
+
+static const char *cmd;
+static char (*rings)[32];
+static struct ev *evs;
+static size_t nr_evs;
+static struct name *names;
+static size_t nr_names;
+
+static const char * const xfer_status[] = {
+	"completed",
+	"error",
+	"timed out",
+	"cancelled",
+	"stall",
+	"no device",
+	"overflow",
+};
+
+static const char * const dongle_states[] = {
+	"zerocd",
+	"ready",
+	"live",
+};
+
+static const char * const hs_states[] = {
+	"sync",
+	"send",
+	"recv",
+	"final",
+	"done",
+};
+
+static void _hex_dumpf(FILE *f, const uint8_t *tmp, size_t len, size_t llen)
+{
+	size_t i, j;
+	size_t line;
+
+	if ( NULL == f || 0 == len )
+		return;
+
+	for(j = 0; j < len; j += line, tmp += line) {
+		if ( j + llen > len ) {
+			line = len - j;
+		}else{
+			line = llen;
+		}
+
+		fprintf(f, " | %05zx : ", j);
+
+		for(i = 0; i < line; i++) {
+			if ( isprint(tmp[i]) ) {
+				fprintf(f, "%c", tmp[i]);
+			}else{
+				fprintf(f, ".");
+			}
+		}
+
+		for(; i < llen; i++)
+			fprintf(f, " ");
+
+		for(i = 0; i < line; i++)
+			fprintf(f, " %02x", tmp[i]);
+
+		fprintf(f, "\n");
+	}
+	fprintf(f, "\n");
+}
+
+static const char *lookup(const char * const *tbl, size_t nmemb,
+				unsigned int i)
+{
+	return (i < nmemb) ? tbl[i] : "?";
+}
+
+static const char *id_name(uint64_t id)
+{
+	size_t i;
+
+	/* the last one to claim it, addresses get reused */
+	for(i = nr_names; i; i--) {
+		if ( names[i - 1].id == id )
+			return names[i - 1].name;
+	}
+	return NULL;
+}
+
+static int add_name(const struct ev *e)
+{
+	struct name *n;
+
+	n = realloc(names, (nr_names + 1) * sizeof(*names));
+	if ( NULL == n )
+		return 0;
+
+	names = n;
+	n = &names[nr_names++];
+	n->id = e->id;
+	if ( e->len )
+		memcpy(n->name, e->data, e->len);
+	n->name[e->len] = '\0';
+	return 1;
+}
+
+static struct ev *new_ev(void)
+{
+	static size_t max;
+	struct ev *e;
+
+	if ( nr_evs >= max ) {
+		max = (max) ? max * 2 : 4096;
+		e = realloc(evs, max * sizeof(*evs));
+		if ( NULL == e ) {
+			fprintf(stderr, "%s: realloc: %s\n",
+				cmd, strerror(errno));
+			return NULL;
+		}
+		evs = e;
+	}
+
+	return &evs[nr_evs++];
+}
+
+/* TRACE_DATA records belong to the event before them, which may have
+ * been overwritten if the ring wrapped in between
+ */
+static int load_ring(FILE *f, unsigned int idx, uint64_t nr)
+{
+	struct trace_rec t;
+	struct ev *e = NULL;
+	int more = 0;
+	uint8_t *data;
+	uint64_t i;
+
+	for(i = 0; i < nr; i++) {
+		if ( fread(&t, sizeof(t), 1, f) != 1 )
+			return 0;
+
+		if ( t.t_type == TRACE_DATA ) {
+			if ( !more )
+				continue;
+		}else{
+			e = new_ev();
+			if ( NULL == e )
+				return 0;
+			e->ns = t.t_ns;
+			e->id = t.t_id;
+			e->arg = t.t_arg;
+			e->arg2 = t.t_arg2;
+			e->type = t.t_type;
+			e->ring = idx;
+			e->seq = nr_evs;
+			e->len = 0;
+			e->data = NULL;
+		}
+
+		more = !!(t.t_flags & TRACE_MORE);
+		if ( !t.t_len || t.t_len > TRACE_REC_DATA ||
+				e->len + t.t_len > TRACE_DATA_MAX )
+			continue;
+
+		data = realloc(e->data, e->len + t.t_len);
+		if ( NULL == data )
+			return 0;
+		memcpy(data + e->len, t.t_data, t.t_len);
+		e->data = data;
+		e->len += t.t_len;
+	}
+
+	return 1;
+}
+
+static int load(const char *fn)
+{
+	struct trace_file_ring r;
+	struct trace_file hdr;
+	unsigned int i;
+	FILE *f;
+
+	f = fopen(fn, "r");
+	if ( NULL == f ) {
+		fprintf(stderr, "%s: %s: %s\n", cmd, fn, strerror(errno));
+		return 0;
+	}
+
+	if ( fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+			memcmp(hdr.f_magic, TRACE_MAGIC, sizeof(hdr.f_magic)) ||
+			hdr.f_version != TRACE_VERSION ||
+			hdr.f_recsz != sizeof(struct trace_rec) ) {
+		fprintf(stderr, "%s: %s: not a trace, or the wrong version\n",
+			cmd, fn);
+		goto err;
+	}
+
+	rings = calloc(hdr.f_nr_rings + 1, sizeof(*rings));
+	if ( NULL == rings )
+		goto err;
+
+	for(i = 0; i < hdr.f_nr_rings; i++) {
+		if ( fread(&r, sizeof(r), 1, f) != 1 )
+			goto trunc;
+		memcpy(rings[i], r.r_name, sizeof(rings[i]));
+		rings[i][sizeof(rings[i]) - 1] = '\0';
+		if ( r.r_lost ) {
+			printf("%s: %"PRIu64" records lost to wrapping\n",
+				rings[i], r.r_lost);
+		}
+		if ( !load_ring(f, i, r.r_nr) )
+			goto trunc;
+	}
+
+	fclose(f);
+	return 1;
+trunc:
+	fprintf(stderr, "%s: %s: truncated\n", cmd, fn);
+err:
+	fclose(f);
+	return 0;
+}
+
+static int ev_cmp(const void *A, const void *B)
+{
+	const struct ev *a = A, *b = B;
+
+	if ( a->ns != b->ns )
+		return (a->ns < b->ns) ? -1 : 1;
+	return (a->seq < b->seq) ? -1 : (a->seq > b->seq);
+}
+
+static void print_text(const struct ev *e)
+{
+	size_t i;
+
+	printf(" \"");
+	for(i = 0; i < e->len; i++) {
+		if ( isprint(e->data[i]) && e->data[i] != '"' ) {
+			putchar(e->data[i]);
+		}else{
+			printf("\\x%02x", e->data[i]);
+		}
+	}
+	printf("\"");
+}
+
+static void print_ev(const struct ev *e, uint64_t base)
+{
+	const char *who = id_name(e->id);
+	unsigned int from, to;
+
+	printf("%12.6f %-10s ", (e->ns - base) / 1e9, rings[e->ring]);
+	if ( who ) {
+		printf("%-12s ", who);
+	}else{
+		printf("%#-12"PRIx64" ", e->id);
+	}
+
+	switch(e->type) {
+	case TRACE_NAME:
+		printf("name");
+		print_text(e);
+		break;
+	case TRACE_XFER_SUBMIT:
+		printf("submit ep 0x%02x len %"PRIu32,
+			e->arg & 0xff, e->arg2);
+		break;
+	case TRACE_XFER_DONE:
+		printf("done ep 0x%02x %s len %"PRIu32, e->arg & 0xff,
+			lookup(xfer_status, sizeof(xfer_status) /
+				sizeof(*xfer_status), e->arg >> 8),
+			e->arg2);
+		break;
+	case TRACE_NBIO_SLEEP:
+		printf("sleep %d ms", (int)e->arg);
+		break;
+	case TRACE_NBIO_WAKE:
+		printf("wake");
+		break;
+	case TRACE_AT_TX:
+		printf("at tx");
+		print_text(e);
+		break;
+	case TRACE_AT_RX:
+		printf("at rx");
+		print_text(e);
+		break;
+	case TRACE_STATE:
+		from = e->arg2 >> 16;
+		to = e->arg2 & 0xffff;
+		if ( e->arg == TRACE_MACHINE_HANDSHAKE ) {
+			printf("handshake %s -> %s",
+				lookup(hs_states, sizeof(hs_states) /
+					sizeof(*hs_states), from),
+				lookup(hs_states, sizeof(hs_states) /
+					sizeof(*hs_states), to));
+		}else{
+			printf("dongle %s -> %s",
+				lookup(dongle_states, sizeof(dongle_states) /
+					sizeof(*dongle_states), from),
+				lookup(dongle_states, sizeof(dongle_states) /
+					sizeof(*dongle_states), to));
+		}
+		break;
+	default:
+		printf("type %u", e->type);
+		break;
+	}
+
+	printf("\n");
+
+	switch(e->type) {
+	case TRACE_XFER_SUBMIT:
+	case TRACE_XFER_DONE:
+		_hex_dumpf(stdout, e->data, e->len, 16);
+		break;
+	default:
+		break;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	size_t i;
+
+	cmd = (argc > 0) ? argv[0] : "odw-trace";
+	if ( argc != 2 ) {
+		fprintf(stderr, "Usage: %s <trace file>\n", cmd);
+		return EXIT_FAILURE;
+	}
+
+	if ( !load(argv[1]) )
+		return EXIT_FAILURE;
+
+	qsort(evs, nr_evs, sizeof(*evs), ev_cmp);
+
+	for(i = 0; i < nr_evs; i++) {
+		if ( evs[i].type == TRACE_NAME && !add_name(&evs[i]) )
+			return EXIT_FAILURE;
+		print_ev(&evs[i], evs[0].ns);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,268 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Unsolicited result codes. The AT channel hands over every line it
+ * can't pin on the command in flight, the ones we recognise are
+ * parsed and published to subscribers as typed events. Subscribers
+ * are called on whichever thread is running the dongle.
+ *
+ * Functions:
+ *  o dongle_urc_subscribe() - Register for events from all dongles
+ *  o dongle_urc_creg() - Registration reports to ask for at init
+ *  o urc_dispatch() - Publish a line if it's one we know
+ *  o urc_init() - Turn on registration reports on a live dongle
+*/
+
+#include <libusb-1.0/libusb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "list.h"
+#include "nbio.h"
+#include "ondawagon.h"
+#include "tapif.h"
+#include "dongle.h"
+
+#define URC_MAX_SUBS	8
+
+static struct {
+	dongle_urc_t	fn;
+	void		*priv;
+}subs[URC_MAX_SUBS];
+static unsigned int nr_subs;
+static unsigned int creg_mode = 2;
+
+static const struct {
+	const char *pfx;
+	size_t len;
+	unsigned int type;
+}urcs[] = {
+	{ "+CREG:", 6, DONGLE_URC_CREG },
+	{ "+CSQ:", 5, DONGLE_URC_CSQ },
+	{ "^RSSI:", 6, DONGLE_URC_CSQ },
+	{ "^MODE:", 6, DONGLE_URC_MODE },
+	{ "RING", 4, DONGLE_URC_RING },
+	{ "+CRING:", 7, DONGLE_URC_RING },
+	{ "+CGREG:", 7, DONGLE_URC_OTHER },
+	{ "+CMTI:", 6, DONGLE_URC_OTHER },
+	{ "+CUSD:", 6, DONGLE_URC_OTHER },
+	{ "^BOOT:", 6, DONGLE_URC_OTHER },
+	{ "^SRVST:", 7, DONGLE_URC_OTHER },
+	{ "^SIMST:", 7, DONGLE_URC_OTHER },
+	{ "^DSFLOWRPT:", 11, DONGLE_URC_OTHER },
+};
+
+/* Subscribe before any dongles are brought up, there's no locking */
+int dongle_urc_subscribe(dongle_urc_t fn, void *priv)
+{
+	if ( nr_subs >= URC_MAX_SUBS )
+		return 0;
+
+	subs[nr_subs].fn = fn;
+	subs[nr_subs].priv = priv;
+	nr_subs++;
+	return 1;
+}
+
+/* AT+CREG=n: 0 for none, 1 for status, 2 with location too */
+int dongle_urc_creg(unsigned int n)
+{
+	if ( n > 2 )
+		return 0;
+	creg_mode = n;
+	return 1;
+}
+
+static void publish(struct _dongle *d, const struct dongle_urc *u)
+{
+	unsigned int i;
+
+	for(i = 0; i < nr_subs; i++)
+		(*subs[i].fn)(subs[i].priv, d, u);
+}
+
+/* Next comma separated field, numbers in quotes are hex. Returns 0
+ * when we run out of line, -1 goes in to v for an empty field.
+ */
+static int field(const char **pp, const char *end, long *v)
+{
+	const char *p = *pp;
+	int quoted = 0, base = 10, digit;
+
+	while ( p < end && *p == ' ' )
+		p++;
+	if ( p >= end )
+		return 0;
+
+	if ( *p == '"' ) {
+		quoted = 1;
+		base = 16;
+		p++;
+	}
+
+	for(*v = -1; p < end; p++) {
+		if ( *p >= '0' && *p <= '9' ) {
+			digit = *p - '0';
+		}else if ( base == 16 && *p >= 'a' && *p <= 'f' ) {
+			digit = *p - 'a' + 10;
+		}else if ( base == 16 && *p >= 'A' && *p <= 'F' ) {
+			digit = *p - 'A' + 10;
+		}else{
+			break;
+		}
+		*v = ((*v < 0) ? 0 : *v) * base + digit;
+	}
+
+	if ( quoted && p < end && *p == '"' )
+		p++;
+	while ( p < end && *p != ',' )
+		p++;
+	if ( p < end )
+		p++;
+
+	*pp = p;
+	return 1;
+}
+
+/* stat[,lac,ci[,act]] with n in front of it in a query response */
+static void parse_creg(struct dongle_urc *u, const char *p,
+			const char *end, int query)
+{
+	long v;
+
+	if ( query && !field(&p, end, &v) )
+		return;
+	if ( field(&p, end, &v) )
+		u->stat = v;
+	if ( field(&p, end, &v) )
+		u->lac = v;
+	if ( field(&p, end, &v) )
+		u->ci = v;
+	if ( field(&p, end, &v) )
+		u->act = v;
+}
+
+static void urc_init_fields(struct dongle_urc *u, unsigned int type,
+				const char *line, size_t len)
+{
+	memset(u, 0, sizeof(*u));
+	u->type = type;
+	u->line = line;
+	u->len = len;
+	u->stat = u->act = -1;
+	u->lac = u->ci = -1;
+	u->rssi = u->ber = -1;
+	u->mode = u->submode = -1;
+}
+
+/* Returns zero if it's not a line we know to be unsolicited */
+int urc_dispatch(struct _dongle *d, const char *line, size_t len)
+{
+	const char *p, *end = line + len;
+	struct dongle_urc u;
+	unsigned int i;
+	long v;
+
+	for(i = 0; i < sizeof(urcs)/sizeof(*urcs); i++) {
+		if ( len >= urcs[i].len &&
+				!memcmp(line, urcs[i].pfx, urcs[i].len) )
+			break;
+	}
+
+	if ( i >= sizeof(urcs)/sizeof(*urcs) )
+		return 0;
+
+	urc_init_fields(&u, urcs[i].type, line, len);
+	p = line + urcs[i].len;
+
+	switch(u.type) {
+	case DONGLE_URC_CREG:
+		parse_creg(&u, p, end, 0);
+		break;
+	case DONGLE_URC_CSQ:
+		if ( field(&p, end, &v) )
+			u.rssi = v;
+		if ( field(&p, end, &v) )
+			u.ber = v;
+		break;
+	case DONGLE_URC_MODE:
+		if ( field(&p, end, &v) )
+			u.mode = v;
+		if ( field(&p, end, &v) )
+			u.submode = v;
+		break;
+	default:
+		break;
+	}
+
+	publish(d, &u);
+	return 1;
+}
+
+/* A report which came in while we were asking looks just like the
+ * answer, except the answer has n in front and so its second field
+ * is never a quoted location
+ */
+static int creg_is_answer(const char *p, const char *end)
+{
+	p = memchr(p, ',', end - p);
+	if ( NULL == p )
+		return 0;
+
+	for(p++; p < end && *p == ' '; p++)
+		/* do nothing */;
+
+	return p < end && *p != '"';
+}
+
+/* The current state, so subscribers needn't wait for it to change */
+static void creg_query_done(void *priv, int result,
+				const char *resp, size_t len)
+{
+	struct _dongle *d = priv;
+	const char *end = resp + len, *nl;
+	struct dongle_urc u;
+
+	if ( result != DONGLE_AT_OK )
+		return;
+
+	for(; resp < end; resp = nl + 1) {
+		nl = memchr(resp, '\n', end - resp);
+		if ( NULL == nl )
+			nl = end;
+		if ( nl - resp < 6 || memcmp(resp, "+CREG:", 6) )
+			continue;
+		urc_init_fields(&u, DONGLE_URC_CREG, resp, nl - resp);
+		parse_creg(&u, resp + 6, nl, creg_is_answer(resp + 6, nl));
+		publish(d, &u);
+	}
+}
+
+static void creg_set_done(void *priv, int result,
+				const char *resp, size_t len)
+{
+	struct _dongle *d = priv;
+
+	if ( result == DONGLE_AT_ERROR || result == DONGLE_AT_TIMEOUT ) {
+		fprintf(stderr, "%s: %s: AT+CREG=%u: failed\n",
+			odw_cmd, d->d_serial, creg_mode);
+	}
+}
+
+/* Queue up AT+CREG=n, then ask where we're at */
+void urc_init(struct _dongle *d)
+{
+	char cmd[32];
+
+	if ( NULL == d->d_at || 0 == creg_mode )
+		return;
+
+	snprintf(cmd, sizeof(cmd), "AT+CREG=%u", creg_mode);
+	atchan_send(d->d_at, cmd, creg_set_done, d);
+	atchan_send(d->d_at, "AT+CREG?", creg_query_done, d);
+}
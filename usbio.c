@@ -0,0 +1,537 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * libusb event handling driven from the nbio eventloop. Every pollfd
+ * of the libusb context is registered as a struct nbio and transfer
+ * completions are dispatched from within nbio_pump().
+ *
+ * Functions:
+ *  o usbio_attach() - Register libusb pollfds with an iothread
+ *  o usbio_pump() - Run the eventloop honouring libusb timeouts
+ *  o usbio_control()/usbio_bulk() - Submit an async transfer
+ *  o usbio_wait() - Pump events until a given transfer completes
+ *  o usbio_run() - Pump events until a flag gets set
+ *  o usbio_drain() - Wait out cancelled transfers before a teardown
+ *  o usbio_defer() - Run a callback after the current completions
+ *  o usbio_flush() - Finish a batch of completions
+*/
+
+#include <libusb-1.0/libusb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+
+#include "compiler.h"
+#include "list.h"
+#include "nbio.h"
+#include "ondawagon.h"
+#include "pktpool.h"
+#include "usbio.h"
+#include "xport.h"
+#include "stats.h"
+#include "trace.h"
+
+struct usbio_fd {
+	struct nbio		f_io;
+	struct usbio		*f_usb;
+	struct list_head	f_list;
+	unsigned int		f_busy;
+	unsigned int		f_dead;
+};
+
+static void run_deferred(struct usbio *u)
+{
+	struct usbio_defer *f;
+
+	while ( !list_empty(&u->u_defer) ) {
+		f = list_entry(u->u_defer.next, struct usbio_defer, list);
+		list_del(&f->list);
+		f->fn(f);
+	}
+}
+
+static void handle_events(struct usbio *u)
+{
+	struct timeval tv;
+
+	memset(&tv, 0, sizeof(tv));
+	libusb_handle_events_timeout(u->u_ctx, &tv);
+	usbio_flush(u);
+}
+
+/* For transports which complete transfers other than from libusb,
+ * called after each batch of them
+ */
+void usbio_flush(struct usbio *u)
+{
+	u->u_stats->s_ctr.usb_events++;
+	run_deferred(u);
+}
+
+static void usbfd_event(struct iothread *t, struct nbio *n)
+{
+	struct usbio_fd *f = (struct usbio_fd *)n;
+
+	/* completion callbacks may close a device handle and hence
+	 * have libusb remove this very pollfd from under us
+	 */
+	f->f_busy = 1;
+	handle_events(f->f_usb);
+	f->f_busy = 0;
+
+	if ( f->f_dead ) {
+		nbio_del(t, n);
+		return;
+	}
+
+	nbio_inactive(t, n, NBIO_READ|NBIO_WRITE|NBIO_ERROR);
+}
+
+static void usbfd_dtor(struct iothread *t, struct nbio *n)
+{
+	struct usbio_fd *f = (struct usbio_fd *)n;
+	/* libusb owns the fd itself */
+	list_del(&f->f_list);
+	free(f);
+}
+
+static const struct nbio_ops usbfd_ops = {
+	.read = usbfd_event,
+	.write = usbfd_event,
+	.dtor = usbfd_dtor,
+};
+
+static void pollfd_added(int fd, short events, void *priv)
+{
+	struct usbio *u = priv;
+	struct usbio_fd *f;
+	nbio_flags_t wait = 0;
+
+	f = calloc(1, sizeof(*f));
+	if ( NULL == f ) {
+		fprintf(stderr, "%s: calloc: %s\n", odw_cmd, os_err());
+		return;
+	}
+
+	if ( events & POLLIN )
+		wait |= NBIO_READ;
+	if ( events & POLLOUT )
+		wait |= NBIO_WRITE;
+
+	f->f_usb = u;
+	f->f_io.fd = fd;
+	f->f_io.ops = &usbfd_ops;
+	list_add_tail(&f->f_list, &u->u_fds);
+	nbio_add(u->u_io, &f->f_io, wait);
+}
+
+static void pollfd_removed(int fd, void *priv)
+{
+	struct usbio *u = priv;
+	struct usbio_fd *f, *tmp;
+
+	list_for_each_entry_safe(f, tmp, &u->u_fds, f_list) {
+		if ( f->f_io.fd != fd || f->f_dead )
+			continue;
+		f->f_dead = 1;
+		if ( !f->f_busy )
+			nbio_del(u->u_io, &f->f_io);
+		break;
+	}
+}
+
+/* name is what the thread's counters are exported as */
+int usbio_init(struct usbio *u, libusb_context *ctx, const char *name)
+{
+	u->u_stats = stats_new(DONGLE_COUNTERS_THREAD, name);
+	if ( NULL == u->u_stats )
+		return 0;
+
+	u->u_ctx = ctx;
+	u->u_io = NULL;
+	INIT_LIST_HEAD(&u->u_fds);
+	INIT_LIST_HEAD(&u->u_defer);
+	pktpool_init(&u->u_pool, NULL, &u->u_stats->s_ctr);
+	return 1;
+}
+
+void usbio_fini(struct usbio *u)
+{
+	usbio_detach(u);
+	pktpool_fini(&u->u_pool);
+	stats_free(u->u_stats);
+	u->u_stats = NULL;
+}
+
+int usbio_attach(struct usbio *u, struct iothread *t)
+{
+	const struct libusb_pollfd **pfd;
+	unsigned int i;
+
+	pfd = libusb_get_pollfds(u->u_ctx);
+	if ( NULL == pfd ) {
+		fprintf(stderr, "%s: libusb_get_pollfds: failed\n", odw_cmd);
+		return 0;
+	}
+
+	u->u_io = t;
+	u->u_pool.pp_io = t;
+	for(i = 0; pfd[i]; i++)
+		pollfd_added(pfd[i]->fd, pfd[i]->events, u);
+
+	libusb_free_pollfds(pfd);
+
+	libusb_set_pollfd_notifiers(u->u_ctx, pollfd_added, pollfd_removed, u);
+	nbio_hist(t, &u->u_stats->s_hist[DONGLE_HIST_LOOP],
+			&u->u_stats->s_hist[DONGLE_HIST_WAIT]);
+	return 1;
+}
+
+void usbio_detach(struct usbio *u)
+{
+	struct usbio_fd *f, *tmp;
+
+	if ( NULL == u->u_io )
+		return;
+
+	libusb_set_pollfd_notifiers(u->u_ctx, NULL, NULL, NULL);
+
+	list_for_each_entry_safe(f, tmp, &u->u_fds, f_list) {
+		list_del(&f->f_list);
+		if ( f->f_dead )
+			continue;
+		f->f_dead = 1;
+		nbio_del(u->u_io, &f->f_io);
+	}
+
+	nbio_hist(u->u_io, NULL, NULL);
+	u->u_io = NULL;
+	u->u_pool.pp_io = NULL;
+}
+
+/* Run one iteration of the eventloop, without sleeping past the next
+ * libusb transfer timeout (which only matters on platforms without
+ * timerfd, where libusb needs to be called to expire transfers). With
+ * no eventloop attached just let libusb poll its own fds.
+ */
+void usbio_pump(struct usbio *u, int mto)
+{
+	struct timeval tv;
+	int uto = -1;
+
+	u->u_stats->s_ctr.loops++;
+
+	if ( NULL == u->u_io ) {
+		tv.tv_sec = (mto < 0) ? 60 : mto / 1000;
+		tv.tv_usec = (mto < 0) ? 0 : (mto % 1000) * 1000;
+		libusb_handle_events_timeout(u->u_ctx, &tv);
+		run_deferred(u);
+		return;
+	}
+
+	if ( libusb_get_next_timeout(u->u_ctx, &tv) == 1 ) {
+		uto = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+		if ( mto < 0 || uto < mto )
+			mto = uto;
+	}
+
+	nbio_pump(u->u_io, mto);
+
+	if ( uto >= 0 )
+		handle_events(u);
+}
+
+void usbio_defer_init(struct usbio_defer *f,
+			void (*fn)(struct usbio_defer *f))
+{
+	INIT_LIST_HEAD(&f->list);
+	f->fn = fn;
+}
+
+/* Queue f to run once the current batch of completions is done,
+ * at most once however many times it is called
+ */
+void usbio_defer(struct usbio *u, struct usbio_defer *f)
+{
+	if ( list_empty(&f->list) )
+		list_add_tail(&f->list, &u->u_defer);
+}
+
+void usbio_defer_cancel(struct usbio_defer *f)
+{
+	list_del(&f->list);
+}
+
+struct usbio_req *usbio_req_new(size_t len)
+{
+	struct usbio_req *r;
+
+	r = calloc(1, sizeof(*r) + LIBUSB_CONTROL_SETUP_SIZE + len);
+	if ( NULL == r )
+		return NULL;
+
+	r->r_xfer = libusb_alloc_transfer(0);
+	if ( NULL == r->r_xfer ) {
+		free(r);
+		return NULL;
+	}
+
+	r->r_buf = (uint8_t *)(r + 1);
+	r->r_buflen = len;
+	return r;
+}
+
+void usbio_req_free(struct usbio_req *r)
+{
+	if ( r ) {
+		libusb_free_transfer(r->r_xfer);
+		free(r);
+	}
+}
+
+uint8_t *usbio_req_data(struct usbio_req *r)
+{
+	return r->r_buf + LIBUSB_CONTROL_SETUP_SIZE;
+}
+
+/* map transfer status on to the error codes of the sync API */
+int usbio_status_err(enum libusb_transfer_status status)
+{
+	switch(status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return LIBUSB_SUCCESS;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_INTERRUPTED;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+/* Control-plane traffic is small and worth seeing in full, but only
+ * bother working out what to record if it's going to be recorded
+ */
+static void req_trace_submit(struct libusb_transfer *x)
+{
+	struct libusb_control_setup *setup;
+	const uint8_t *data = NULL;
+	size_t len = x->length;
+
+	if ( unlikely(trace_on) ) {
+		if ( x->type == LIBUSB_TRANSFER_TYPE_CONTROL ) {
+			setup = libusb_control_transfer_get_setup(x);
+			data = x->buffer;
+			len = LIBUSB_CONTROL_SETUP_SIZE;
+			if ( !(setup->bmRequestType & LIBUSB_ENDPOINT_IN) )
+				len += libusb_le16_to_cpu(setup->wLength);
+		}else if ( !(x->endpoint & LIBUSB_ENDPOINT_IN) ) {
+			data = x->buffer;
+		}
+	}
+
+	trace_xfer_submit(x, x->endpoint, data, len);
+}
+
+static void req_trace_done(struct libusb_transfer *x)
+{
+	const uint8_t *data = NULL;
+
+	if ( unlikely(trace_on) ) {
+		if ( x->type == LIBUSB_TRANSFER_TYPE_CONTROL ) {
+			if ( libusb_control_transfer_get_setup(x)->bmRequestType
+					& LIBUSB_ENDPOINT_IN )
+				data = libusb_control_transfer_get_data(x);
+		}else if ( x->endpoint & LIBUSB_ENDPOINT_IN ) {
+			data = x->buffer;
+		}
+	}
+
+	trace_xfer_done(x, x->endpoint, x->status, data, x->actual_length);
+}
+
+static void req_done(struct libusb_transfer *x)
+{
+	struct usbio_req *r = x->user_data;
+
+	req_trace_done(x);
+
+	r->r_len = x->actual_length;
+	r->r_err = usbio_status_err(x->status);
+	r->r_complete = 1;
+
+	/* may free the request */
+	if ( r->r_done )
+		r->r_done(r);
+}
+
+static int req_submit(struct usbio_req *r, usbio_done_t done, void *priv)
+{
+	int rc;
+
+	r->r_done = done;
+	r->r_priv = priv;
+	r->r_len = 0;
+	r->r_err = 0;
+	r->r_complete = 0;
+
+	req_trace_submit(r->r_xfer);
+	rc = r->r_xport->x_ops->submit(r->r_xport, r->r_xfer);
+	if ( rc ) {
+		r->r_err = rc;
+		r->r_complete = 1;
+	}
+
+	return rc;
+}
+
+int usbio_control(struct usbio_req *r, struct xport *x,
+			uint8_t type, uint8_t req, uint16_t val,
+			uint16_t idx, uint16_t len, unsigned int timeout,
+			usbio_done_t done, void *priv)
+{
+	if ( len > r->r_buflen )
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	libusb_fill_control_setup(r->r_buf, type, req, val, idx, len);
+	libusb_fill_control_transfer(r->r_xfer, x->x_handle, r->r_buf,
+					req_done, r, timeout);
+	r->r_xport = x;
+	return req_submit(r, done, priv);
+}
+
+int usbio_bulk(struct usbio_req *r, struct xport *x,
+			uint8_t ep, size_t len, unsigned int timeout,
+			usbio_done_t done, void *priv)
+{
+	if ( len > r->r_buflen )
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	libusb_fill_bulk_transfer(r->r_xfer, x->x_handle, ep,
+					usbio_req_data(r), len,
+					req_done, r, timeout);
+	r->r_xport = x;
+	return req_submit(r, done, priv);
+}
+
+void usbio_cancel(struct usbio_req *r)
+{
+	if ( !r->r_complete )
+		r->r_xport->x_ops->cancel(r->r_xport, r->r_xfer);
+}
+
+/* Pump events until *done is set by a completion, or by deferred
+ * work, on transfers to x
+ */
+void usbio_run(struct usbio *u, struct xport *x, int *done)
+{
+	while ( !*done ) {
+		if ( u->u_io ) {
+			usbio_pump(u, -1);
+		}else{
+			x->x_ops->events(x, NULL, done);
+			run_deferred(u);
+		}
+	}
+}
+
+/* Handle completions until busy() says nothing is left in flight.
+ * Interrupted or timed out waits are retried. Returns 0 if the
+ * transport fails for good, the transfers may then still complete at
+ * any time so the caller must leak whatever they point at.
+ */
+int usbio_drain(struct xport *x, int (*busy)(void *priv), void *priv)
+{
+	struct timeval tv;
+	int rc;
+
+	while ( (*busy)(priv) ) {
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		rc = x->x_ops->events(x, &tv, NULL);
+		if ( rc == LIBUSB_ERROR_INTERRUPTED ||
+				rc == LIBUSB_ERROR_TIMEOUT )
+			continue;
+		if ( rc ) {
+			fprintf(stderr, "%s: draining transfers: %s\n",
+				odw_cmd, libusb_error_name(rc));
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Returns bytes transferred or a negative libusb error code */
+int usbio_wait(struct usbio *u, struct usbio_req *r)
+{
+	usbio_run(u, r->r_xport, &r->r_complete);
+	return (r->r_err) ? r->r_err : r->r_len;
+}
+
+int usbio_control_sync(struct usbio *u, struct xport *x,
+			uint8_t type, uint8_t req, uint16_t val,
+			uint16_t idx, uint8_t *data, uint16_t len,
+			unsigned int timeout)
+{
+	struct usbio_req *r;
+	int ret;
+
+	r = usbio_req_new(len);
+	if ( NULL == r )
+		return LIBUSB_ERROR_NO_MEM;
+
+	if ( !(type & LIBUSB_ENDPOINT_IN) )
+		memcpy(usbio_req_data(r), data, len);
+
+	ret = usbio_control(r, x, type, req, val, idx, len, timeout,
+				NULL, NULL);
+	if ( !ret )
+		ret = usbio_wait(u, r);
+
+	if ( ret > 0 && (type & LIBUSB_ENDPOINT_IN) )
+		memcpy(data, usbio_req_data(r), ret);
+
+	usbio_req_free(r);
+	return ret;
+}
+
+int usbio_bulk_sync(struct usbio *u, struct xport *x,
+			uint8_t ep, uint8_t *data, int len,
+			int *actual, unsigned int timeout)
+{
+	struct usbio_req *r;
+	int ret;
+
+	*actual = 0;
+
+	r = usbio_req_new(len);
+	if ( NULL == r )
+		return LIBUSB_ERROR_NO_MEM;
+
+	if ( !(ep & LIBUSB_ENDPOINT_IN) )
+		memcpy(usbio_req_data(r), data, len);
+
+	ret = usbio_bulk(r, x, ep, len, timeout, NULL, NULL);
+	if ( !ret ) {
+		usbio_wait(u, r);
+		ret = r->r_err;
+		*actual = r->r_len;
+	}
+
+	if ( *actual > 0 && (ep & LIBUSB_ENDPOINT_IN) )
+		memcpy(data, usbio_req_data(r), *actual);
+
+	usbio_req_free(r);
+	return ret;
+}
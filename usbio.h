@@ -0,0 +1,88 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+*/
+#ifndef _USBIO_H
+#define _USBIO_H
+
+/* Work deferred until libusb has dispatched every pending completion,
+ * lets completion handlers batch up their side effects
+ */
+struct usbio_defer {
+	struct list_head	list;
+	void			(*fn)(struct usbio_defer *f);
+};
+
+/* Binds the pollfds of a libusb context to an nbio iothread */
+struct usbio {
+	libusb_context		*u_ctx;
+	struct iothread		*u_io;
+	struct list_head	u_fds;
+	struct list_head	u_defer;
+	struct pktpool		u_pool;
+	struct stats		*u_stats;
+};
+
+/* An asynchronous transfer, completion is signalled by calling r_done
+ * from within nbio_pump(). The data buffer always has room for a
+ * control setup packet in front of it.
+ */
+struct usbio_req;
+struct xport;
+typedef void (*usbio_done_t)(struct usbio_req *r);
+
+struct usbio_req {
+	struct libusb_transfer	*r_xfer;
+	struct xport		*r_xport;
+	usbio_done_t		r_done;
+	void			*r_priv;
+	uint8_t			*r_buf;
+	size_t			r_buflen;
+	int			r_err;
+	int			r_len;
+	int			r_complete;
+};
+
+_private int usbio_init(struct usbio *u, libusb_context *ctx,
+				const char *name);
+_private void usbio_fini(struct usbio *u);
+_private int usbio_attach(struct usbio *u, struct iothread *t);
+_private void usbio_detach(struct usbio *u);
+_private void usbio_pump(struct usbio *u, int mto);
+_private void usbio_defer_init(struct usbio_defer *f,
+				void (*fn)(struct usbio_defer *f));
+_private void usbio_defer(struct usbio *u, struct usbio_defer *f);
+_private void usbio_defer_cancel(struct usbio_defer *f);
+_private void usbio_flush(struct usbio *u);
+
+_private struct usbio_req *usbio_req_new(size_t len);
+_private void usbio_req_free(struct usbio_req *r);
+_private uint8_t *usbio_req_data(struct usbio_req *r);
+_private int usbio_control(struct usbio_req *r, struct xport *x,
+				uint8_t type, uint8_t req, uint16_t val,
+				uint16_t idx, uint16_t len,
+				unsigned int timeout,
+				usbio_done_t done, void *priv);
+_private int usbio_bulk(struct usbio_req *r, struct xport *x,
+				uint8_t ep, size_t len, unsigned int timeout,
+				usbio_done_t done, void *priv);
+_private void usbio_cancel(struct usbio_req *r);
+_private int usbio_status_err(enum libusb_transfer_status status);
+_private int usbio_wait(struct usbio *u, struct usbio_req *r);
+_private void usbio_run(struct usbio *u, struct xport *x, int *done);
+_private int usbio_drain(struct xport *x, int (*busy)(void *priv),
+				void *priv);
+
+/* Blocking calls with libusb semantics which keep the eventloop
+ * running while they wait. Not to be used from within callbacks.
+ */
+_private int usbio_control_sync(struct usbio *u, struct xport *x,
+				uint8_t type, uint8_t req, uint16_t val,
+				uint16_t idx, uint8_t *data, uint16_t len,
+				unsigned int timeout);
+_private int usbio_bulk_sync(struct usbio *u, struct xport *x,
+				uint8_t ep, uint8_t *data, int len,
+				int *actual, unsigned int timeout);
+
+#endif /* _USBIO_H */
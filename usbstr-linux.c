@@ -0,0 +1,171 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * USB strings out of sysfs, where a device at bus B behind root hub
+ * ports P1, P2... is /sys/bus/usb/devices/B-P1.P2 and the kernel has
+ * left its serial, product and manufacturer strings in files there.
+ * Results are cached by port path, so an unchanged device costs
+ * nothing at all the next time around.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "list.h"
+#include "ondawagon.h"
+#include "usbstr.h"
+
+#define SYSFS_USB_DEVICES	"/sys/bus/usb/devices"
+#define USBSTR_PATH_MAX		32	/* "bbb-" plus 7 ports of "ppp." */
+#define USBSTR_HASH_SIZE	32U
+
+struct usbstr_ent {
+	struct hlist_node	u_hash;
+	char			u_path[USBSTR_PATH_MAX];
+	uint8_t			u_devnum;
+	char			*u_serial;
+	char			*u_product;
+	char			*u_mnfr;
+};
+
+static struct hlist_head cache[USBSTR_HASH_SIZE];
+
+static unsigned int path_hash(const char *path)
+{
+	unsigned int h = 0;
+
+	for(; *path; path++)
+		h = h * 31 + (uint8_t)*path;
+
+	return h % USBSTR_HASH_SIZE;
+}
+
+/* Read a one line attribute, sans newline */
+static char *read_attr(const char *path, const char *attr)
+{
+	char fn[sizeof(SYSFS_USB_DEVICES) + USBSTR_PATH_MAX + 32];
+	char buf[256];
+	size_t len;
+	FILE *f;
+
+	snprintf(fn, sizeof(fn), "%s/%s/%s", SYSFS_USB_DEVICES, path, attr);
+
+	f = fopen(fn, "r");
+	if ( NULL == f )
+		return NULL;
+
+	if ( NULL == fgets(buf, sizeof(buf), f) ) {
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+
+	len = strlen(buf);
+	if ( len && buf[len - 1] == '\n' )
+		buf[--len] = '\0';
+
+	return strdup(buf);
+}
+
+static void ent_clear(struct usbstr_ent *e)
+{
+	free(e->u_serial);
+	free(e->u_product);
+	free(e->u_mnfr);
+	e->u_serial = e->u_product = e->u_mnfr = NULL;
+}
+
+static int ent_fill(struct usbstr_ent *e, uint8_t devnum)
+{
+	char *dev;
+	int ok;
+
+	ent_clear(e);
+
+	/* make sure we're looking at the same device libusb is */
+	dev = read_attr(e->u_path, "devnum");
+	ok = (dev && strtoul(dev, NULL, 10) == devnum);
+	free(dev);
+	if ( !ok )
+		return 0;
+
+	e->u_serial = read_attr(e->u_path, "serial");
+	e->u_product = read_attr(e->u_path, "product");
+	e->u_mnfr = read_attr(e->u_path, "manufacturer");
+	if ( NULL == e->u_serial || NULL == e->u_product ||
+			NULL == e->u_mnfr ) {
+		ent_clear(e);
+		return 0;
+	}
+
+	e->u_devnum = devnum;
+	return 1;
+}
+
+int usbstr_lookup(uint8_t bus, const uint8_t *ports, unsigned int nports,
+			uint8_t devnum, struct usbstr *s)
+{
+	char path[USBSTR_PATH_MAX];
+	struct usbstr_ent *e = NULL;
+	struct hlist_node *n;
+	unsigned int i, h;
+	size_t len;
+
+	/* root hubs have no port path, nor do the strings we want */
+	if ( !nports )
+		return 0;
+
+	len = snprintf(path, sizeof(path), "%u-", bus);
+	for(i = 0; i < nports && len < sizeof(path); i++) {
+		len += snprintf(path + len, sizeof(path) - len,
+				(i) ? ".%u" : "%u", ports[i]);
+	}
+	if ( len >= sizeof(path) )
+		return 0;
+
+	h = path_hash(path);
+	hlist_for_each(n, &cache[h]) {
+		e = hlist_entry(n, struct usbstr_ent, u_hash);
+		if ( !strcmp(e->u_path, path) )
+			break;
+		e = NULL;
+	}
+
+	if ( NULL == e ) {
+		e = calloc(1, sizeof(*e));
+		if ( NULL == e )
+			return 0;
+		strcpy(e->u_path, path);
+		hlist_add_head(&e->u_hash, &cache[h]);
+	}
+
+	if ( NULL == e->u_serial || e->u_devnum != devnum ) {
+		if ( !ent_fill(e, devnum) )
+			return 0;
+	}
+
+	s->serial = e->u_serial;
+	s->product = e->u_product;
+	s->mnfr = e->u_mnfr;
+	return 1;
+}
+
+void usbstr_flush(void)
+{
+	struct usbstr_ent *e;
+	unsigned int i;
+
+	for(i = 0; i < USBSTR_HASH_SIZE; i++) {
+		while ( !hlist_empty(&cache[i]) ) {
+			e = hlist_entry(cache[i].first,
+					struct usbstr_ent, u_hash);
+			hlist_del(&e->u_hash);
+			ent_clear(e);
+			free(e);
+		}
+	}
+}
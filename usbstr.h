@@ -0,0 +1,22 @@
+#ifndef _USBSTR_H
+#define _USBSTR_H
+
+/* The string descriptors of a device as the OS already read them at
+ * enumeration time, which saves opening it and asking again. Devices
+ * are named by bus and port path, devnum is there to notice something
+ * else having been plugged in to the same port since.
+ */
+struct usbstr {
+	const char *serial;
+	const char *product;
+	const char *mnfr;
+};
+
+/* Strings stay valid until the next lookup of the same port, returns
+ * 0 if the OS doesn't know, in which case ask the device
+ */
+int usbstr_lookup(uint8_t bus, const uint8_t *ports, unsigned int nports,
+			uint8_t devnum, struct usbstr *s);
+void usbstr_flush(void);
+
+#endif /* _USBSTR_H */
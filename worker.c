@@ -0,0 +1,518 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Functions:
+ *  o workers_start() - Spawn worker iothreads
+ *  o workers_assign() - Hand a dongle to a worker chosen by policy
+ *  o workers_release() - Drop a dongle which has gone away
+ *  o workers_stop() - Tear down all workers and their dongles
+*/
+
+#define _GNU_SOURCE
+#include <libusb-1.0/libusb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+
+#include "compiler.h"
+#include "list.h"
+#include "nbio.h"
+#include "ondawagon.h"
+#include "tapif.h"
+#include "dongle.h"
+#include "pktpool.h"
+#include "usbio.h"
+#include "worker.h"
+#include "trace.h"
+
+/* A dongle waiting to be picked up, or dropped, by its worker */
+struct assignment {
+	struct list_head	a_list;
+	char			*a_serial;
+	unsigned int		a_bus;
+	unsigned int		a_addr;
+	int			a_release;
+};
+
+struct worker {
+	pthread_t		w_thread;
+	unsigned int		w_idx;
+	libusb_context		*w_ctx;
+	struct iothread		w_io;
+	struct usbio		w_usb;
+	struct nbio		w_wake;
+
+	/* protected by w_lock */
+	pthread_mutex_t		w_lock;
+	struct list_head	w_inbox;
+	int			w_quit;
+
+	/* owned by the worker thread */
+	struct list_head	w_pending;
+	struct list_head	w_handshaking;
+	struct list_head	w_linked;
+	struct list_head	w_dongles;
+	int			w_stop;
+
+	/* load metrics, read racily by the placement policy */
+	unsigned int		w_ndongles;
+	uint64_t		w_rate;
+
+	/* owned by the worker thread, for working out w_rate */
+	struct nbio_timer	w_tick;
+	uint64_t		w_bytes;
+};
+
+/* How often the byte rate is sampled, and how much weight each sample
+ * gets as 1 / (1 << WORKER_RATE_SHIFT)
+ */
+#define WORKER_TICK_MS		1000
+#define WORKER_RATE_SHIFT	2
+
+static struct worker *workers;
+static unsigned int nr_workers;
+static const struct worker_policy *policy;
+
+static void assignment_free(struct assignment *a)
+{
+	list_del(&a->a_list);
+	free(a->a_serial);
+	free(a);
+}
+
+static void wake_read(struct iothread *t, struct nbio *n)
+{
+	struct worker *w = container_of(n, struct worker, w_wake);
+	uint64_t cnt;
+
+	while ( read(n->fd, &cnt, sizeof(cnt)) == sizeof(cnt) )
+		/* do nothing */;
+
+	pthread_mutex_lock(&w->w_lock);
+	list_splice(&w->w_inbox, w->w_pending.prev);
+	w->w_stop = w->w_quit;
+	pthread_mutex_unlock(&w->w_lock);
+
+	nbio_inactive(t, n, NBIO_READ|NBIO_ERROR);
+}
+
+static void wake_dtor(struct iothread *t, struct nbio *n)
+{
+	close(n->fd);
+}
+
+static const struct nbio_ops wake_ops = {
+	.read = wake_read,
+	.write = wake_read,
+	.dtor = wake_dtor,
+};
+
+static void worker_kick(struct worker *w)
+{
+	uint64_t one = 1;
+
+	if ( write(w->w_wake.fd, &one, sizeof(one)) != sizeof(one) )
+		fprintf(stderr, "%s: worker %u: wake: %s\n",
+			odw_cmd, w->w_idx, os_err());
+}
+
+static void release_from(struct worker *w, struct list_head *list,
+				const char *serial)
+{
+	struct _dongle *d, *tmp;
+
+	list_for_each_entry_safe(d, tmp, list, d_list) {
+		if ( strcmp(d->d_serial, serial) )
+			continue;
+		printf("%s: worker %u: dropping %s\n",
+			odw_cmd, w->w_idx, serial);
+		dongle_close(d);
+		__atomic_sub_fetch(&w->w_ndongles, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void worker_release(struct worker *w, const char *serial)
+{
+	release_from(w, &w->w_handshaking, serial);
+	release_from(w, &w->w_linked, serial);
+	release_from(w, &w->w_dongles, serial);
+}
+
+/* Called from within the eventloop, leave the rest to worker_bringup() */
+static void worker_linked(struct _dongle *d, int ok, void *priv)
+{
+	struct worker *w = priv;
+
+	list_move_tail(&d->d_list, &w->w_linked);
+}
+
+static void worker_ifup(struct worker *w)
+{
+	struct _dongle *d, *tmp;
+
+	list_for_each_entry_safe(d, tmp, &w->w_linked, d_list) {
+		if ( !dongle_ifup(d, &w->w_io) ) {
+			fprintf(stderr, "%s: worker %u: %s: failed to "
+				"come up\n", odw_cmd, w->w_idx, d->d_serial);
+			dongle_close(d);
+			__atomic_sub_fetch(&w->w_ndongles, 1,
+						__ATOMIC_RELAXED);
+			continue;
+		}
+
+		printf("%s: worker %u: serving %s\n",
+			odw_cmd, w->w_idx, d->d_serial);
+		list_move_tail(&d->d_list, &w->w_dongles);
+	}
+}
+
+/* Runs outside of nbio_pump(), opening dongles and closing them again
+ * isn't something to do from inside a completion. All the handshakes
+ * of a batch of new dongles run concurrently.
+ */
+static void worker_bringup(struct worker *w)
+{
+	struct assignment *a, *tmp;
+	struct _dongle *d;
+
+	list_for_each_entry_safe(a, tmp, &w->w_pending, a_list) {
+		if ( a->a_release ) {
+			worker_release(w, a->a_serial);
+			assignment_free(a);
+			continue;
+		}
+
+		d = dongle__open_at(&w->w_usb, a->a_bus, a->a_addr);
+		if ( NULL == d || strcmp(d->d_serial, a->a_serial) ) {
+			fprintf(stderr, "%s: worker %u: %s: not found\n",
+				odw_cmd, w->w_idx, a->a_serial);
+			goto fail;
+		}
+
+		if ( !dongle__init_start(d, worker_linked, w) ) {
+			fprintf(stderr, "%s: worker %u: %s: failed to "
+				"come up\n", odw_cmd, w->w_idx, a->a_serial);
+			goto fail;
+		}
+
+		list_add_tail(&d->d_list, &w->w_handshaking);
+		goto next;
+fail:
+		if ( d )
+			dongle_close(d);
+		__atomic_sub_fetch(&w->w_ndongles, 1, __ATOMIC_RELAXED);
+next:
+		assignment_free(a);
+	}
+
+	worker_ifup(w);
+}
+
+/* Placement goes by recent traffic, so keep a moving average of bytes
+ * per second rather than the lifetime total. Totals drop when a dongle
+ * goes away, that sample just counts as idle.
+ */
+static void worker_account(struct iothread *t, struct nbio_timer *tm)
+{
+	struct worker *w = container_of(tm, struct worker, w_tick);
+	struct _dongle *d;
+	uint64_t bytes = 0, delta, rate;
+
+	list_for_each_entry(d, &w->w_dongles, d_list)
+		bytes += dongle_bytes(d);
+
+	delta = (bytes > w->w_bytes) ? bytes - w->w_bytes : 0;
+	delta = delta * 1000 / WORKER_TICK_MS;
+	w->w_bytes = bytes;
+
+	rate = w->w_rate;
+	rate = rate - (rate >> WORKER_RATE_SHIFT) +
+		(delta >> WORKER_RATE_SHIFT);
+	__atomic_store_n(&w->w_rate, rate, __ATOMIC_RELAXED);
+
+	nbio_timer_add(t, tm, WORKER_TICK_MS);
+}
+
+static void *worker_main(void *priv)
+{
+	struct worker *w = priv;
+	struct _dongle *d, *tmp;
+	char name[32];
+
+	snprintf(name, sizeof(name), "worker %u", w->w_idx);
+	trace_thread(name);
+
+	while ( !w->w_stop ) {
+		usbio_pump(&w->w_usb, -1);
+		worker_bringup(w);
+	}
+
+	list_for_each_entry(d, &w->w_dongles, d_list)
+		dongle_ifdown(d);
+
+	nbio_timer_del(&w->w_io, &w->w_tick);
+	usbio_detach(&w->w_usb);
+	nbio_fini(&w->w_io);
+
+	list_splice(&w->w_handshaking, &w->w_dongles);
+	list_splice(&w->w_linked, &w->w_dongles);
+	list_for_each_entry_safe(d, tmp, &w->w_dongles, d_list)
+		dongle_close(d);
+
+	return NULL;
+}
+
+static void worker_fini(struct worker *w)
+{
+	struct assignment *a, *tmp;
+
+	list_splice(&w->w_inbox, &w->w_pending);
+	list_for_each_entry_safe(a, tmp, &w->w_pending, a_list)
+		assignment_free(a);
+
+	pthread_mutex_destroy(&w->w_lock);
+	usbio_fini(&w->w_usb);
+	libusb_exit(w->w_ctx);
+}
+
+static void pin_cpu(struct worker *w)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+
+	if ( ncpu <= 0 )
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->w_idx % ncpu, &set);
+	pthread_setaffinity_np(w->w_thread, sizeof(set), &set);
+}
+
+static int worker_init(struct worker *w, unsigned int idx)
+{
+	char name[32];
+
+	w->w_idx = idx;
+	INIT_LIST_HEAD(&w->w_inbox);
+	INIT_LIST_HEAD(&w->w_pending);
+	INIT_LIST_HEAD(&w->w_handshaking);
+	INIT_LIST_HEAD(&w->w_linked);
+	INIT_LIST_HEAD(&w->w_dongles);
+	nbio_timer_init(&w->w_tick, worker_account);
+	pthread_mutex_init(&w->w_lock, NULL);
+
+	if ( libusb_init(&w->w_ctx) ) {
+		fprintf(stderr, "%s: worker %u: libusb_init: failed\n",
+			odw_cmd, idx);
+		goto err;
+	}
+
+	snprintf(name, sizeof(name), "worker %u", idx);
+	if ( !usbio_init(&w->w_usb, w->w_ctx, name) )
+		goto err_ctx;
+
+	if ( !nbio_init(&w->w_io, odw_eventloop) )
+		goto err_usb;
+	nbio_busy_poll(&w->w_io, odw_busy_poll);
+	nbio_budget(&w->w_io, odw_weight, odw_budget);
+
+	if ( !usbio_attach(&w->w_usb, &w->w_io) )
+		goto err_nbio;
+
+	w->w_wake.fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if ( w->w_wake.fd < 0 ) {
+		fprintf(stderr, "%s: eventfd: %s\n", odw_cmd, os_err());
+		goto err_detach;
+	}
+
+	w->w_wake.ops = &wake_ops;
+	nbio_add(&w->w_io, &w->w_wake, NBIO_READ);
+	nbio_timer_add(&w->w_io, &w->w_tick, WORKER_TICK_MS);
+
+	if ( pthread_create(&w->w_thread, NULL, worker_main, w) ) {
+		fprintf(stderr, "%s: pthread_create: %s\n",
+			odw_cmd, os_err());
+		goto err_detach;
+	}
+
+	pin_cpu(w);
+	return 1;
+
+err_detach:
+	nbio_timer_del(&w->w_io, &w->w_tick);
+	usbio_detach(&w->w_usb);
+err_nbio:
+	nbio_fini(&w->w_io);
+err_usb:
+	usbio_fini(&w->w_usb);
+err_ctx:
+	libusb_exit(w->w_ctx);
+err:
+	pthread_mutex_destroy(&w->w_lock);
+	return 0;
+}
+
+static struct worker *pick_rr(struct worker *w, unsigned int nr)
+{
+	static unsigned int next;
+	return &w[next++ % nr];
+}
+
+static struct worker *pick_least_loaded(struct worker *w, unsigned int nr)
+{
+	struct worker *best = w;
+	uint64_t rate, best_rate;
+	unsigned int i;
+
+	best_rate = __atomic_load_n(&w[0].w_rate, __ATOMIC_RELAXED);
+	for(i = 1; i < nr; i++) {
+		rate = __atomic_load_n(&w[i].w_rate, __ATOMIC_RELAXED);
+		if ( rate > best_rate )
+			continue;
+		if ( rate == best_rate &&
+				w[i].w_ndongles >= best->w_ndongles )
+			continue;
+		best = &w[i];
+		best_rate = rate;
+	}
+
+	return best;
+}
+
+static const struct worker_policy policies[] = {
+	{ .name = "round-robin", .pick = pick_rr },
+	{ .name = "least-loaded", .pick = pick_least_loaded },
+};
+
+static const struct worker_policy *policy_find(const char *name)
+{
+	unsigned int i;
+
+	for(i = 0; i < sizeof(policies)/sizeof(*policies); i++)
+		if ( !strcmp(policies[i].name, name) )
+			return &policies[i];
+
+	return NULL;
+}
+
+int workers_start(unsigned int nr, const char *name)
+{
+	policy = policy_find((name) ? name : "least-loaded");
+	if ( NULL == policy ) {
+		fprintf(stderr, "%s: unknown worker policy: %s\n",
+			odw_cmd, name);
+		return 0;
+	}
+
+	workers = calloc(nr, sizeof(*workers));
+	if ( NULL == workers ) {
+		fprintf(stderr, "%s: calloc: %s\n", odw_cmd, os_err());
+		return 0;
+	}
+
+	for(nr_workers = 0; nr_workers < nr; nr_workers++) {
+		if ( !worker_init(&workers[nr_workers], nr_workers) )
+			break;
+	}
+
+	if ( nr_workers < nr ) {
+		workers_stop();
+		return 0;
+	}
+
+	printf("%s: %u worker(s), %s placement\n",
+		odw_cmd, nr_workers, policy->name);
+	return 1;
+}
+
+static struct assignment *assignment_new(const char *serial)
+{
+	struct assignment *a;
+
+	a = calloc(1, sizeof(*a));
+	if ( NULL == a )
+		return NULL;
+
+	a->a_serial = strdup(serial);
+	if ( NULL == a->a_serial ) {
+		free(a);
+		return NULL;
+	}
+
+	return a;
+}
+
+static void assignment_post(struct worker *w, struct assignment *a)
+{
+	pthread_mutex_lock(&w->w_lock);
+	list_add_tail(&a->a_list, &w->w_inbox);
+	pthread_mutex_unlock(&w->w_lock);
+
+	worker_kick(w);
+}
+
+int workers_assign(const char *serial, unsigned int bus, unsigned int addr)
+{
+	struct assignment *a;
+	struct worker *w;
+
+	if ( 0 == nr_workers )
+		return 0;
+
+	a = assignment_new(serial);
+	if ( NULL == a )
+		return 0;
+
+	a->a_bus = bus;
+	a->a_addr = addr;
+
+	w = policy->pick(workers, nr_workers);
+	__atomic_add_fetch(&w->w_ndongles, 1, __ATOMIC_RELAXED);
+
+	assignment_post(w, a);
+	return 1;
+}
+
+/* We don't keep track of who has what, whoever has it will drop it */
+void workers_release(const char *serial)
+{
+	struct assignment *a;
+	unsigned int i;
+
+	for(i = 0; i < nr_workers; i++) {
+		a = assignment_new(serial);
+		if ( NULL == a )
+			return;
+
+		a->a_release = 1;
+		assignment_post(&workers[i], a);
+	}
+}
+
+void workers_stop(void)
+{
+	unsigned int i;
+
+	for(i = 0; i < nr_workers; i++) {
+		pthread_mutex_lock(&workers[i].w_lock);
+		workers[i].w_quit = 1;
+		pthread_mutex_unlock(&workers[i].w_lock);
+		worker_kick(&workers[i]);
+	}
+
+	for(i = 0; i < nr_workers; i++) {
+		pthread_join(workers[i].w_thread, NULL);
+		worker_fini(&workers[i]);
+	}
+
+	free(workers);
+	workers = NULL;
+	nr_workers = 0;
+}
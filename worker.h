@@ -0,0 +1,26 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+*/
+#ifndef _WORKER_H
+#define _WORKER_H
+
+/* A pool of iothreads each with its own libusb context. Dongles are
+ * handed to a worker by a placement policy and from then on all of
+ * their USB and TAP I/O happens on that one thread.
+ */
+struct worker;
+
+struct worker_policy {
+	const char *name;
+	struct worker *(*pick)(struct worker *w, unsigned int nr);
+};
+
+_private int workers_start(unsigned int nr, const char *policy);
+_private int workers_assign(const char *serial, unsigned int bus,
+				unsigned int addr);
+_private void workers_release(const char *serial);
+_private void workers_stop(void);
+
+#endif /* _WORKER_H */
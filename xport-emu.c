@@ -0,0 +1,1202 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * A software dongle for testing and benchmarking without hardware.
+ * It answers the control channel handshake, replies OK to every AT
+ * command, with registration reports if they're asked for, and acts
+ * as a packet sink on the data OUT endpoint and a source of UDP
+ * frames on the data IN endpoint, at a configurable rate, size,
+ * latency and loss. With zerocd they start out in ZeroCD
+ * mode and take the eject command and a reset to switch, after which
+ * they're gone for a while before coming back as modems.
+ *
+ * Nothing ever completes from within submit, just like the real
+ * thing. Transfers are queued with the time they're due and an nbio
+ * timer on the usbio's iothread fires them, or an eventfd if they're
+ * due already, so that a zero latency modem isn't held to the timer
+ * wheel's millisecond ticks. With no eventloop attached the events
+ * hook sleeps until they are due.
+ *
+ * Functions:
+ *  o xport_emu_conf() - Parse --emulate n[,rate=pps][,size=bytes]...
+ *  o xport_emu_count() - How many emulated dongles to enumerate
+ *  o xport_emu_open() - Open emulated dongle number idx
+ *  o xport_emu_present() - Is it there, and what does it look like
+ *  o xport_emu_rate()/xport_emu_size() - Change the source on the fly
+ *  o xport_emu_sink() - Look at every frame sent through the modem
+*/
+
+#include <libusb-1.0/libusb.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+
+#include "compiler.h"
+#include "list.h"
+#include "nbio.h"
+#include "ondawagon.h"
+#include "pktpool.h"
+#include "usbio.h"
+#include "xport.h"
+
+/* endpoints, the AT channel is where dongle.c expects it */
+#define EMU_EP_ZEROCD		(LIBUSB_ENDPOINT_OUT | 1)
+#define EMU_EP_AT_OUT		(LIBUSB_ENDPOINT_OUT | 2)
+#define EMU_EP_AT_IN		(LIBUSB_ENDPOINT_IN | 2)
+#define EMU_EP_DATA_OUT		(LIBUSB_ENDPOINT_OUT | 3)
+#define EMU_EP_DATA_IN		(LIBUSB_ENDPOINT_IN | 4)
+#define EMU_EP_NOTIFY		(LIBUSB_ENDPOINT_IN | 6)
+#define EMU_MPS			512
+
+#define EMU_NR_IFACE		5
+#define EMU_QLEN		256
+#define EMU_AT_LINES		8
+#define EMU_AT_LINE_MAX		128
+#define EMU_QMI_MAX		256
+
+/* how long a stick takes to re-enumerate after being mode-switched */
+#define EMU_REENUM		500000
+
+/* how far the source may fall behind before it stops catching up */
+#define EMU_BACKLOG		100000
+
+#define EMU_STAMP_OFF	(ETH_HLEN + sizeof(struct iphdr) + \
+				sizeof(struct udphdr))
+#define EMU_FRAME_MIN	(EMU_STAMP_OFF + sizeof(struct xport_emu_stamp))
+#define EMU_FRAME_MAX	ETH_FRAME_LEN
+
+static struct emu_conf {
+	unsigned int nr;
+	unsigned int rate;	/* frames/sec from the modem, 0 for none */
+	unsigned int size;	/* ethernet frame length */
+	unsigned int latency;	/* usecs, applied to every completion */
+	unsigned int loss;	/* parts per million, in both directions */
+	unsigned int zerocd;	/* start out in ZeroCD mode */
+}emu_conf = {
+	.size = 1024,
+};
+
+/* The mode a stick is in outlives any one handle on it */
+static struct emu_stick {
+	uint64_t	back;	/* re-enumerated at this time */
+	uint8_t		ready;
+	uint8_t		ejected;
+}emu_sticks[256];
+
+static xport_emu_sink_t emu_sink_fn;
+static void *emu_sink_priv;
+static LIST_HEAD(emu_list);
+
+struct emu_ent {
+	struct libusb_transfer	*x;
+	uint64_t		due;
+};
+
+/* FIFO of transfers, cancelled entries are left as NULL tombstones */
+struct emu_q {
+	unsigned int		head;
+	unsigned int		tail;
+	struct emu_ent		ent[EMU_QLEN];
+};
+
+struct emu;
+struct emu_kick {
+	struct nbio		k_io;
+	struct emu		*k_emu;
+};
+
+struct emu {
+	struct xport		e_xport;
+	struct list_head	e_list;
+	unsigned int		e_idx;
+	unsigned int		e_cfg;
+	unsigned int		e_claimed;
+
+	struct nbio_timer	e_timer;
+	struct iothread		*e_io;
+	struct emu_kick		*e_kick;
+	unsigned int		e_kicked;
+
+	struct emu_q		e_done;	/* completed, waiting out latency */
+	struct emu_q		e_src;	/* data IN waiting for frames */
+	struct emu_q		e_at;	/* AT IN waiting for a response */
+	struct emu_q		e_intr;	/* waiting for a notification */
+
+	uint64_t		e_next_frame;
+	uint32_t		e_rand;
+	uint32_t		e_seq;
+
+	unsigned int		e_notify;
+	size_t			e_qmi_len;
+	uint8_t			e_qmi[EMU_QMI_MAX];
+
+	unsigned int		e_creg;
+	unsigned int		e_at_head;
+	unsigned int		e_at_tail;
+	uint8_t			e_at_len[EMU_AT_LINES];
+	char			e_at_line[EMU_AT_LINES][EMU_AT_LINE_MAX];
+
+	uint64_t		e_tx_pkts;
+	uint64_t		e_tx_lost;
+	uint64_t		e_rx_pkts;
+	uint64_t		e_rx_lost;
+
+	unsigned int		e_size;
+	uint8_t			e_frame[EMU_FRAME_MAX];
+};
+
+static const struct libusb_endpoint_descriptor emu_data_ep[] = {
+	{
+		.bLength = LIBUSB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = LIBUSB_DT_ENDPOINT,
+		.bEndpointAddress = EMU_EP_DATA_IN,
+		.bmAttributes = LIBUSB_TRANSFER_TYPE_BULK,
+		.wMaxPacketSize = EMU_MPS,
+	},
+	{
+		.bLength = LIBUSB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = LIBUSB_DT_ENDPOINT,
+		.bEndpointAddress = EMU_EP_DATA_OUT,
+		.bmAttributes = LIBUSB_TRANSFER_TYPE_BULK,
+		.wMaxPacketSize = EMU_MPS,
+	},
+};
+
+#define EMU_INTF(n, nep, ep) { \
+		.bLength = LIBUSB_DT_INTERFACE_SIZE, \
+		.bDescriptorType = LIBUSB_DT_INTERFACE, \
+		.bInterfaceNumber = n, \
+		.bNumEndpoints = nep, \
+		.bInterfaceClass = LIBUSB_CLASS_VENDOR_SPEC, \
+		.endpoint = ep, \
+	}
+static const struct libusb_interface_descriptor emu_intf[EMU_NR_IFACE] = {
+	EMU_INTF(0, 0, NULL),
+	EMU_INTF(1, 0, NULL),
+	EMU_INTF(2, 0, NULL),
+	EMU_INTF(3, 0, NULL),
+	EMU_INTF(4, 2, emu_data_ep),
+};
+
+static const struct libusb_interface emu_iface[EMU_NR_IFACE] = {
+	{.altsetting = &emu_intf[0], .num_altsetting = 1},
+	{.altsetting = &emu_intf[1], .num_altsetting = 1},
+	{.altsetting = &emu_intf[2], .num_altsetting = 1},
+	{.altsetting = &emu_intf[3], .num_altsetting = 1},
+	{.altsetting = &emu_intf[4], .num_altsetting = 1},
+};
+
+static struct libusb_config_descriptor emu_config = {
+	.bLength = LIBUSB_DT_CONFIG_SIZE,
+	.bDescriptorType = LIBUSB_DT_CONFIG,
+	.bNumInterfaces = EMU_NR_IFACE,
+	.bConfigurationValue = 1,
+	.interface = emu_iface,
+};
+
+#define EMU_STR_MNFR	1
+#define EMU_STR_PRODUCT	2
+#define EMU_STR_SERIAL	3
+
+static const struct libusb_device_descriptor emu_desc = {
+	.bLength = LIBUSB_DT_DEVICE_SIZE,
+	.bDescriptorType = LIBUSB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = 64,
+	.idVendor = 0x19d2,
+	.idProduct = 0x1008,
+	.iManufacturer = EMU_STR_MNFR,
+	.iProduct = EMU_STR_PRODUCT,
+	.iSerialNumber = EMU_STR_SERIAL,
+	.bNumConfigurations = 1,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t now_us(void)
+{
+	return now_ns() / 1000;
+}
+
+/* Off the bus while it re-enumerates, a modem once it's back */
+static int stick_present(unsigned int idx)
+{
+	struct emu_stick *s = &emu_sticks[idx];
+
+	if ( s->back ) {
+		if ( now_us() < s->back )
+			return 0;
+		s->back = 0;
+		s->ready = 1;
+	}
+
+	return 1;
+}
+
+/* xorshift, it only has to decide which packets to drop */
+static int emu_lose(struct emu *e)
+{
+	uint32_t r = e->e_rand;
+
+	if ( !emu_conf.loss )
+		return 0;
+
+	r ^= r << 13;
+	r ^= r >> 17;
+	r ^= r << 5;
+	e->e_rand = r;
+	return (r % 1000000U) < emu_conf.loss;
+}
+
+static int q_empty(struct emu_q *q)
+{
+	return q->head == q->tail;
+}
+
+static int q_push(struct emu_q *q, struct libusb_transfer *x, uint64_t due)
+{
+	struct emu_ent *ent;
+
+	if ( q->tail - q->head >= EMU_QLEN )
+		return 0;
+
+	ent = &q->ent[q->tail++ % EMU_QLEN];
+	ent->x = x;
+	ent->due = due;
+	return 1;
+}
+
+static struct emu_ent *q_head(struct emu_q *q)
+{
+	while ( !q_empty(q) ) {
+		struct emu_ent *ent = &q->ent[q->head % EMU_QLEN];
+		if ( ent->x )
+			return ent;
+		q->head++;
+	}
+	return NULL;
+}
+
+static struct libusb_transfer *q_pop(struct emu_q *q)
+{
+	struct emu_ent *ent;
+
+	ent = q_head(q);
+	if ( NULL == ent )
+		return NULL;
+
+	q->head++;
+	return ent->x;
+}
+
+static int q_remove(struct emu_q *q, struct libusb_transfer *x)
+{
+	unsigned int i;
+
+	for(i = q->head; i != q->tail; i++) {
+		if ( q->ent[i % EMU_QLEN].x == x ) {
+			q->ent[i % EMU_QLEN].x = NULL;
+			q_head(q);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* earliest transfer deadline in a queue, 0 for none */
+static uint64_t q_deadline(struct emu_q *q)
+{
+	uint64_t ret = 0;
+	unsigned int i;
+
+	for(i = q->head; i != q->tail; i++) {
+		struct emu_ent *ent = &q->ent[i % EMU_QLEN];
+		if ( ent->x && ent->due && (!ret || ent->due < ret) )
+			ret = ent->due;
+	}
+	return ret;
+}
+
+static uint64_t deadline(struct libusb_transfer *x, uint64_t now)
+{
+	return (x->timeout) ? now + x->timeout * 1000ULL : 0;
+}
+
+static int complete(struct emu *e, struct libusb_transfer *x,
+			enum libusb_transfer_status status, int len)
+{
+	x->status = status;
+	x->actual_length = len;
+	return q_push(&e->e_done, x, now_us() + emu_conf.latency);
+}
+
+static void expire(struct emu *e, struct emu_q *q, uint64_t now)
+{
+	unsigned int i;
+
+	for(i = q->head; i != q->tail; i++) {
+		struct emu_ent *ent = &q->ent[i % EMU_QLEN];
+		struct libusb_transfer *x = ent->x;
+
+		if ( NULL == x || !ent->due || ent->due > now )
+			continue;
+
+		ent->x = NULL;
+		x->status = LIBUSB_TRANSFER_TIMED_OUT;
+		x->actual_length = 0;
+		x->callback(x);
+	}
+	q_head(q);
+}
+
+static void feed_notify(struct emu *e)
+{
+	static const uint8_t avail[8] = {0xa1, 0x01, 0, 0, 4, 0, 0, 0};
+	struct libusb_transfer *x;
+	int len;
+
+	if ( !e->e_notify )
+		return;
+
+	x = q_pop(&e->e_intr);
+	if ( NULL == x )
+		return;
+
+	len = (x->length < 8) ? x->length : 8;
+	memcpy(x->buffer, avail, len);
+	complete(e, x, LIBUSB_TRANSFER_COMPLETED, len);
+	e->e_notify = 0;
+}
+
+static void feed_at(struct emu *e)
+{
+	struct libusb_transfer *x;
+	unsigned int i;
+	int len;
+
+	while ( e->e_at_head != e->e_at_tail ) {
+		x = q_pop(&e->e_at);
+		if ( NULL == x )
+			return;
+
+		i = e->e_at_head++ % EMU_AT_LINES;
+		len = e->e_at_len[i];
+		if ( len > x->length )
+			len = x->length;
+		memcpy(x->buffer, e->e_at_line[i], len);
+		complete(e, x, LIBUSB_TRANSFER_COMPLETED, len);
+	}
+}
+
+static void at_line(struct emu *e, const void *buf, size_t len)
+{
+	unsigned int i;
+
+	if ( e->e_at_tail - e->e_at_head >= EMU_AT_LINES )
+		return;
+
+	if ( len > EMU_AT_LINE_MAX )
+		len = EMU_AT_LINE_MAX;
+
+	i = e->e_at_tail++ % EMU_AT_LINES;
+	memcpy(e->e_at_line[i], buf, len);
+	e->e_at_len[i] = len;
+}
+
+static int at_is(const uint8_t *buf, size_t len, const char *cmd)
+{
+	size_t clen = strlen(cmd);
+
+	return len >= clen && !memcmp(buf, cmd, clen);
+}
+
+static void at_creg(struct emu *e, char *str, size_t len, const char *pfx)
+{
+	if ( e->e_creg > 1 ) {
+		snprintf(str, len, "\r\n+CREG: %s1,\"00C3\",\"%04X\"\r\n",
+			pfx, 0xa13b + e->e_idx);
+	}else{
+		snprintf(str, len, "\r\n+CREG: %s1\r\n", pfx);
+	}
+}
+
+/* The modem echoes the command line, answers the few queries we know
+ * about, then says OK whatever it was. Turning on registration reports
+ * has the emulated network register us straight away.
+ */
+static void at_command(struct emu *e, const uint8_t *buf, size_t len)
+{
+	static const char ok[] = "\r\nOK\r\n";
+	char rsp[EMU_AT_LINE_MAX], pfx[4];
+	int urc = 0;
+
+	rsp[0] = '\0';
+	if ( at_is(buf, len, "AT+CSQ\r") ) {
+		snprintf(rsp, sizeof(rsp), "\r\n+CSQ: %u,99\r\n",
+			17 + e->e_idx % 10);
+	}else if ( at_is(buf, len, "AT+CREG?") ) {
+		snprintf(pfx, sizeof(pfx), "%u,", e->e_creg);
+		at_creg(e, rsp, sizeof(rsp), pfx);
+	}else if ( at_is(buf, len, "AT+CREG=") && len > 8 ) {
+		e->e_creg = (buf[8] >= '0' && buf[8] <= '2') ?
+				buf[8] - '0' : 0;
+		urc = !!e->e_creg;
+	}
+
+	at_line(e, buf, len);
+	if ( rsp[0] )
+		at_line(e, rsp, strlen(rsp));
+	at_line(e, ok, sizeof(ok) - 1);
+
+	if ( urc ) {
+		at_creg(e, rsp, sizeof(rsp), "");
+		at_line(e, rsp, strlen(rsp));
+		snprintf(rsp, sizeof(rsp), "\r\n^MODE: 5,4\r\n");
+		at_line(e, rsp, strlen(rsp));
+	}
+
+	feed_at(e);
+}
+
+static int string_desc(struct emu *e, unsigned int idx,
+			uint8_t *buf, unsigned int len)
+{
+	char str[32];
+	uint8_t out[2 + 2 * sizeof(str)];
+	unsigned int i, n;
+
+	switch(idx) {
+	case 0:
+		/* supported languages: just US english */
+		out[2] = 0x09;
+		out[3] = 0x04;
+		n = 4;
+		goto done;
+	case EMU_STR_MNFR:
+		snprintf(str, sizeof(str), "ondawagon");
+		break;
+	case EMU_STR_PRODUCT:
+		snprintf(str, sizeof(str), "Emulated 3G Modem");
+		break;
+	case EMU_STR_SERIAL:
+		snprintf(str, sizeof(str), "EMU%07u", e->e_idx);
+		break;
+	default:
+		return -1;
+	}
+
+	for(n = 2, i = 0; str[i]; i++) {
+		out[n++] = str[i];
+		out[n++] = 0;
+	}
+done:
+	out[0] = n;
+	out[1] = LIBUSB_DT_STRING;
+	if ( n > len )
+		n = len;
+	memcpy(buf, out, n);
+	return n;
+}
+
+/* Returns zero if the completion couldn't be queued */
+static int control(struct emu *e, struct libusb_transfer *x)
+{
+	struct libusb_control_setup *s = (void *)x->buffer;
+	uint8_t *data = x->buffer + LIBUSB_CONTROL_SETUP_SIZE;
+	unsigned int val = le16toh(s->wValue);
+	unsigned int len = le16toh(s->wLength);
+	int ret = -1;
+
+	switch((s->bmRequestType << 8) | s->bRequest) {
+	case (LIBUSB_ENDPOINT_IN << 8) | LIBUSB_REQUEST_GET_DESCRIPTOR:
+		if ( (val >> 8) == LIBUSB_DT_STRING )
+			ret = string_desc(e, val & 0xff, data, len);
+		break;
+	case 0x2100:
+		/* encapsulated command on the QMI control channel, the
+		 * response is announced on the notification endpoint
+		 */
+		if ( len > EMU_QMI_MAX )
+			len = EMU_QMI_MAX;
+		memcpy(e->e_qmi, data, len);
+		e->e_qmi_len = len;
+		e->e_notify = 1;
+		feed_notify(e);
+		ret = len;
+		break;
+	case 0xa101:
+		/* canned response: the request, flagged as one */
+		ret = (e->e_qmi_len < len) ? e->e_qmi_len : len;
+		memcpy(data, e->e_qmi, ret);
+		if ( ret > 3 )
+			data[3] = 0x80;
+		e->e_qmi_len = 0;
+		break;
+	case 0xa1fe:
+		if ( len ) {
+			data[0] = 0;
+			ret = 1;
+		}else{
+			ret = 0;
+		}
+		break;
+	default:
+		if ( (s->bmRequestType & LIBUSB_REQUEST_TYPE_CLASS) &&
+				!(s->bmRequestType & LIBUSB_ENDPOINT_IN) )
+			ret = len;
+		break;
+	}
+
+	if ( ret < 0 )
+		return complete(e, x, LIBUSB_TRANSFER_STALL, 0);
+
+	return complete(e, x, LIBUSB_TRANSFER_COMPLETED, ret);
+}
+
+static void frame_init(struct emu *e)
+{
+	struct ethhdr *eth = (struct ethhdr *)e->e_frame;
+	struct iphdr *iph = (struct iphdr *)(eth + 1);
+	struct udphdr *udp = (struct udphdr *)(iph + 1);
+	uint16_t *w = (uint16_t *)iph;
+	unsigned int len = emu_conf.size;
+	uint32_t sum = 0;
+	unsigned int i;
+
+	memset(e->e_frame, 0, sizeof(e->e_frame));
+	e->e_size = len;
+
+	memset(eth->h_dest, 0xff, ETH_ALEN);
+	eth->h_source[0] = 0x02;
+	eth->h_source[5] = e->e_idx;
+	eth->h_proto = htobe16(ETH_P_IP);
+
+	iph->version = 4;
+	iph->ihl = sizeof(*iph) / 4;
+	iph->tot_len = htobe16(len - ETH_HLEN);
+	iph->ttl = 64;
+	iph->protocol = IPPROTO_UDP;
+	iph->saddr = htobe32(0x0a400001 | (e->e_idx << 8));
+	iph->daddr = htobe32(0x0a400002 | (e->e_idx << 8));
+
+	for(i = 0; i < sizeof(*iph) / 2; i++)
+		sum += w[i];
+	while ( sum >> 16 )
+		sum = (sum & 0xffff) + (sum >> 16);
+	iph->check = ~sum;
+
+	/* discard service, checksum left out */
+	udp->source = htobe16(9);
+	udp->dest = htobe16(9);
+	udp->len = htobe16(len - ETH_HLEN - sizeof(*iph));
+}
+
+/* Hand out frames from the source for every slot that's come due */
+static unsigned int source(struct emu *e, uint64_t now)
+{
+	uint64_t gap = 1000000 / emu_conf.rate;
+	struct xport_emu_stamp stamp;
+	struct libusb_transfer *x;
+	unsigned int n = 0;
+	int len;
+
+	if ( e->e_size != emu_conf.size )
+		frame_init(e);
+
+	if ( e->e_next_frame + EMU_BACKLOG < now )
+		e->e_next_frame = now - EMU_BACKLOG;
+
+	while ( e->e_next_frame + emu_conf.latency <= now ) {
+		if ( NULL == q_head(&e->e_src) )
+			break;
+
+		e->e_next_frame += (gap) ? gap : 1;
+		if ( emu_lose(e) ) {
+			e->e_rx_lost++;
+			continue;
+		}
+
+		x = q_pop(&e->e_src);
+		stamp.magic = XPORT_EMU_MAGIC;
+		stamp.seq = e->e_seq++;
+		stamp.ns = now_ns();
+		memcpy(e->e_frame + EMU_STAMP_OFF, &stamp, sizeof(stamp));
+		len = (x->length < (int)emu_conf.size) ?
+				x->length : (int)emu_conf.size;
+		memcpy(x->buffer, e->e_frame, len);
+		x->status = LIBUSB_TRANSFER_COMPLETED;
+		x->actual_length = len;
+		e->e_rx_pkts++;
+		x->callback(x);
+		n++;
+	}
+
+	return n;
+}
+
+static unsigned int emu_run(struct emu *e)
+{
+	uint64_t now = now_us();
+	struct libusb_transfer *x;
+	struct emu_ent *ent;
+	unsigned int n = 0, end;
+
+	/* not what callbacks queue up meanwhile, with no latency that
+	 * could go on forever
+	 */
+	end = e->e_done.tail;
+	while ( (ent = q_head(&e->e_done)) && ent->due <= now ) {
+		if ( e->e_done.head == end )
+			break;
+		x = q_pop(&e->e_done);
+		x->callback(x);
+		n++;
+	}
+
+	if ( emu_conf.rate )
+		n += source(e, now);
+
+	expire(e, &e->e_src, now);
+	expire(e, &e->e_at, now);
+	expire(e, &e->e_intr, now);
+	return n;
+}
+
+static uint64_t emu_next(struct emu *e)
+{
+	uint64_t next = 0, t;
+	struct emu_ent *ent;
+
+	ent = q_head(&e->e_done);
+	if ( ent )
+		next = ent->due;
+
+	if ( emu_conf.rate && q_head(&e->e_src) ) {
+		t = e->e_next_frame + emu_conf.latency;
+		if ( !next || t < next )
+			next = t;
+	}
+
+	t = q_deadline(&e->e_src);
+	if ( t && (!next || t < next) )
+		next = t;
+	t = q_deadline(&e->e_at);
+	if ( t && (!next || t < next) )
+		next = t;
+	t = q_deadline(&e->e_intr);
+	if ( t && (!next || t < next) )
+		next = t;
+
+	return next;
+}
+
+static void emu_run_batch(struct emu *e)
+{
+	if ( emu_run(e) )
+		usbio_flush(e->e_xport.x_usb);
+}
+
+static void emu_arm(struct emu *e);
+
+static void kick_read(struct iothread *t, struct nbio *n)
+{
+	struct emu_kick *k = (struct emu_kick *)n;
+	uint64_t cnt;
+
+	while ( read(n->fd, &cnt, sizeof(cnt)) == sizeof(cnt) )
+		/* do nothing */;
+
+	if ( k->k_emu ) {
+		k->k_emu->e_kicked = 0;
+		emu_run_batch(k->k_emu);
+		emu_arm(k->k_emu);
+	}
+
+	nbio_inactive(t, n, NBIO_READ|NBIO_ERROR);
+}
+
+/* Either the emulator let go of us or the iothread is going away */
+static void kick_dtor(struct iothread *t, struct nbio *n)
+{
+	struct emu_kick *k = (struct emu_kick *)n;
+	struct emu *e = k->k_emu;
+
+	if ( e ) {
+		nbio_timer_del(t, &e->e_timer);
+		e->e_kick = NULL;
+		e->e_io = NULL;
+	}
+
+	close(n->fd);
+	free(k);
+}
+
+static const struct nbio_ops kick_ops = {
+	.read = kick_read,
+	.write = kick_read,
+	.dtor = kick_dtor,
+};
+
+static void emu_detach(struct emu *e)
+{
+	struct emu_kick *k = e->e_kick;
+
+	if ( NULL == e->e_io )
+		return;
+
+	nbio_timer_del(e->e_io, &e->e_timer);
+	if ( k ) {
+		k->k_emu = NULL;
+		nbio_del(e->e_io, &k->k_io);
+		e->e_kick = NULL;
+	}
+	e->e_io = NULL;
+}
+
+/* Without the eventfd everything goes through the timer */
+static void emu_attach(struct emu *e, struct iothread *t)
+{
+	struct emu_kick *k;
+
+	e->e_io = t;
+	e->e_kicked = 0;
+
+	k = calloc(1, sizeof(*k));
+	if ( NULL == k )
+		return;
+
+	k->k_io.fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if ( k->k_io.fd < 0 ) {
+		free(k);
+		return;
+	}
+
+	k->k_io.ops = &kick_ops;
+	k->k_emu = e;
+	nbio_add(t, &k->k_io, NBIO_READ);
+	e->e_kick = k;
+}
+
+static void emu_kick(struct emu *e)
+{
+	uint64_t one = 1;
+
+	if ( e->e_kicked )
+		return;
+	if ( write(e->e_kick->k_io.fd, &one, sizeof(one)) == sizeof(one) )
+		e->e_kicked = 1;
+}
+
+static void emu_arm(struct emu *e)
+{
+	struct iothread *t = e->e_xport.x_usb->u_io;
+	uint64_t next, now;
+
+	if ( e->e_io != t ) {
+		emu_detach(e);
+		if ( t )
+			emu_attach(e, t);
+	}
+	if ( NULL == t )
+		return;
+
+	next = emu_next(e);
+	if ( !next ) {
+		nbio_timer_del(t, &e->e_timer);
+		return;
+	}
+
+	now = now_us();
+	if ( next <= now && e->e_kick ) {
+		nbio_timer_del(t, &e->e_timer);
+		emu_kick(e);
+		return;
+	}
+
+	nbio_timer_mod(t, &e->e_timer,
+			(next > now) ? (next - now + 999) / 1000 : 0);
+}
+
+static void emu_timer(struct iothread *t, struct nbio_timer *tm)
+{
+	struct emu *e = container_of(tm, struct emu, e_timer);
+
+	emu_run_batch(e);
+	emu_arm(e);
+}
+
+static int emu_submit(struct xport *xp, struct libusb_transfer *x)
+{
+	struct emu *e = (struct emu *)xp;
+	uint64_t now = now_us();
+	int ok = 1;
+
+	if ( !stick_present(e->e_idx) )
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	if ( x->type == LIBUSB_TRANSFER_TYPE_CONTROL ) {
+		ok = control(e, x);
+		goto out;
+	}
+
+	switch(x->endpoint) {
+	case EMU_EP_NOTIFY:
+		ok = q_push(&e->e_intr, x, deadline(x, now));
+		feed_notify(e);
+		break;
+	case EMU_EP_AT_OUT:
+		ok = complete(e, x, LIBUSB_TRANSFER_COMPLETED, x->length);
+		at_command(e, x->buffer, x->length);
+		break;
+	case EMU_EP_AT_IN:
+		ok = q_push(&e->e_at, x, deadline(x, now));
+		feed_at(e);
+		break;
+	case EMU_EP_DATA_OUT:
+		/* the sink always says it sent it */
+		if ( emu_lose(e) ) {
+			e->e_tx_lost++;
+		}else{
+			e->e_tx_pkts++;
+			if ( emu_sink_fn )
+				emu_sink_fn(emu_sink_priv, x->buffer,
+						x->length);
+		}
+		ok = complete(e, x, LIBUSB_TRANSFER_COMPLETED, x->length);
+		break;
+	case EMU_EP_DATA_IN:
+		if ( q_empty(&e->e_src) && e->e_next_frame < now )
+			e->e_next_frame = now;
+		ok = q_push(&e->e_src, x, deadline(x, now));
+		break;
+	case EMU_EP_ZEROCD:
+		/* the mass storage CBW which tells it to switch */
+		if ( x->length == 31 && !memcmp(x->buffer, "USBC", 4) )
+			emu_sticks[e->e_idx].ejected = 1;
+		ok = complete(e, x, LIBUSB_TRANSFER_COMPLETED, x->length);
+		break;
+	default:
+		ok = complete(e, x, LIBUSB_TRANSFER_STALL, 0);
+		break;
+	}
+
+out:
+	if ( !ok )
+		return LIBUSB_ERROR_BUSY;
+	emu_arm(e);
+	return LIBUSB_SUCCESS;
+}
+
+static int emu_cancel(struct xport *xp, struct libusb_transfer *x)
+{
+	struct emu *e = (struct emu *)xp;
+
+	if ( !q_remove(&e->e_src, x) &&
+			!q_remove(&e->e_at, x) &&
+			!q_remove(&e->e_intr, x) )
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	x->status = LIBUSB_TRANSFER_CANCELLED;
+	x->actual_length = 0;
+	q_push(&e->e_done, x, now_us());
+	emu_arm(e);
+	return LIBUSB_SUCCESS;
+}
+
+static int emu_events(struct xport *xp, struct timeval *tv, int *completed)
+{
+	struct emu *e = (struct emu *)xp;
+	uint64_t end = 0, next, now;
+	struct timespec ts;
+
+	if ( tv )
+		end = now_us() + tv->tv_sec * 1000000ULL + tv->tv_usec;
+
+	for(;;) {
+		if ( emu_run(e) && NULL == completed )
+			return 0;
+		if ( completed && *completed )
+			return 0;
+
+		next = emu_next(e);
+		now = now_us();
+		if ( end && (!next || next > end) )
+			next = end;
+		if ( !next )
+			return LIBUSB_ERROR_NOT_FOUND;
+		if ( end && now >= end )
+			return 0;
+		if ( next <= now )
+			continue;
+
+		ts.tv_sec = (next - now) / 1000000;
+		ts.tv_nsec = ((next - now) % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+	}
+}
+
+static int emu_get_desc(struct xport *xp,
+			struct libusb_device_descriptor *desc)
+{
+	struct emu *e = (struct emu *)xp;
+
+	if ( !xport_emu_present(e->e_idx, desc) )
+		return LIBUSB_ERROR_NO_DEVICE;
+	return 0;
+}
+
+static int emu_get_config(struct xport *xp,
+			struct libusb_config_descriptor **conf)
+{
+	struct emu *e = (struct emu *)xp;
+
+	if ( e->e_cfg != emu_config.bConfigurationValue )
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	*conf = &emu_config;
+	return 0;
+}
+
+static void emu_free_config(struct xport *xp,
+			struct libusb_config_descriptor *conf)
+{
+}
+
+static int emu_set_config(struct xport *xp, int cfg)
+{
+	struct emu *e = (struct emu *)xp;
+
+	if ( cfg != emu_config.bConfigurationValue )
+		return LIBUSB_ERROR_NOT_FOUND;
+	if ( e->e_claimed )
+		return LIBUSB_ERROR_BUSY;
+
+	e->e_cfg = cfg;
+	return 0;
+}
+
+static int emu_claim(struct xport *xp, int iface)
+{
+	struct emu *e = (struct emu *)xp;
+
+	if ( iface < 0 || iface >= EMU_NR_IFACE )
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	e->e_claimed |= (1U << iface);
+	return 0;
+}
+
+static int emu_release(struct xport *xp, int iface)
+{
+	struct emu *e = (struct emu *)xp;
+
+	if ( iface < 0 || iface >= EMU_NR_IFACE ||
+			!(e->e_claimed & (1U << iface)) )
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	e->e_claimed &= ~(1U << iface);
+	return 0;
+}
+
+static int emu_detach_kernel(struct xport *xp, int iface)
+{
+	return 0;
+}
+
+static int emu_reset(struct xport *xp)
+{
+	struct emu *e = (struct emu *)xp;
+	struct emu_stick *s = &emu_sticks[e->e_idx];
+
+	if ( !stick_present(e->e_idx) )
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	if ( s->ejected && !s->ready && emu_conf.zerocd ) {
+		s->ejected = 0;
+		s->back = now_us() + EMU_REENUM;
+	}
+
+	return 0;
+}
+
+static unsigned int emu_busnum(struct xport *xp)
+{
+	return XPORT_EMU_BUS;
+}
+
+static unsigned int emu_devnum(struct xport *xp)
+{
+	struct emu *e = (struct emu *)xp;
+	return e->e_idx + 1;
+}
+
+static void emu_close(struct xport *xp)
+{
+	struct emu *e = (struct emu *)xp;
+
+	emu_detach(e);
+	list_del(&e->e_list);
+
+	if ( (odw_stats || odw_verbose) &&
+			e->e_tx_pkts + e->e_tx_lost + e->e_rx_pkts + e->e_rx_lost ) {
+		printf("%s: emulator %u: sunk %"PRIu64" dropped %"PRIu64
+			", sourced %"PRIu64" dropped %"PRIu64"\n",
+			odw_cmd, e->e_idx, e->e_tx_pkts, e->e_tx_lost,
+			e->e_rx_pkts, e->e_rx_lost);
+	}
+
+	free(e);
+}
+
+static const struct xport_ops emu_ops = {
+	.submit = emu_submit,
+	.cancel = emu_cancel,
+	.events = emu_events,
+	.get_desc = emu_get_desc,
+	.get_config = emu_get_config,
+	.free_config = emu_free_config,
+	.set_config = emu_set_config,
+	.claim = emu_claim,
+	.release = emu_release,
+	.detach_kernel = emu_detach_kernel,
+	.reset = emu_reset,
+	.busnum = emu_busnum,
+	.devnum = emu_devnum,
+	.close = emu_close,
+	.name = "emulator",
+};
+
+struct xport *xport_emu_open(struct usbio *u, unsigned int idx)
+{
+	struct emu *e;
+
+	if ( idx >= emu_conf.nr || !stick_present(idx) )
+		return NULL;
+
+	e = calloc(1, sizeof(*e));
+	if ( NULL == e ) {
+		fprintf(stderr, "%s: calloc: %s\n", odw_cmd, os_err());
+		return NULL;
+	}
+
+	e->e_xport.x_ops = &emu_ops;
+	e->e_xport.x_usb = u;
+	e->e_idx = idx;
+	e->e_cfg = emu_config.bConfigurationValue;
+	e->e_rand = 0x9e3779b9U ^ idx;
+	nbio_timer_init(&e->e_timer, emu_timer);
+	frame_init(e);
+	list_add_tail(&e->e_list, &emu_list);
+	return &e->e_xport;
+}
+
+unsigned int xport_emu_count(void)
+{
+	return emu_conf.nr;
+}
+
+/* Returns 0 while it's away re-enumerating */
+int xport_emu_present(unsigned int idx, struct libusb_device_descriptor *desc)
+{
+	if ( idx >= emu_conf.nr || !stick_present(idx) )
+		return 0;
+
+	*desc = emu_desc;
+	if ( emu_conf.zerocd && !emu_sticks[idx].ready )
+		desc->idProduct = 0x1007;
+	return 1;
+}
+
+/* Nothing is armed for a source that's off, so wake them all up. Call
+ * from the thread the emulators are running on.
+ */
+void xport_emu_rate(unsigned int pps)
+{
+	struct emu *e;
+
+	emu_conf.rate = pps;
+	list_for_each_entry(e, &emu_list, e_list) {
+		e->e_next_frame = now_us();
+		emu_arm(e);
+	}
+}
+
+int xport_emu_size(unsigned int size)
+{
+	if ( size < EMU_FRAME_MIN || size > EMU_FRAME_MAX )
+		return 0;
+	emu_conf.size = size;
+	return 1;
+}
+
+void xport_emu_sink(xport_emu_sink_t fn, void *priv)
+{
+	emu_sink_fn = fn;
+	emu_sink_priv = priv;
+}
+
+int xport_emu_conf(const char *spec)
+{
+	char *str, *tok, *end, *save = NULL;
+	int ret = 0;
+
+	str = strdup(spec);
+	if ( NULL == str )
+		return 0;
+
+	tok = strtok_r(str, ",", &save);
+	if ( NULL == tok )
+		goto out;
+
+	emu_conf.nr = strtoul(tok, &end, 0);
+	if ( *end || emu_conf.nr > 255 )
+		goto out;
+
+	while ( (tok = strtok_r(NULL, ",", &save)) ) {
+		if ( !strncmp(tok, "rate=", 5) ) {
+			emu_conf.rate = strtoul(tok + 5, &end, 0);
+		}else if ( !strncmp(tok, "size=", 5) ) {
+			emu_conf.size = strtoul(tok + 5, &end, 0);
+			if ( emu_conf.size < EMU_FRAME_MIN ||
+					emu_conf.size > EMU_FRAME_MAX )
+				goto out;
+		}else if ( !strncmp(tok, "latency=", 8) ) {
+			emu_conf.latency = strtoul(tok + 8, &end, 0);
+		}else if ( !strcmp(tok, "zerocd") ) {
+			emu_conf.zerocd = 1;
+			end = tok + 6;
+		}else if ( !strncmp(tok, "loss=", 5) ) {
+			double pct = strtod(tok + 5, &end);
+			if ( pct < 0.0 || pct > 100.0 )
+				goto out;
+			emu_conf.loss = pct * 10000.0;
+		}else{
+			goto out;
+		}
+		if ( *end )
+			goto out;
+	}
+
+	ret = 1;
+out:
+	free(str);
+	return ret;
+}
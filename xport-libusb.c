@@ -0,0 +1,139 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * The real thing: a dongle on the end of a libusb device handle.
+*/
+
+#include <libusb-1.0/libusb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "compiler.h"
+#include "list.h"
+#include "nbio.h"
+#include "ondawagon.h"
+#include "pktpool.h"
+#include "usbio.h"
+#include "xport.h"
+
+static int usb_submit(struct xport *x, struct libusb_transfer *xfer)
+{
+	return libusb_submit_transfer(xfer);
+}
+
+static int usb_cancel(struct xport *x, struct libusb_transfer *xfer)
+{
+	return libusb_cancel_transfer(xfer);
+}
+
+static int usb_events(struct xport *x, struct timeval *tv, int *completed)
+{
+	libusb_context *ctx = x->x_usb->u_ctx;
+
+	if ( NULL == tv )
+		return libusb_handle_events_completed(ctx, completed);
+	return libusb_handle_events_timeout_completed(ctx, tv, completed);
+}
+
+static int usb_get_desc(struct xport *x, struct libusb_device_descriptor *desc)
+{
+	return libusb_get_device_descriptor(libusb_get_device(x->x_handle),
+						desc);
+}
+
+static int usb_get_config(struct xport *x,
+			struct libusb_config_descriptor **conf)
+{
+	return libusb_get_active_config_descriptor(
+					libusb_get_device(x->x_handle), conf);
+}
+
+static void usb_free_config(struct xport *x,
+			struct libusb_config_descriptor *conf)
+{
+	libusb_free_config_descriptor(conf);
+}
+
+static int usb_set_config(struct xport *x, int cfg)
+{
+	return libusb_set_configuration(x->x_handle, cfg);
+}
+
+static int usb_claim(struct xport *x, int iface)
+{
+	return libusb_claim_interface(x->x_handle, iface);
+}
+
+static int usb_release(struct xport *x, int iface)
+{
+	return libusb_release_interface(x->x_handle, iface);
+}
+
+static int usb_detach_kernel(struct xport *x, int iface)
+{
+	return libusb_detach_kernel_driver(x->x_handle, iface);
+}
+
+static int usb_reset(struct xport *x)
+{
+	return libusb_reset_device(x->x_handle);
+}
+
+static unsigned int usb_busnum(struct xport *x)
+{
+	return libusb_get_bus_number(libusb_get_device(x->x_handle));
+}
+
+static unsigned int usb_devnum(struct xport *x)
+{
+	return libusb_get_device_address(libusb_get_device(x->x_handle));
+}
+
+static void usb_close(struct xport *x)
+{
+	libusb_close(x->x_handle);
+	free(x);
+}
+
+static const struct xport_ops usb_ops = {
+	.submit = usb_submit,
+	.cancel = usb_cancel,
+	.events = usb_events,
+	.get_desc = usb_get_desc,
+	.get_config = usb_get_config,
+	.free_config = usb_free_config,
+	.set_config = usb_set_config,
+	.claim = usb_claim,
+	.release = usb_release,
+	.detach_kernel = usb_detach_kernel,
+	.reset = usb_reset,
+	.busnum = usb_busnum,
+	.devnum = usb_devnum,
+	.close = usb_close,
+	.name = "libusb",
+};
+
+struct xport *xport_libusb_open(struct usbio *u, libusb_device *dev)
+{
+	struct xport *x;
+
+	x = calloc(1, sizeof(*x));
+	if ( NULL == x ) {
+		fprintf(stderr, "%s: calloc: %s\n", odw_cmd, os_err());
+		return NULL;
+	}
+
+	if ( libusb_open(dev, &x->x_handle) ) {
+		fprintf(stderr, "%s: libusb_open: %s\n",
+			odw_cmd, os_err());
+		free(x);
+		return NULL;
+	}
+
+	x->x_ops = &usb_ops;
+	x->x_usb = u;
+	return x;
+}
@@ -0,0 +1,79 @@
+/*
+ * This file is part of ondawagon
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+*/
+#ifndef _XPORT_H
+#define _XPORT_H
+
+/* How a dongle gets at its USB device. Transfers are plain libusb
+ * transfers whichever transport is underneath, so completion handlers
+ * don't need to care, only submission and device control go through
+ * here. x_handle is NULL for transports which aren't libusb.
+ */
+struct xport;
+struct usbio;
+
+struct xport_ops {
+	int (*submit)(struct xport *x, struct libusb_transfer *xfer);
+	int (*cancel)(struct xport *x, struct libusb_transfer *xfer);
+	/* run completions without an eventloop, until *completed is
+	 * set if it's given, otherwise until tv runs out
+	 */
+	int (*events)(struct xport *x, struct timeval *tv, int *completed);
+
+	int (*get_desc)(struct xport *x,
+			struct libusb_device_descriptor *desc);
+	int (*get_config)(struct xport *x,
+			struct libusb_config_descriptor **conf);
+	void (*free_config)(struct xport *x,
+			struct libusb_config_descriptor *conf);
+	int (*set_config)(struct xport *x, int cfg);
+	int (*claim)(struct xport *x, int iface);
+	int (*release)(struct xport *x, int iface);
+	int (*detach_kernel)(struct xport *x, int iface);
+	int (*reset)(struct xport *x);
+	unsigned int (*busnum)(struct xport *x);
+	unsigned int (*devnum)(struct xport *x);
+	void (*close)(struct xport *x);
+	const char *name;
+};
+
+struct xport {
+	const struct xport_ops	*x_ops;
+	libusb_device_handle	*x_handle;
+	struct usbio		*x_usb;
+};
+
+/* No real USB bus is numbered zero, emulated dongles live there */
+#define XPORT_EMU_BUS	0
+
+/* xport-libusb.c */
+_private struct xport *xport_libusb_open(struct usbio *u, libusb_device *dev);
+
+/* Emulated source frames carry this straight after their UDP header,
+ * stamped as they leave the modem. It never leaves the host so it's
+ * in host byte order.
+ */
+#define XPORT_EMU_MAGIC		0x4f445742U
+struct xport_emu_stamp {
+	uint32_t	magic;
+	uint32_t	seq;
+	uint64_t	ns;	/* CLOCK_MONOTONIC */
+};
+
+/* Called with every frame the emulated modem sends on to the network */
+typedef void (*xport_emu_sink_t)(void *priv, const uint8_t *frame,
+				size_t len);
+
+/* xport-emu.c */
+_private int xport_emu_conf(const char *spec);
+_private unsigned int xport_emu_count(void);
+_private struct xport *xport_emu_open(struct usbio *u, unsigned int idx);
+_private int xport_emu_present(unsigned int idx,
+				struct libusb_device_descriptor *desc);
+_private void xport_emu_rate(unsigned int pps);
+_private int xport_emu_size(unsigned int size);
+_private void xport_emu_sink(xport_emu_sink_t fn, void *priv);
+
+#endif /* _XPORT_H */